@@ -7,10 +7,40 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+/* linux/fs.h, pulled in by io_uring.h, has a BLOCK_SIZE of its own */
+#undef BLOCK_SIZE
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <math.h>
+#include <endian.h>
+#include <stddef.h>
+#if defined(__AVX2__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef USE_GFDB
+#include <sqlite3.h>
+#endif
 
 
 #define MAX_VALUE 0xFF
 #define BLOCK_SIZE 1024
+#define STR_TAB "        "
 
 typedef unsigned char uchar_t;
 typedef signed char schar_t;
@@ -30,39 +60,479 @@ typedef enum log_level {
         log_info = 0
 }log_level_t;
 
+/*
+ * Salvage and filter runs over a corrupt query file can raise millions of
+ * diagnostics, and a vasprintf plus a stdio write for each one stalls the
+ * decode loop. Instead log_it formats into a thread local buffer and hands
+ * the line to a writer thread through a bounded lock free queue (Vyukov's
+ * sequence numbered ring, many producers and the one consumer). The writer
+ * sleeps on a futex and drains the queue with writev, errors to fd 2 and
+ * info to fd 1. When the queue is full the message is dropped and counted
+ * rather than blocking the caller; the count is reported at exit.
+ *
+ * Every LOG_IT call site owns a static gfdb_log_site_t, which lets only
+ * GFDB_LOG_SITE_BURST messages through per GFDB_LOG_SITE_WINDOW seconds and
+ * reports how many it held back once the window rolls over (or at exit).
+ *
+ * LOG_AT carries the offset of the offending record. With --log-format kv
+ * every line becomes key=value pairs so the offsets can be grepped out:
+ *
+ *      level=error src=file.c:123 func=fn offset=4096 msg="..."
+ */
+#define GFDB_LOG_SLOTS                  4096
+#define GFDB_LOG_SLOT_SIZE              512
+#define GFDB_LOG_LINE_MAX               8192
+#define GFDB_LOG_WRITE_BATCH            64
+#define GFDB_LOG_SITE_BURST             10
+#define GFDB_LOG_SITE_WINDOW            1
+#define GFDB_LOG_IDLE_MS                100
+#define GFDB_LOG_FLUSH_MS               2000
+#define GFDB_LOG_NO_OFFSET              (-1LL)
+
+typedef enum gfdb_log_format {
+        GFDB_LOG_FORMAT_TEXT = 0,
+        GFDB_LOG_FORMAT_KV
+} gfdb_log_format_t;
+
+typedef struct gfdb_log_site {
+        long long                       window;
+        unsigned int                    count;
+        unsigned int                    suppressed;
+        int                             registered;
+        log_level_t                     log_level;
+        const char                      *file_name;
+        const char                      *function;
+        int                             line;
+        struct gfdb_log_site            *next;
+} gfdb_log_site_t;
+
+typedef struct gfdb_log_slot {
+        unsigned long long              seq;
+        int                             fd;
+        int                             len;
+        char                            msg[GFDB_LOG_SLOT_SIZE];
+} gfdb_log_slot_t;
+
+typedef struct gfdb_log_queue {
+        /* producers and the consumer each get their own cache line */
+        unsigned long long              enqueue_pos
+                                        __attribute__ ((aligned (64)));
+        unsigned long long              dequeue_pos
+                                        __attribute__ ((aligned (64)));
+        unsigned long long              written;
+        unsigned int                    pending
+                                        __attribute__ ((aligned (64)));
+        unsigned int                    sleeping;
+        unsigned long long              dropped;
+        int                             started;
+        gfdb_log_site_t                 *sites;
+        gfdb_log_slot_t                 slots[GFDB_LOG_SLOTS];
+} gfdb_log_queue_t;
+
+static gfdb_log_queue_t         gfdb_log_queue;
+static pthread_once_t           gfdb_log_once = PTHREAD_ONCE_INIT;
+static gfdb_log_format_t        gfdb_log_format = GFDB_LOG_FORMAT_TEXT;
+static __thread char            gfdb_log_message[GFDB_LOG_LINE_MAX];
+static __thread char            gfdb_log_line[GFDB_LOG_LINE_MAX];
+
+
+static void
+gfdb_log_write_all (int fd, const char *buf, size_t len)
+{
+        ssize_t written = 0;
+
+        /* Nowhere left to report a failure, so just give up on it */
+        while (len > 0) {
+                written = write (fd, buf, len);
+                if (written < 0 && errno == EINTR)
+                        continue;
+                if (written <= 0)
+                        return;
+                buf += written;
+                len -= written;
+        }
+}
+
+
+static void *
+gfdb_log_writer (void *arg)
+{
+        gfdb_log_queue_t *queue = arg;
+        gfdb_log_slot_t *slot = NULL;
+        struct iovec iov[GFDB_LOG_WRITE_BATCH];
+        struct timespec timeout = {0};
+        unsigned long long pos = 0;
+        unsigned int seen = 0;
+        int count = 0;
+        int fd = -1;
+        int i = 0;
+
+        timeout.tv_sec = GFDB_LOG_IDLE_MS / 1000;
+        timeout.tv_nsec = (GFDB_LOG_IDLE_MS % 1000) * 1000000L;
+
+        for (;;) {
+                seen = __atomic_load_n (&queue->pending, __ATOMIC_ACQUIRE);
+
+                /* Gather the ready slots going to the same fd */
+                pos = queue->dequeue_pos;
+                count = 0;
+                while (count < GFDB_LOG_WRITE_BATCH) {
+                        slot = &queue->slots[(pos + count) %
+                                             GFDB_LOG_SLOTS];
+                        if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE)
+                            != pos + count + 1)
+                                break;
+                        if (count > 0 && slot->fd != fd)
+                                break;
+                        fd = slot->fd;
+                        iov[count].iov_base = slot->msg;
+                        iov[count].iov_len = slot->len;
+                        count++;
+                }
+
+                if (count > 0) {
+                        if (writev (fd, iov, count) < 0) {
+                                for (i = 0; i < count; i++)
+                                        gfdb_log_write_all (fd,
+                                                iov[i].iov_base,
+                                                iov[i].iov_len);
+                        }
+                        for (i = 0; i < count; i++) {
+                                slot = &queue->slots[(pos + i) %
+                                                     GFDB_LOG_SLOTS];
+                                __atomic_store_n (&slot->seq,
+                                                  pos + i + GFDB_LOG_SLOTS,
+                                                  __ATOMIC_RELEASE);
+                        }
+                        queue->dequeue_pos = pos + count;
+                        __atomic_add_fetch (&queue->written, count,
+                                            __ATOMIC_RELEASE);
+                        continue;
+                }
+
+                /* Nothing ready: sleep until a producer bumps pending */
+                __atomic_store_n (&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n (&queue->pending, __ATOMIC_SEQ_CST)
+                    == seen)
+                        syscall (SYS_futex, &queue->pending,
+                                 FUTEX_WAIT_PRIVATE, seen, &timeout,
+                                 NULL, 0);
+                __atomic_store_n (&queue->sleeping, 0, __ATOMIC_SEQ_CST);
+        }
+
+        return NULL;
+}
+
+
+static void
+gfdb_log_wake (gfdb_log_queue_t *queue)
+{
+        __atomic_add_fetch (&queue->pending, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&queue->sleeping, __ATOMIC_SEQ_CST))
+                syscall (SYS_futex, &queue->pending, FUTEX_WAKE_PRIVATE,
+                         1, NULL, NULL, 0);
+}
+
+
+/* Wait, for a bounded time, until the writer has caught up with every
+ * message queued so far */
+static void
+gfdb_log_flush (void)
+{
+        gfdb_log_queue_t *queue = &gfdb_log_queue;
+        unsigned long long target = 0;
+        struct timespec pause = {0, 1000000L};
+        int waited = 0;
+
+        if (!__atomic_load_n (&queue->started, __ATOMIC_ACQUIRE))
+                return;
+
+        target = __atomic_load_n (&queue->enqueue_pos, __ATOMIC_ACQUIRE);
+        gfdb_log_wake (queue);
+        while (__atomic_load_n (&queue->written, __ATOMIC_ACQUIRE) < target
+               && waited++ < GFDB_LOG_FLUSH_MS)
+                nanosleep (&pause, NULL);
+}
+
+
+/* Queue one formatted line, returns -1 if the queue is full */
+static int
+gfdb_log_enqueue (int fd, const char *msg, int len)
+{
+        gfdb_log_queue_t *queue = &gfdb_log_queue;
+        gfdb_log_slot_t *slot = NULL;
+        unsigned long long pos = 0;
+        unsigned long long seq = 0;
+        long long diff = 0;
+
+        pos = __atomic_load_n (&queue->enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                slot = &queue->slots[pos % GFDB_LOG_SLOTS];
+                seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+                diff = (long long)(seq - pos);
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n (&queue->enqueue_pos,
+                                        &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        __atomic_add_fetch (&queue->dropped, 1,
+                                            __ATOMIC_RELAXED);
+                        return -1;
+                } else {
+                        pos = __atomic_load_n (&queue->enqueue_pos,
+                                               __ATOMIC_RELAXED);
+                }
+        }
+
+        slot->fd = fd;
+        slot->len = len;
+        memcpy (slot->msg, msg, len);
+        __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        gfdb_log_wake (queue);
+        return 0;
+}
+
+
+/* Format one line into the thread local line buffer */
+static int
+gfdb_log_format_line (log_level_t log_level, const char *file_name,
+                      const char *function, int line, long long offset,
+                      const char *message)
+{
+        char *out = gfdb_log_line;
+        size_t size = sizeof (gfdb_log_line);
+        size_t len = 0;
+        const char *c = NULL;
+
+        if (gfdb_log_format == GFDB_LOG_FORMAT_TEXT) {
+                if (offset == GFDB_LOG_NO_OFFSET)
+                        len = snprintf (out, size, "%d %s %s : %s\n",
+                                        line, file_name, function, message);
+                else
+                        len = snprintf (out, size,
+                                        "%d %s %s : %s (offset %lld)\n",
+                                        line, file_name, function, message,
+                                        offset);
+                goto out;
+        }
+
+        len = snprintf (out, size, "level=%s src=%s:%d func=%s ",
+                        (log_level == log_error) ? "error" : "info",
+                        file_name, line, function);
+        if (offset != GFDB_LOG_NO_OFFSET && len < size)
+                len += snprintf (out + len, size - len, "offset=%lld ",
+                                 offset);
+
+        /* msg is quoted, so escape quotes, backslashes and newlines */
+        if (len < size)
+                len += snprintf (out + len, size - len, "msg=\"");
+        for (c = message; *c && len + 4 < size; c++) {
+                if (*c == '"' || *c == '\\') {
+                        out[len++] = '\\';
+                        out[len++] = *c;
+                } else if (*c == '\n') {
+                        out[len++] = '\\';
+                        out[len++] = 'n';
+                } else {
+                        out[len++] = *c;
+                }
+        }
+        if (len + 2 < size) {
+                out[len++] = '"';
+                out[len++] = '\n';
+                out[len] = '\0';
+        }
+out:
+        if (len >= size) {
+                len = size - 1;
+                out[len - 1] = '\n';
+        }
+        return len;
+}
+
+
+static void
+gfdb_log_emit (log_level_t log_level, const char *file_name,
+               const char *function, int line, long long offset,
+               const char *message)
+{
+        int fd = (log_level == log_error) ? 2 : 1;
+        int len = 0;
+
+        len = gfdb_log_format_line (log_level, file_name, function, line,
+                                    offset, message);
+
+        if (__atomic_load_n (&gfdb_log_queue.started, __ATOMIC_ACQUIRE)
+            && len <= GFDB_LOG_SLOT_SIZE) {
+                gfdb_log_enqueue (fd, gfdb_log_line, len);
+                return;
+        }
+
+        /* Too long for a slot (usage, say), or no writer thread: keep the
+         * order by draining the queue first and write it out here */
+        gfdb_log_flush ();
+        gfdb_log_write_all (fd, gfdb_log_line, len);
+}
+
+
+static void
+gfdb_log_report_suppressed (gfdb_log_site_t *site, unsigned int suppressed)
+{
+        snprintf (gfdb_log_message, sizeof (gfdb_log_message),
+                  "%u similar messages suppressed", suppressed);
+        gfdb_log_emit (site->log_level, site->file_name, site->function,
+                       site->line, GFDB_LOG_NO_OFFSET, gfdb_log_message);
+}
+
+
+/* Report what the rate limiting and a full queue held back, and let the
+ * writer finish before the process goes away */
+static void
+gfdb_log_shutdown (void)
+{
+        gfdb_log_site_t *site = NULL;
+        unsigned int suppressed = 0;
+        unsigned long long dropped = 0;
+
+        site = __atomic_load_n (&gfdb_log_queue.sites, __ATOMIC_ACQUIRE);
+        for (; site; site = site->next) {
+                suppressed = __atomic_exchange_n (&site->suppressed, 0,
+                                                  __ATOMIC_RELAXED);
+                if (suppressed)
+                        gfdb_log_report_suppressed (site, suppressed);
+        }
+
+        gfdb_log_flush ();
+
+        dropped = __atomic_load_n (&gfdb_log_queue.dropped, __ATOMIC_RELAXED);
+        if (dropped) {
+                snprintf (gfdb_log_message, sizeof (gfdb_log_message),
+                          "%llu messages dropped, log queue was full",
+                          dropped);
+                __atomic_store_n (&gfdb_log_queue.started, 0,
+                                  __ATOMIC_RELEASE);
+                gfdb_log_emit (log_error, __FILE__, __FUNCTION__, __LINE__,
+                               GFDB_LOG_NO_OFFSET, gfdb_log_message);
+        }
+}
+
+
+static void
+gfdb_log_start (void)
+{
+        gfdb_log_queue_t *queue = &gfdb_log_queue;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int i = 0;
+
+        for (i = 0; i < GFDB_LOG_SLOTS; i++)
+                queue->slots[i].seq = i;
+
+        /* Without a writer thread every message is written synchronously */
+        if (pthread_attr_init (&attr))
+                return;
+        pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create (&thread, &attr, gfdb_log_writer, queue) == 0) {
+                __atomic_store_n (&queue->started, 1, __ATOMIC_RELEASE);
+                atexit (gfdb_log_shutdown);
+        }
+        pthread_attr_destroy (&attr);
+}
+
+
+/* Returns _true if the call site has used up its burst for this window */
+static int
+gfdb_log_site_limited (gfdb_log_site_t *site, log_level_t log_level,
+                       const char *file_name, const char *function, int line)
+{
+        gfdb_log_site_t *head = NULL;
+        long long now = 0;
+        long long window = 0;
+        unsigned int suppressed = 0;
+        struct timespec ts = {0};
+
+        clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+        now = ts.tv_sec;
+
+        window = __atomic_load_n (&site->window, __ATOMIC_RELAXED);
+        if (now - window >= GFDB_LOG_SITE_WINDOW &&
+            __atomic_compare_exchange_n (&site->window, &window, now, 0,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
+                __atomic_store_n (&site->count, 0, __ATOMIC_RELAXED);
+                suppressed = __atomic_exchange_n (&site->suppressed, 0,
+                                                  __ATOMIC_RELAXED);
+                if (suppressed)
+                        gfdb_log_report_suppressed (site, suppressed);
+        }
+
+        if (__atomic_fetch_add (&site->count, 1, __ATOMIC_RELAXED) <
+            GFDB_LOG_SITE_BURST)
+                return 0;
+
+        __atomic_add_fetch (&site->suppressed, 1, __ATOMIC_RELAXED);
+
+        /* Remember the site so what it held back is reported at exit */
+        if (__atomic_exchange_n (&site->registered, 1, __ATOMIC_ACQ_REL))
+                return 1;
+        site->log_level = log_level;
+        site->file_name = file_name;
+        site->function = function;
+        site->line = line;
+        head = __atomic_load_n (&gfdb_log_queue.sites, __ATOMIC_RELAXED);
+        do {
+                site->next = head;
+        } while (!__atomic_compare_exchange_n (&gfdb_log_queue.sites, &head,
+                                               site, 1, __ATOMIC_RELEASE,
+                                               __ATOMIC_RELAXED));
+        return 1;
+}
+
 
 /* Function used for logging */
-void
-log_it (log_level_t     log_level,
-        const char       *file_name,
-        const char       *function,
+void __attribute__ ((format (printf, 7, 8)))
+log_it (gfdb_log_site_t *site,
+        log_level_t     log_level,
+        const char      *file_name,
+        const char      *function,
         int             line,
+        long long       offset,
         const char      *fmt, ...)
 {
-        FILE *stream = NULL;
         va_list arg_list;
-        char *message = NULL;
 
-        if (log_level == -1)
-                stream = stderr;
-        else if (log_level == 0)
-                stream = stdout;
+        pthread_once (&gfdb_log_once, gfdb_log_start);
+
+        if (site && gfdb_log_site_limited (site, log_level, file_name,
+                                           function, line))
+                return;
 
         /* form the message */
         va_start (arg_list, fmt);
-        vasprintf (&message, fmt, arg_list);
+        vsnprintf (gfdb_log_message, sizeof (gfdb_log_message), fmt,
+                   arg_list);
         va_end (arg_list);
 
-        fprintf (stream, "%d %s %s : %s\n", line, file_name, function, message);
-
-        free (message);
+        gfdb_log_emit (log_level, file_name, function, line, offset,
+                       gfdb_log_message);
 }
 
 
 /* Macro used for logging */
 #define LOG_IT(log_level, fmt...)\
 do {\
-        log_it (log_level, __FILE__, __FUNCTION__, __LINE__, ##fmt);\
+        static gfdb_log_site_t __gfdb_log_site;\
+        log_it (&__gfdb_log_site, log_level, __FILE__, __FUNCTION__,\
+                __LINE__, GFDB_LOG_NO_OFFSET, ##fmt);\
+} while(0)
+
+/* Same, for a message about the record at offset */
+#define LOG_AT(log_level, offset, fmt...)\
+do {\
+        static gfdb_log_site_t __gfdb_log_site;\
+        log_it (&__gfdb_log_site, log_level, __FILE__, __FUNCTION__,\
+                __LINE__, (long long)(offset), ##fmt);\
 } while(0)
 /******************************************************************************
 
@@ -171,6 +641,77 @@ void uuid_unpack(const uuid_t in, struct uuid *uu)
 	memcpy(uu->node, ptr, 6);
 }
 
+void uuid_pack(const struct uuid *uu, uuid_t ptr)
+{
+	uint32_t	tmp;
+	unsigned char	*out = ptr;
+
+	tmp = uu->time_low;
+	out[3] = (unsigned char) tmp;
+	tmp >>= 8;
+	out[2] = (unsigned char) tmp;
+	tmp >>= 8;
+	out[1] = (unsigned char) tmp;
+	tmp >>= 8;
+	out[0] = (unsigned char) tmp;
+
+	tmp = uu->time_mid;
+	out[5] = (unsigned char) tmp;
+	tmp >>= 8;
+	out[4] = (unsigned char) tmp;
+
+	tmp = uu->time_hi_and_version;
+	out[7] = (unsigned char) tmp;
+	tmp >>= 8;
+	out[6] = (unsigned char) tmp;
+
+	tmp = uu->clock_seq;
+	out[9] = (unsigned char) tmp;
+	tmp >>= 8;
+	out[8] = (unsigned char) tmp;
+
+	memcpy(out+10, uu->node, 6);
+}
+
+int gf_uuid_parse(const char *in, uuid_t uu)
+{
+	struct uuid	uuid;
+	int 		i;
+	const char	*cp;
+	char		buf[3];
+
+	if (strlen(in) != 36)
+		return -1;
+	for (i=0, cp = in; i <= 36; i++,cp++) {
+		if ((i == 8) || (i == 13) || (i == 18) ||
+		    (i == 23)) {
+			if (*cp == '-')
+				continue;
+			else
+				return -1;
+		}
+		if (i== 36)
+			if (*cp == 0)
+				continue;
+		if (!isxdigit(*cp))
+			return -1;
+	}
+	uuid.time_low = strtoul(in, NULL, 16);
+	uuid.time_mid = strtoul(in+9, NULL, 16);
+	uuid.time_hi_and_version = strtoul(in+14, NULL, 16);
+	uuid.clock_seq = strtoul(in+19, NULL, 16);
+	cp = in+24;
+	buf[2] = 0;
+	for (i=0; i < 6; i++) {
+		buf[0] = *cp++;
+		buf[1] = *cp++;
+		uuid.node[i] = strtoul(buf, NULL, 16);
+	}
+
+	uuid_pack(&uuid, uu);
+	return 0;
+}
+
 static const char *fmt_lower =
 	"%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x";
 
@@ -235,7 +776,8 @@ void gf_uuid_unparse(const uuid_t uu, char *out)
 /*Structure to hold the link information*/
 typedef struct gfdb_link_info {
         uuid_t                          pargfid;
-        char                            file_name[GF_NAME_MAX];
+        /* Names are up to GF_NAME_MAX bytes, plus the NUL */
+        char                            file_name[GF_NAME_MAX + 1];
         struct list_head                list;
 } gfdb_link_info_t;
 
@@ -362,6 +904,11 @@ gfdb_add_link_to_query_record (gfdb_query_record_t      *query_record,
 
         gf_uuid_copy (link_info->pargfid, pgfid);
         base_name_len = strlen (base_name);
+        if (base_name_len > GF_NAME_MAX) {
+                LOG_IT (log_error, "Basename of %d bytes is too long",
+                        base_name_len);
+                goto out;
+        }
         memcpy (link_info->file_name, base_name, base_name_len);
         link_info->file_name[base_name_len] = '\0';
 
@@ -387,7 +934,7 @@ gfdb_query_record_free(gfdb_query_record_t *query_record)
 {
         if (query_record) {
                 gfdb_free_link_info_list (query_record);
-                if (query_record) { (query_record); }
+                free (query_record);
         }
 }
 
@@ -437,6 +984,17 @@ gfdb_query_record_free(gfdb_query_record_t *query_record)
 #define GFDB_QUERY_RECORD_FOOTER 0xBAADF00D
 #define UUID_LEN                 16
 
+/* Smallest valid serialized record : GFID, link count and footer */
+#define GFDB_QUERY_RECORD_MIN_LEN       (UUID_LEN + 2 * sizeof (int32_t))
+
+/* Largest serialized link : PGFID, name length and a GF_NAME_MAX name */
+#define GFDB_QUERY_LINK_MAX_LEN         (UUID_LEN + sizeof (int32_t) + \
+                                         GF_NAME_MAX)
+
+/* A length prefix above this is taken as corruption rather than a record
+ * to buffer, it leaves room for some 240k links of the longest names */
+#define GFDB_QUERY_RECORD_MAX_LEN       (64 * 1024 * 1024)
+
 static boolean_t
 is_serialized_buffer_valid (char *in_buffer, int buffer_length) {
         boolean_t       ret        = _false;
@@ -526,6 +1084,14 @@ gfdb_query_record_deserialize (char *in_buffer,
                 memcpy (&base_name_len, buffer, sizeof (int32_t));
                 buffer += sizeof (int32_t);
                 count += sizeof (int32_t);
+                if (base_name_len < 0 || base_name_len > GF_NAME_MAX ||
+                    base_name_len > buffer_length - count) {
+                        LOG_IT (log_error, "Invalid serialized "
+                                "query record");
+                        gfdb_link_info_free (link_info);
+                        ret = -1;
+                        goto out;
+                }
 
                 /* READ basename */
                 memcpy (link_info->file_name, buffer, base_name_len);
@@ -553,6 +1119,80 @@ out:
 
 
 
+/* Returns the length of the serialized form of the query record */
+static int
+gfdb_query_record_serialized_length (gfdb_query_record_t *query_record)
+{
+        int len                         = 0;
+        gfdb_link_info_t *link_info     = NULL;
+
+        /* GFID, link count and footer */
+        len = UUID_LEN + 2 * sizeof (int32_t);
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                len += UUID_LEN + sizeof (int32_t) +
+                       strlen (link_info->file_name);
+        }
+
+        return len;
+}
+
+
+/* Serializes the query record into out_buffer, which should be atleast
+ * gfdb_query_record_serialized_length () bytes long.
+ * Returns the length of the serialized query record.
+ * */
+static int
+gfdb_query_record_serialize (gfdb_query_record_t *query_record,
+                             char *out_buffer)
+{
+        int ret                                 = -1;
+        char *buffer                            = NULL;
+        char *link_count_ptr                    = NULL;
+        gfdb_link_info_t *link_info             = NULL;
+        int link_count                          = 0;
+        int base_name_len                       = 0;
+        int footer                              = GFDB_QUERY_RECORD_FOOTER;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, query_record, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, out_buffer, out);
+
+        buffer = out_buffer;
+
+        /* Write GFID */
+        memcpy (buffer, query_record->gfid, UUID_LEN);
+        buffer += UUID_LEN;
+
+        /* Link count is filled once all the links are written */
+        link_count_ptr = buffer;
+        buffer += sizeof (int32_t);
+
+        /* Write all the links */
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                memcpy (buffer, link_info->pargfid, UUID_LEN);
+                buffer += UUID_LEN;
+
+                base_name_len = strlen (link_info->file_name);
+                memcpy (buffer, &base_name_len, sizeof (int32_t));
+                buffer += sizeof (int32_t);
+
+                memcpy (buffer, link_info->file_name, base_name_len);
+                buffer += base_name_len;
+
+                link_count++;
+        }
+        memcpy (link_count_ptr, &link_count, sizeof (int32_t));
+
+        /* Write the footer */
+        memcpy (buffer, &footer, sizeof (int32_t));
+        buffer += sizeof (int32_t);
+
+        ret = buffer - out_buffer;
+out:
+        return ret;
+}
+
+
 /* Function to read query record from file.
  * Allocates memory to query record and
  * returns length of serialized query record when successful
@@ -586,6 +1226,15 @@ gfdb_read_query_record (int fd,
                 goto out;
         }
 
+        /* A corrupt length must not size the allocation */
+        if (buffer_len < (int)GFDB_QUERY_RECORD_MIN_LEN ||
+            buffer_len > GFDB_QUERY_RECORD_MAX_LEN) {
+                LOG_IT (log_error, "Invalid record length %d, corrupted "
+                        "query file", buffer_len);
+                ret = -1;
+                goto out;
+        }
+
         /* Allocating memory to the serialization buffer */
         buffer = calloc (1, buffer_len);
         if (!buffer) {
@@ -633,76 +1282,8578 @@ out:
 
 
 /******************************************************************************
- * 
- *                      Main ()
- * 
+                        THROTTLING
+*******************************************************************************/
+/******************************************************************************
+ The reader runs on live storage nodes, where reading a query file at full
+ speed competes with the clients of the brick. Every loop reading records
+ off a query file reports each record to gfdb_throttle_account (), which:
+
+ - charges the record to token buckets of bytes and of records per second
+   (--max-read-rate, --max-record-rate). The buckets hold GFDB_THROTTLE_BURST_MS
+   worth of tokens, and a record finding its bucket in debt sleeps until the
+   debt is paid back.
+
+ - with --adaptive <depth>, samples the stat file of the block device
+   holding the query file every GFDB_ADAPTIVE_SAMPLE_MS. The average queue
+   depth over the interval is the growth of the weighted time in queue
+   (11th field, in ms) divided by the time elapsed. While it is above
+   <depth> the reader backs off, with sleeps doubling up to
+   GFDB_ADAPTIVE_MAX_BACKOFF_MS.
+
+ --ioprio and --sched-idle lower the I/O and CPU priority of the reader, so
+ the kernel only gives it what others leave.
+
+ The throttle is process wide, like the log format, as the read loops it
+ paces sit far below the configuration.
  * ****************************************************************************/
 
-#define STR_TAB "        "
+#define GFDB_THROTTLE_BURST_MS          100
+#define GFDB_ADAPTIVE_SAMPLE_MS         100
+#define GFDB_ADAPTIVE_MIN_BACKOFF_MS    10
+#define GFDB_ADAPTIVE_MAX_BACKOFF_MS    1000
+/* Field of /sys/block/<dev>/stat, counted from 0 */
+#define GFDB_DISKSTAT_TIME_IN_QUEUE     10
+
+/* linux/ioprio.h is not installed everywhere */
+#define GFDB_IOPRIO_WHO_PROCESS         1
+#define GFDB_IOPRIO_CLASS_SHIFT         13
+#define GFDB_IOPRIO_CLASS_BE            2
+#define GFDB_IOPRIO_CLASS_IDLE          3
+#define GFDB_IOPRIO_BE_LEVELS           8
+
+typedef struct gfdb_token_bucket {
+        /* Tokens per second, 0 when not limited */
+        double                          rate;
+        double                          burst;
+        double                          tokens;
+        int64_t                         last_ns;
+} gfdb_token_bucket_t;
+
+typedef struct gfdb_throttle {
+        boolean_t                       enabled;
+        gfdb_token_bucket_t             bytes;
+        gfdb_token_bucket_t             records;
+        /* Adaptive back off, stat_fd is -1 when off */
+        int                             stat_fd;
+        double                          max_queue_depth;
+        uint64_t                        last_time_in_queue;
+        int64_t                         last_sample_ns;
+} gfdb_throttle_t;
+
+static gfdb_throttle_t gfdb_throttle = { .stat_fd = -1 };
+
+
+static inline int64_t
+gfdb_throttle_now_ns (void)
+{
+        struct timespec ts = {0};
 
-void
-usage(){
-        LOG_IT (log_error, "Usage : gfdb_query_file_reader <query_file_path>");
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 
-int
-main ( int argc, char *argv[] ) {
+static void
+gfdb_throttle_sleep_ns (int64_t ns)
+{
+        struct timespec ts = {0};
 
-        int ret                                 = -1;
-        struct stat stat_buff                   = {0};
-        char *query_file_path                   = NULL;
-        int query_fd                            = -1;
-        gfdb_query_record_t *query_record       = NULL;
-        char uuid_str[100]                      ="";
-        gfdb_link_info_t *link_info             = NULL;
+        ts.tv_sec = ns / 1000000000LL;
+        ts.tv_nsec = ns % 1000000000LL;
+        while (nanosleep (&ts, &ts) && errno == EINTR)
+                ;
+}
 
-        if (argc != 2) {
-                usage();
-                goto out;
+
+static void
+gfdb_token_bucket_init (gfdb_token_bucket_t *bucket, uint64_t rate)
+{
+        bucket->rate = rate;
+        bucket->burst = (double)rate * GFDB_THROTTLE_BURST_MS / 1000;
+        if (bucket->burst < 1)
+                bucket->burst = 1;
+        bucket->tokens = bucket->burst;
+        bucket->last_ns = gfdb_throttle_now_ns ();
+}
+
+
+/* Takes count tokens, returns how long to sleep to pay back the debt */
+static int64_t
+gfdb_token_bucket_take (gfdb_token_bucket_t *bucket, double count,
+                        int64_t now_ns)
+{
+        if (bucket->rate == 0)
+                return 0;
+
+        bucket->tokens += bucket->rate * (now_ns - bucket->last_ns) / 1e9;
+        if (bucket->tokens > bucket->burst)
+                bucket->tokens = bucket->burst;
+        bucket->last_ns = now_ns;
+
+        bucket->tokens -= count;
+        if (bucket->tokens >= 0)
+                return 0;
+
+        return (int64_t)(-bucket->tokens / bucket->rate * 1e9);
+}
+
+
+/* Reads the weighted time in queue of the device, in ms */
+static int
+gfdb_throttle_time_in_queue (int stat_fd, uint64_t *time_in_queue)
+{
+        char buffer[512] = "";
+        ssize_t len = 0;
+        char *field = NULL;
+        char *end = NULL;
+        int i = 0;
+
+        len = pread (stat_fd, buffer, sizeof (buffer) - 1, 0);
+        if (len <= 0)
+                return -1;
+        buffer[len] = '\0';
+
+        field = buffer;
+        for (i = 0; i <= GFDB_DISKSTAT_TIME_IN_QUEUE; i++) {
+                errno = 0;
+                *time_in_queue = strtoull (field, &end, 10);
+                if (errno || end == field)
+                        return -1;
+                field = end;
+        }
+
+        return 0;
+}
+
+
+/* Sleeps, longer and longer, while the device queue is deeper than asked */
+static void
+gfdb_throttle_backoff (gfdb_throttle_t *throttle, int64_t now_ns)
+{
+        uint64_t time_in_queue = 0;
+        double queue_depth = 0;
+        int64_t backoff_ms = 0;
+
+        for (;;) {
+                if (gfdb_throttle_time_in_queue (throttle->stat_fd,
+                                                 &time_in_queue))
+                        return;
+
+                queue_depth = (double)(time_in_queue -
+                                       throttle->last_time_in_queue) * 1e6 /
+                              (now_ns - throttle->last_sample_ns);
+                throttle->last_time_in_queue = time_in_queue;
+                throttle->last_sample_ns = now_ns;
+
+                if (queue_depth <= throttle->max_queue_depth)
+                        return;
+
+                backoff_ms = backoff_ms ? backoff_ms * 2 :
+                             GFDB_ADAPTIVE_MIN_BACKOFF_MS;
+                if (backoff_ms > GFDB_ADAPTIVE_MAX_BACKOFF_MS)
+                        backoff_ms = GFDB_ADAPTIVE_MAX_BACKOFF_MS;
+                gfdb_throttle_sleep_ns (backoff_ms * 1000000LL);
+                now_ns = gfdb_throttle_now_ns ();
         }
+}
 
-	query_file_path = argv[1];
 
-        ret = stat (query_file_path, &stat_buff);
-        if (ret) {
-                LOG_IT (log_error, "%s query file doesnt exist : %s",
-                          query_file_path, strerror (errno));
+/* Paces the read loops, called for every record read off a query file */
+static inline void
+gfdb_throttle_account (size_t bytes, size_t records)
+{
+        gfdb_throttle_t *throttle = &gfdb_throttle;
+        int64_t now_ns = 0;
+        int64_t wait_ns = 0;
+        int64_t record_wait_ns = 0;
+
+        if (!throttle->enabled)
+                return;
+
+        now_ns = gfdb_throttle_now_ns ();
+        wait_ns = gfdb_token_bucket_take (&throttle->bytes, bytes, now_ns);
+        record_wait_ns = gfdb_token_bucket_take (&throttle->records,
+                                                 records, now_ns);
+        if (record_wait_ns > wait_ns)
+                wait_ns = record_wait_ns;
+        if (wait_ns > 0) {
+                gfdb_throttle_sleep_ns (wait_ns);
+                now_ns += wait_ns;
+        }
+
+        if (throttle->stat_fd >= 0 && now_ns - throttle->last_sample_ns >=
+            GFDB_ADAPTIVE_SAMPLE_MS * 1000000LL)
+                gfdb_throttle_backoff (throttle, now_ns);
+}
+
+
+/* Limits, 0 for none, of the bytes and records read per second */
+void
+gfdb_throttle_set_rates (uint64_t read_rate, uint64_t record_rate)
+{
+        gfdb_token_bucket_init (&gfdb_throttle.bytes, read_rate);
+        gfdb_token_bucket_init (&gfdb_throttle.records, record_rate);
+        if (read_rate || record_rate)
+                gfdb_throttle.enabled = _true;
+}
+
+
+/* Backs off while the device holding the query file has a queue deeper
+ * than max_queue_depth */
+int
+gfdb_throttle_watch_device (int query_fd, uint64_t max_queue_depth)
+{
+        int ret = -1;
+        struct stat stat_buff = {0};
+        char stat_path[PATH_MAX] = "";
+        int stat_fd = -1;
+
+        if (fstat (query_fd, &stat_buff)) {
+                LOG_IT (log_error, "Failed to stat query file : %s",
+                        strerror (errno));
                 goto out;
         }
 
-        query_fd = open (query_file_path, O_RDONLY);
-        if (query_fd < 0) {
-                LOG_IT (log_error, "Failed to open %s", query_file_path);
+        /* Partitions have a stat file of their own */
+        snprintf (stat_path, sizeof (stat_path), "/sys/dev/block/%u:%u/stat",
+                  major (stat_buff.st_dev), minor (stat_buff.st_dev));
+        stat_fd = open (stat_path, O_RDONLY | O_CLOEXEC);
+        if (stat_fd < 0) {
+                LOG_IT (log_error, "No block device statistics for the "
+                        "query file (%s), --adaptive needs a query file on "
+                        "a block device", stat_path);
                 goto out;
         }
 
-        while((ret = gfdb_read_query_record
-                        (query_fd, &query_record)) != 0) {
+        gfdb_throttle.stat_fd = stat_fd;
+        gfdb_throttle.max_queue_depth = max_queue_depth;
+        gfdb_throttle.last_sample_ns = gfdb_throttle_now_ns ();
+        if (gfdb_throttle_time_in_queue (stat_fd,
+                                         &gfdb_throttle.last_time_in_queue)) {
+                LOG_IT (log_error, "Failed to parse %s", stat_path);
+                gfdb_throttle.stat_fd = -1;
+                goto out;
+        }
+        stat_fd = -1;
+        gfdb_throttle.enabled = _true;
 
-                if (ret < 0 && !query_record) {
-                         LOG_IT (log_error,"Failed to fetch query record "
-                                "from query file");
-                        goto out;
-                }
+        ret = 0;
+out:
+        if (stat_fd >= 0)
+                close (stat_fd);
+        return ret;
+}
 
-                gf_uuid_unparse (query_record->gfid, uuid_str);
-                printf("GFID : %s\n", uuid_str);
 
-                list_for_each_entry (link_info, &query_record->link_list,
-                                    list) {
-                        
-                        gf_uuid_unparse (link_info->pargfid, uuid_str);
-                        printf("%sPGFID : %s, BASE_NAME: %s \n", STR_TAB,
-                                uuid_str, link_info->file_name);
-                }
+/* Lowers the I/O priority to ioprio_class (and level, for best effort) and
+ * the CPU one to SCHED_IDLE. Done before any thread is started, so that
+ * they all inherit it. */
+int
+gfdb_throttle_set_priority (int ioprio_class, int ioprio_level,
+                            boolean_t sched_idle)
+{
+        struct sched_param param = {0};
+
+        if (ioprio_class &&
+            syscall (SYS_ioprio_set, GFDB_IOPRIO_WHO_PROCESS, 0,
+                     (ioprio_class << GFDB_IOPRIO_CLASS_SHIFT) |
+                     ioprio_level)) {
+                LOG_IT (log_error, "Failed to set the I/O priority : %s",
+                        strerror (errno));
+                return -1;
+        }
 
-                free (query_record);
-                query_record = NULL;
-                
+        if (sched_idle && sched_setscheduler (0, SCHED_IDLE, &param)) {
+                LOG_IT (log_error, "Failed to switch to SCHED_IDLE : %s",
+                        strerror (errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+                SCANNING SERIALIZED RECORDS WITHOUT DECODING
+*******************************************************************************/
+/******************************************************************************
+ The scanner reads the query file in large chunks and hands out the
+ serialized records in place, by following the length prefix of each record.
+ Nothing is allocated or decoded per record, which suits passes that only
+ need a few fields (the GFID is the first 16 bytes of every record) or only
+ a few of the records.
+ * ****************************************************************************/
+
+#define GFDB_SCAN_BUFFER_SIZE           (4 * 1024 * 1024)
+
+typedef struct gfdb_record_scanner {
+        int                             fd;
+        char                            *buffer;
+        size_t                          buffer_size;
+        size_t                          data_start;
+        size_t                          data_end;
+        /* File offset of the next record, i.e. of buffer[data_start] */
+        off_t                           offset;
+} gfdb_record_scanner_t;
+
+
+int
+gfdb_query_file_version (int fd);
+
+int
+gfdb_record_scanner_init (gfdb_record_scanner_t *scanner, int fd)
+{
+        int ret = -1;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, scanner, out);
+
+        /* Raw records only exist in legacy query files */
+        if (gfdb_query_file_version (fd) != 1) {
+                LOG_IT (log_error, "Only legacy (version 1) query files "
+                        "can be scanned, rewrite it with --write-version 1");
+                goto out;
+        }
+
+        memset (scanner, 0, sizeof (*scanner));
+        scanner->fd = fd;
+        scanner->buffer_size = GFDB_SCAN_BUFFER_SIZE;
+        scanner->buffer = malloc (scanner->buffer_size);
+        if (!scanner->buffer) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "scan buffer");
+                goto out;
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+void
+gfdb_record_scanner_cleanup (gfdb_record_scanner_t *scanner)
+{
+        if (scanner) {
+                free (scanner->buffer);
+                scanner->buffer = NULL;
+        }
+}
+
+
+/* Makes atleast len bytes available from data_start.
+ * Returns 1 when they are, 0 on EOF before them and -1 on failure.
+ * */
+static int
+gfdb_record_scanner_fill (gfdb_record_scanner_t *scanner, size_t len)
+{
+        ssize_t ret             = 0;
+        char *new_buffer        = NULL;
+        size_t pending          = 0;
+        size_t new_size         = 0;
+
+        while (scanner->data_end - scanner->data_start < len) {
+                pending = scanner->data_end - scanner->data_start;
+
+                if (scanner->data_start > 0) {
+                        memmove (scanner->buffer,
+                                 scanner->buffer + scanner->data_start,
+                                 pending);
+                        scanner->data_start = 0;
+                        scanner->data_end = pending;
+                }
+
+                if (len > scanner->buffer_size) {
+                        new_size = scanner->buffer_size;
+                        while (new_size < len)
+                                new_size <<= 1;
+                        new_buffer = realloc (scanner->buffer, new_size);
+                        if (!new_buffer) {
+                                LOG_IT (log_error, "Memory allocation "
+                                        "failed for scan buffer");
+                                return -1;
+                        }
+                        scanner->buffer = new_buffer;
+                        scanner->buffer_size = new_size;
+                }
+
+                ret = read (scanner->fd, scanner->buffer + scanner->data_end,
+                            scanner->buffer_size - scanner->data_end);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_IT (log_error, "Failed reading query file : %s",
+                                strerror (errno));
+                        return -1;
+                }
+                if (ret == 0)
+                        return 0;
+
+                scanner->data_end += ret;
+        }
+
+        return 1;
+}
+
+
+/* Hands out the next serialized record, without the length prefix.
+ * *record points into the scan buffer and stays valid till the next call.
+ * Returns 1 for a record, 0 on EOF and -1 on failure or corruption.
+ * */
+int
+gfdb_record_scanner_next (gfdb_record_scanner_t *scanner, char **record,
+                          int *record_len)
+{
+        int ret                 = -1;
+        int32_t buffer_len      = 0;
+
+        ret = gfdb_record_scanner_fill (scanner, sizeof (int32_t));
+        if (ret <= 0) {
+                /* A few stray bytes at the end are a truncated record */
+                if (ret == 0 && scanner->data_end != scanner->data_start) {
+                        LOG_AT (log_error, scanner->offset,
+                                "Truncated record");
+                        ret = -1;
+                }
+                goto out;
+        }
+
+        memcpy (&buffer_len, scanner->buffer + scanner->data_start,
+                sizeof (int32_t));
+        if (buffer_len < (int32_t)GFDB_QUERY_RECORD_MIN_LEN ||
+            buffer_len > GFDB_QUERY_RECORD_MAX_LEN) {
+                LOG_AT (log_error, scanner->offset, "Invalid record length "
+                        "%d, corrupted query file", buffer_len);
+                ret = -1;
+                goto out;
+        }
+
+        ret = gfdb_record_scanner_fill (scanner,
+                                        sizeof (int32_t) + buffer_len);
+        if (ret <= 0) {
+                if (ret == 0) {
+                        LOG_AT (log_error, scanner->offset,
+                                "Truncated record");
+                        ret = -1;
+                }
+                goto out;
+        }
+
+        *record = scanner->buffer + scanner->data_start + sizeof (int32_t);
+        *record_len = buffer_len;
+
+        if (!is_serialized_buffer_valid (*record, buffer_len)) {
+                LOG_AT (log_error, scanner->offset, "Invalid serialized "
+                        "query record");
+                ret = -1;
+                goto out;
+        }
+
+        scanner->data_start += sizeof (int32_t) + buffer_len;
+        scanner->offset += sizeof (int32_t) + buffer_len;
+        gfdb_throttle_account (sizeof (int32_t) + buffer_len, 1);
+        ret = 1;
+out:
+        return ret;
+}
+
+
+/******************************************************************************
+                        READER CONFIGURATION
+*******************************************************************************/
+
+typedef enum gfdb_reader_mode {
+        GFDB_READER_MODE_DUMP = 0,
+        GFDB_READER_MODE_GROUP_BY_PGFID,
+        GFDB_READER_MODE_SERVE,
+        GFDB_READER_MODE_WRITE,
+        GFDB_READER_MODE_BLOOM_BUILD,
+        GFDB_READER_MODE_BLOOM_CHECK,
+        GFDB_READER_MODE_ARROW,
+        GFDB_READER_MODE_INDEX_BUILD,
+        GFDB_READER_MODE_INDEX_LOOKUP
+} gfdb_reader_mode_t;
+
+/*Format of the records printed by the dump mode*/
+typedef enum gfdb_output_format {
+        GFDB_OUTPUT_FORMAT_TEXT = 0,
+        GFDB_OUTPUT_FORMAT_JSON,
+        GFDB_OUTPUT_FORMAT_NUL,
+        GFDB_OUTPUT_FORMAT_BINARY
+} gfdb_output_format_t;
+
+/*Query run on the gfdb, as the tier daemon does*/
+typedef enum gfdb_query_type {
+        GFDB_QUERY_ALL = 0,
+        GFDB_QUERY_CHANGED,
+        GFDB_QUERY_UNCHANGED
+} gfdb_query_type_t;
+
+/*Structure to hold the command line options*/
+typedef struct gfdb_reader_conf {
+        gfdb_reader_mode_t              mode;
+        char                            *query_file_path;
+        size_t                          group_budget;
+        boolean_t                       follow;
+        char                            *done_marker_path;
+        char                            *serve_socket_path;
+        size_t                          ring_size;
+        char                            *attach_socket_path;
+        char                            *write_query_file_path;
+        char                            *gfdb_path;
+        gfdb_query_type_t               query_type;
+        int64_t                         query_time_usec;
+        int64_t                         write_freq;
+        int64_t                         read_freq;
+        char                            *bloom_path;
+        double                          bloom_fpr;
+        size_t                          sample_count;
+        uint64_t                        sample_seed;
+        /* Format of the query file written by -w */
+        int                             write_version;
+        char                            *arrow_path;
+        /* With -w, only the records still live on this brick */
+        char                            *brick_path;
+        int                             check_threads;
+        char                            *checkpoint_path;
+        int                             checkpoint_interval;
+        boolean_t                       resume;
+        gfdb_output_format_t            output_format;
+        char                            *index_path;
+        /* Look the keys up among the parents rather than the GFIDs */
+        boolean_t                       by_pgfid;
+        /* Throttling, 0 when not limited */
+        size_t                          max_read_rate;
+        size_t                          max_record_rate;
+        size_t                          adaptive_depth;
+        int                             ioprio_class;
+        int                             ioprio_level;
+        boolean_t                       sched_idle;
+        /* Positional arguments, query files or GFIDs */
+        char                            **args;
+        int                             arg_count;
+} gfdb_reader_conf_t;
+
+/* Callback invoked for every query record read from the query file.
+ * The record is owned by the caller and freed once the callback returns.
+ * A non zero return stops the read loop.
+ * */
+typedef int (*gfdb_query_record_cbk_t) (gfdb_query_record_t *query_record,
+                                        void *data);
+
+int
+gfdb_process_query_file (int query_fd, const gfdb_reader_conf_t *conf,
+                         gfdb_query_record_cbk_t cbk, void *data);
+
+
+/******************************************************************************
+                VERSION 2 QUERY FILE FORMAT
+*******************************************************************************/
+/******************************************************************************
+ The legacy format has no file header, host endian int lengths and only the
+ record footer for validation. Version 2 adds a file header, fixed little
+ endian fields, and groups the records into blocks that are each checked by
+ a CRC32C and can be decoded on their own. A block directory at the end of
+ the file, found through a fixed size trailer, gives the offset of every
+ block. Readers tell the formats apart by the file magic, which a legacy
+ file can not start with short of a 1.5 GB first record.
+
+   +------------------------------------------------------------------+
+   | FILE HEADER | BLOCK | BLOCK | ..... | BLOCK DIRECTORY | TRAILER  |
+   +------------------------------------------------------------------+
+
+   FILE HEADER (32 B)
+   +---------------------------------------------------------------+
+   | MAGIC "GFDBQRY2" | VERSION | HEADER LENGTH | BLOCK SIZE | 0.. |
+   +---------------------------------------------------------------+
+          8 B            4 B          4 B           4 B      12 B
+
+   BLOCK
+   +---------------------------------------------------------------+
+   | BLOCK MAGIC | CRC32C | PAYLOAD LENGTH | RECORD COUNT | PAYLOAD |
+   +---------------------------------------------------------------+
+        4 B        4 B         8 B              8 B
+   CRC32C is that of the PAYLOAD, which is RECORD COUNT records of
+   +-------------------------------------------------------------+
+   | RECORD LENGTH | GFID | LINK COUNT | <LINK INFO> | .....      |
+   +-------------------------------------------------------------+
+          4 B        16 B      4 B
+   RECORD LENGTH counts the bytes after it. Each <LINK INFO> is
+   +-----------------------------------------------+
+   | PGFID | BASE_NAME_LENGTH |      BASE_NAME      |
+   +-----------------------------------------------+
+     16 B          4 B          BASE_NAME_LENGTH
+
+   BLOCK DIRECTORY
+   +----------------------------------------------------------+
+   | DIR MAGIC | CRC32C | BLOCK COUNT | <DIR ENTRY> | .....    |
+   +----------------------------------------------------------+
+       4 B       4 B        8 B
+   CRC32C is that of the <DIR ENTRY>s, each of which is
+   +---------------------------------------------------------+
+   | BLOCK OFFSET | PAYLOAD LENGTH | RECORD COUNT | FIRST RECORD |
+   +---------------------------------------------------------+
+         8 B            8 B              8 B            8 B
+
+   TRAILER (24 B, the last bytes of the file)
+   +------------------------------------------------------+
+   | DIRECTORY OFFSET | RECORD COUNT | END MAGIC "GFDBEND2" |
+   +------------------------------------------------------+
+           8 B              8 B              8 B
+
+ Offsets, payload lengths and counts are 64 bit. The lengths inside a record
+ stay 32 bit unsigned, a record being bounded by its links and names.
+ * ****************************************************************************/
+
+#define GFDB_V2_MAGIC                   "GFDBQRY2"
+#define GFDB_V2_END_MAGIC               "GFDBEND2"
+#define GFDB_V2_MAGIC_LEN               8
+#define GFDB_V2_VERSION                 2
+#define GFDB_V2_HEADER_LEN              32
+#define GFDB_V2_BLOCK_MAGIC             0x4B4C4247      /* "GBLK" */
+#define GFDB_V2_DIR_MAGIC               0x52494447      /* "GDIR" */
+#define GFDB_V2_BLOCK_HEADER_LEN        24
+#define GFDB_V2_DIR_HEADER_LEN          16
+#define GFDB_V2_DIR_ENTRY_LEN           32
+#define GFDB_V2_TRAILER_LEN             24
+#define GFDB_V2_BLOCK_SIZE              (1024 * 1024)
+
+/*Directory entry of a block*/
+typedef struct gfdb_v2_dir_entry {
+        uint64_t                        offset;
+        uint64_t                        payload_len;
+        uint64_t                        record_count;
+        uint64_t                        first_record;
+} gfdb_v2_dir_entry_t;
+
+/*State of a version 2 query file being written*/
+typedef struct gfdb_v2_writer {
+        int                             fd;
+        /* Block header followed by the payload being filled */
+        char                            *block;
+        size_t                          block_size;
+        size_t                          block_used;
+        uint64_t                        block_records;
+        uint64_t                        offset;
+        uint64_t                        record_count;
+        gfdb_v2_dir_entry_t             *dir;
+        size_t                          dir_count;
+        size_t                          dir_size;
+} gfdb_v2_writer_t;
+
+
+static inline void
+gfdb_put_le32 (char *buf, uint32_t val)
+{
+        val = htole32 (val);
+        memcpy (buf, &val, sizeof (val));
+}
+
+
+static inline void
+gfdb_put_le64 (char *buf, uint64_t val)
+{
+        val = htole64 (val);
+        memcpy (buf, &val, sizeof (val));
+}
+
+
+static inline uint32_t
+gfdb_get_le32 (const char *buf)
+{
+        uint32_t val = 0;
+
+        memcpy (&val, buf, sizeof (val));
+        return le32toh (val);
+}
+
+
+static inline uint64_t
+gfdb_get_le64 (const char *buf)
+{
+        uint64_t val = 0;
+
+        memcpy (&val, buf, sizeof (val));
+        return le64toh (val);
+}
+
+
+/* Writes all of buf, retrying short writes */
+static int
+gfdb_write_full (int fd, const char *buf, size_t len)
+{
+        ssize_t ret     = 0;
+        size_t written  = 0;
+
+        while (written < len) {
+                ret = write (fd, buf + written, len - written);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_IT (log_error, "Failed writing query file : %s",
+                                strerror (errno));
+                        return -1;
+                }
+                written += ret;
+        }
+
+        return 0;
+}
+
+
+/* Reads all of len bytes at offset, a short read is an error */
+static int
+gfdb_pread_full (int fd, char *buf, size_t len, off_t offset)
+{
+        ssize_t ret     = 0;
+        size_t done     = 0;
+
+        while (done < len) {
+                ret = pread (fd, buf + done, len - done, offset + done);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_IT (log_error, "Failed reading query file : %s",
+                                strerror (errno));
+                        return -1;
+                }
+                if (ret == 0) {
+                        LOG_AT (log_error, offset + done, "Unexpected end "
+                                "of query file");
+                        return -1;
+                }
+                done += ret;
+        }
+
+        return 0;
+}
+
+
+/* CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the cpu has
+ * it and a table otherwise. */
+#define GFDB_CRC32C_POLY                0x82F63B78
+
+static uint32_t gfdb_crc32c_table[256];
+static pthread_once_t gfdb_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+gfdb_crc32c_init_table (void)
+{
+        uint32_t crc    = 0;
+        int i           = 0;
+        int j           = 0;
+
+        for (i = 0; i < 256; i++) {
+                crc = i;
+                for (j = 0; j < 8; j++)
+                        crc = (crc >> 1) ^ ((crc & 1) ? GFDB_CRC32C_POLY : 0);
+                gfdb_crc32c_table[i] = crc;
+        }
+}
+
+
+static uint32_t
+gfdb_crc32c_sw (uint32_t crc, const unsigned char *buf, size_t len)
+{
+        pthread_once (&gfdb_crc32c_once, gfdb_crc32c_init_table);
+
+        while (len--)
+                crc = gfdb_crc32c_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+        return crc;
+}
+
+
+#if defined(__x86_64__)
+__attribute__ ((target ("sse4.2")))
+static uint32_t
+gfdb_crc32c_hw (uint32_t crc, const unsigned char *buf, size_t len)
+{
+        uint64_t crc64  = crc;
+        uint64_t word   = 0;
+
+        while (len >= sizeof (uint64_t)) {
+                memcpy (&word, buf, sizeof (word));
+                crc64 = _mm_crc32_u64 (crc64, word);
+                buf += sizeof (word);
+                len -= sizeof (word);
+        }
+
+        crc = (uint32_t)crc64;
+        while (len--)
+                crc = _mm_crc32_u8 (crc, *buf++);
+
+        return crc;
+}
+#endif
+
+
+uint32_t
+gfdb_crc32c (const void *buf, size_t len)
+{
+        uint32_t crc = 0xFFFFFFFF;
+
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports ("sse4.2"))
+                crc = gfdb_crc32c_hw (crc, buf, len);
+        else
+#endif
+                crc = gfdb_crc32c_sw (crc, buf, len);
+
+        return ~crc;
+}
+
+
+/* Returns the version of the query file open on fd, 1 for legacy files */
+int
+gfdb_query_file_version (int fd)
+{
+        char magic[GFDB_V2_MAGIC_LEN] = {0};
+
+        if (pread (fd, magic, sizeof (magic), 0) == sizeof (magic) &&
+            memcmp (magic, GFDB_V2_MAGIC, GFDB_V2_MAGIC_LEN) == 0)
+                return GFDB_V2_VERSION;
+
+        return 1;
+}
+
+
+static size_t
+gfdb_v2_record_length (gfdb_query_record_t *query_record)
+{
+        size_t len                      = 0;
+        gfdb_link_info_t *link_info     = NULL;
+
+        /* Record length, GFID and link count */
+        len = sizeof (uint32_t) + UUID_LEN + sizeof (uint32_t);
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                len += UUID_LEN + sizeof (uint32_t) +
+                       strlen (link_info->file_name);
+        }
+
+        return len;
+}
+
+
+/* Encodes the query record at out_buffer, returns the encoded length */
+static size_t
+gfdb_v2_record_serialize (gfdb_query_record_t *query_record,
+                          char *out_buffer)
+{
+        char *buffer                    = out_buffer;
+        char *link_count_ptr            = NULL;
+        gfdb_link_info_t *link_info     = NULL;
+        uint32_t link_count             = 0;
+        uint32_t base_name_len          = 0;
+
+        /* Record length is filled at the end */
+        buffer += sizeof (uint32_t);
+
+        memcpy (buffer, query_record->gfid, UUID_LEN);
+        buffer += UUID_LEN;
+
+        link_count_ptr = buffer;
+        buffer += sizeof (uint32_t);
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                memcpy (buffer, link_info->pargfid, UUID_LEN);
+                buffer += UUID_LEN;
+
+                base_name_len = strlen (link_info->file_name);
+                gfdb_put_le32 (buffer, base_name_len);
+                buffer += sizeof (uint32_t);
+
+                memcpy (buffer, link_info->file_name, base_name_len);
+                buffer += base_name_len;
+
+                link_count++;
+        }
+
+        gfdb_put_le32 (link_count_ptr, link_count);
+        gfdb_put_le32 (out_buffer, buffer - out_buffer - sizeof (uint32_t));
+
+        return buffer - out_buffer;
+}
+
+
+/* Decodes the record body (after RECORD LENGTH) of buffer_length bytes */
+static int
+gfdb_v2_record_deserialize (const char *buffer, uint32_t buffer_length,
+                            gfdb_query_record_t **query_record)
+{
+        int ret                                 = -1;
+        const char *end                         = buffer + buffer_length;
+        gfdb_query_record_t *ret_qrecord        = NULL;
+        uint32_t link_count                     = 0;
+        uint32_t base_name_len                  = 0;
+        uint32_t i                              = 0;
+        uuid_t pgfid                            = {0};
+        char base_name[GF_NAME_MAX + 1]         = "";
+
+        if (buffer_length < UUID_LEN + sizeof (uint32_t)) {
+                LOG_IT (log_error, "Invalid serialized query record");
+                goto out;
+        }
+
+        ret_qrecord = gfdb_query_record_new ();
+        if (!ret_qrecord)
+                goto out;
+
+        memcpy (ret_qrecord->gfid, buffer, UUID_LEN);
+        buffer += UUID_LEN;
+
+        link_count = gfdb_get_le32 (buffer);
+        buffer += sizeof (uint32_t);
+
+        for (i = 0; i < link_count; i++) {
+                if (end - buffer < (ptrdiff_t)(UUID_LEN + sizeof (uint32_t)))
+                        goto corrupt;
+                memcpy (pgfid, buffer, UUID_LEN);
+                buffer += UUID_LEN;
+
+                base_name_len = gfdb_get_le32 (buffer);
+                buffer += sizeof (uint32_t);
+                if (base_name_len > GF_NAME_MAX ||
+                    end - buffer < (ptrdiff_t)base_name_len)
+                        goto corrupt;
+
+                memcpy (base_name, buffer, base_name_len);
+                base_name[base_name_len] = '\0';
+                buffer += base_name_len;
+
+                if (gfdb_add_link_to_query_record (ret_qrecord, pgfid,
+                                                   base_name))
+                        goto out;
+        }
+
+        if (buffer != end)
+                goto corrupt;
+
+        ret = 0;
+        goto out;
+corrupt:
+        LOG_IT (log_error, "Invalid serialized query record");
+out:
+        if (ret) {
+                gfdb_query_record_free (ret_qrecord);
+                ret_qrecord = NULL;
+        }
+        *query_record = ret_qrecord;
+        return ret;
+}
+
+
+/* Writes the file header and gets ready for the first block */
+int
+gfdb_v2_writer_init (gfdb_v2_writer_t *writer, int fd)
+{
+        int ret                                 = -1;
+        char header[GFDB_V2_HEADER_LEN]         = {0};
+
+        memset (writer, 0, sizeof (*writer));
+        writer->fd = fd;
+
+        writer->block_size = GFDB_V2_BLOCK_HEADER_LEN + GFDB_V2_BLOCK_SIZE;
+        writer->block = malloc (writer->block_size);
+        if (!writer->block) {
+                LOG_IT (log_error, "Memory allocation failed for block "
+                        "buffer");
+                goto out;
+        }
+        writer->block_used = GFDB_V2_BLOCK_HEADER_LEN;
+
+        memcpy (header, GFDB_V2_MAGIC, GFDB_V2_MAGIC_LEN);
+        gfdb_put_le32 (header + 8, GFDB_V2_VERSION);
+        gfdb_put_le32 (header + 12, GFDB_V2_HEADER_LEN);
+        gfdb_put_le32 (header + 16, GFDB_V2_BLOCK_SIZE);
+
+        if (gfdb_write_full (fd, header, sizeof (header)))
+                goto out;
+        writer->offset = GFDB_V2_HEADER_LEN;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Seals the current block with its header and CRC and writes it out */
+static int
+gfdb_v2_writer_flush_block (gfdb_v2_writer_t *writer)
+{
+        int ret                         = -1;
+        gfdb_v2_dir_entry_t *new_dir    = NULL;
+        gfdb_v2_dir_entry_t *entry      = NULL;
+        uint64_t payload_len            = 0;
+
+        if (writer->block_records == 0)
+                return 0;
+
+        if (writer->dir_count == writer->dir_size) {
+                writer->dir_size = writer->dir_size ?
+                                   writer->dir_size << 1 : 64;
+                new_dir = realloc (writer->dir,
+                                   writer->dir_size * sizeof (*new_dir));
+                if (!new_dir) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "block directory");
+                        goto out;
+                }
+                writer->dir = new_dir;
+        }
+
+        payload_len = writer->block_used - GFDB_V2_BLOCK_HEADER_LEN;
+        gfdb_put_le32 (writer->block, GFDB_V2_BLOCK_MAGIC);
+        gfdb_put_le32 (writer->block + 4, gfdb_crc32c (writer->block +
+                                GFDB_V2_BLOCK_HEADER_LEN, payload_len));
+        gfdb_put_le64 (writer->block + 8, payload_len);
+        gfdb_put_le64 (writer->block + 16, writer->block_records);
+
+        if (gfdb_write_full (writer->fd, writer->block, writer->block_used))
+                goto out;
+
+        entry = &writer->dir[writer->dir_count++];
+        entry->offset = writer->offset;
+        entry->payload_len = payload_len;
+        entry->record_count = writer->block_records;
+        entry->first_record = writer->record_count;
+
+        writer->offset += writer->block_used;
+        writer->record_count += writer->block_records;
+        writer->block_used = GFDB_V2_BLOCK_HEADER_LEN;
+        writer->block_records = 0;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+int
+gfdb_v2_write_query_record (gfdb_v2_writer_t *writer,
+                            gfdb_query_record_t *query_record)
+{
+        int ret                 = -1;
+        size_t len              = 0;
+        size_t needed           = 0;
+        char *new_block         = NULL;
+
+        len = gfdb_v2_record_length (query_record);
+        if (writer->block_used + len > writer->block_size) {
+                if (gfdb_v2_writer_flush_block (writer))
+                        goto out;
+        }
+
+        /* A record bigger than a whole block gets a block of its own */
+        needed = GFDB_V2_BLOCK_HEADER_LEN + len;
+        if (needed > writer->block_size) {
+                new_block = realloc (writer->block, needed);
+                if (!new_block) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "block buffer");
+                        goto out;
+                }
+                writer->block = new_block;
+                writer->block_size = needed;
+        }
+
+        writer->block_used += gfdb_v2_record_serialize (query_record,
+                                writer->block + writer->block_used);
+        writer->block_records++;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Writes the last block, the block directory and the trailer */
+int
+gfdb_v2_writer_finish (gfdb_v2_writer_t *writer)
+{
+        int ret                                 = -1;
+        char *dir                               = NULL;
+        size_t dir_len                          = 0;
+        size_t i                                = 0;
+        char *entry                             = NULL;
+        char trailer[GFDB_V2_TRAILER_LEN]       = {0};
+
+        if (gfdb_v2_writer_flush_block (writer))
+                goto out;
+
+        dir_len = GFDB_V2_DIR_HEADER_LEN +
+                  writer->dir_count * GFDB_V2_DIR_ENTRY_LEN;
+        dir = malloc (dir_len);
+        if (!dir) {
+                LOG_IT (log_error, "Memory allocation failed for block "
+                        "directory");
+                goto out;
+        }
+
+        for (i = 0; i < writer->dir_count; i++) {
+                entry = dir + GFDB_V2_DIR_HEADER_LEN +
+                        i * GFDB_V2_DIR_ENTRY_LEN;
+                gfdb_put_le64 (entry, writer->dir[i].offset);
+                gfdb_put_le64 (entry + 8, writer->dir[i].payload_len);
+                gfdb_put_le64 (entry + 16, writer->dir[i].record_count);
+                gfdb_put_le64 (entry + 24, writer->dir[i].first_record);
+        }
+        gfdb_put_le32 (dir, GFDB_V2_DIR_MAGIC);
+        gfdb_put_le32 (dir + 4, gfdb_crc32c (dir + GFDB_V2_DIR_HEADER_LEN,
+                                dir_len - GFDB_V2_DIR_HEADER_LEN));
+        gfdb_put_le64 (dir + 8, writer->dir_count);
+
+        gfdb_put_le64 (trailer, writer->offset);
+        gfdb_put_le64 (trailer + 8, writer->record_count);
+        memcpy (trailer + 16, GFDB_V2_END_MAGIC, GFDB_V2_MAGIC_LEN);
+
+        if (gfdb_write_full (writer->fd, dir, dir_len) ||
+            gfdb_write_full (writer->fd, trailer, sizeof (trailer)))
+                goto out;
+
+        ret = 0;
+out:
+        free (dir);
+        return ret;
+}
+
+
+void
+gfdb_v2_writer_cleanup (gfdb_v2_writer_t *writer)
+{
+        free (writer->block);
+        free (writer->dir);
+        writer->block = NULL;
+        writer->dir = NULL;
+}
+
+
+/* Loads and checks the block directory through the trailer */
+int
+gfdb_v2_read_directory (int fd, gfdb_v2_dir_entry_t **dir,
+                        uint64_t *block_count)
+{
+        int ret                                 = -1;
+        struct stat stat_buff                   = {0};
+        char trailer[GFDB_V2_TRAILER_LEN]       = {0};
+        char dir_header[GFDB_V2_DIR_HEADER_LEN] = {0};
+        char *entries                           = NULL;
+        gfdb_v2_dir_entry_t *ret_dir            = NULL;
+        uint64_t dir_offset                     = 0;
+        uint64_t count                          = 0;
+        uint64_t i                              = 0;
+        uint64_t expected                       = GFDB_V2_HEADER_LEN;
+        uint64_t first_record                   = 0;
+        size_t entries_len                      = 0;
+
+        if (fstat (fd, &stat_buff) ||
+            stat_buff.st_size < GFDB_V2_HEADER_LEN + GFDB_V2_DIR_HEADER_LEN +
+                                GFDB_V2_TRAILER_LEN) {
+                LOG_IT (log_error, "Truncated version 2 query file");
+                goto out;
+        }
+
+        if (gfdb_pread_full (fd, trailer, sizeof (trailer),
+                             stat_buff.st_size - GFDB_V2_TRAILER_LEN))
+                goto out;
+        if (memcmp (trailer + 16, GFDB_V2_END_MAGIC, GFDB_V2_MAGIC_LEN)) {
+                LOG_IT (log_error, "Version 2 query file has no trailer, "
+                        "truncated or still being written");
+                goto out;
+        }
+
+        dir_offset = gfdb_get_le64 (trailer);
+        if (dir_offset < GFDB_V2_HEADER_LEN ||
+            dir_offset > (uint64_t)stat_buff.st_size - GFDB_V2_TRAILER_LEN -
+                         GFDB_V2_DIR_HEADER_LEN)
+                goto corrupt;
+
+        if (gfdb_pread_full (fd, dir_header, sizeof (dir_header),
+                             dir_offset))
+                goto out;
+        count = gfdb_get_le64 (dir_header + 8);
+        if (gfdb_get_le32 (dir_header) != GFDB_V2_DIR_MAGIC ||
+            count != (stat_buff.st_size - GFDB_V2_TRAILER_LEN - dir_offset -
+                      GFDB_V2_DIR_HEADER_LEN) / GFDB_V2_DIR_ENTRY_LEN)
+                goto corrupt;
+
+        entries_len = count * GFDB_V2_DIR_ENTRY_LEN;
+        entries = malloc (entries_len + 1);
+        ret_dir = calloc (count + 1, sizeof (*ret_dir));
+        if (!entries || !ret_dir) {
+                LOG_IT (log_error, "Memory allocation failed for block "
+                        "directory");
+                goto out;
+        }
+
+        if (gfdb_pread_full (fd, entries, entries_len,
+                             dir_offset + GFDB_V2_DIR_HEADER_LEN))
+                goto out;
+        if (gfdb_crc32c (entries, entries_len) !=
+            gfdb_get_le32 (dir_header + 4)) {
+                LOG_IT (log_error, "Block directory checksum mismatch");
+                goto out;
+        }
+
+        /* Blocks must tile the file between the header and the directory */
+        for (i = 0; i < count; i++) {
+                ret_dir[i].offset = gfdb_get_le64 (entries +
+                                        i * GFDB_V2_DIR_ENTRY_LEN);
+                ret_dir[i].payload_len = gfdb_get_le64 (entries +
+                                        i * GFDB_V2_DIR_ENTRY_LEN + 8);
+                ret_dir[i].record_count = gfdb_get_le64 (entries +
+                                        i * GFDB_V2_DIR_ENTRY_LEN + 16);
+                ret_dir[i].first_record = gfdb_get_le64 (entries +
+                                        i * GFDB_V2_DIR_ENTRY_LEN + 24);
+                if (ret_dir[i].offset != expected ||
+                    ret_dir[i].first_record != first_record ||
+                    ret_dir[i].payload_len > dir_offset)
+                        goto corrupt;
+                expected += GFDB_V2_BLOCK_HEADER_LEN +
+                            ret_dir[i].payload_len;
+                first_record += ret_dir[i].record_count;
+        }
+        if (expected != dir_offset ||
+            first_record != gfdb_get_le64 (trailer + 8))
+                goto corrupt;
+
+        *dir = ret_dir;
+        *block_count = count;
+        ret_dir = NULL;
+        ret = 0;
+        goto out;
+corrupt:
+        LOG_IT (log_error, "Corrupted version 2 query file directory");
+out:
+        free (entries);
+        free (ret_dir);
+        return ret;
+}
+
+
+/* Reads, checks and decodes one block on its own, handing the records to
+ * cbk. *buffer is a scratch buffer grown as needed.
+ * */
+int
+gfdb_v2_decode_block (int fd, const gfdb_v2_dir_entry_t *entry,
+                      char **buffer, size_t *buffer_size,
+                      gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                                         = -1;
+        char header[GFDB_V2_BLOCK_HEADER_LEN]           = {0};
+        char *new_buffer                                = NULL;
+        char *ptr                                       = NULL;
+        char *end                                       = NULL;
+        uint32_t record_len                             = 0;
+        uint64_t records                                = 0;
+        gfdb_query_record_t *query_record               = NULL;
+
+        if (gfdb_pread_full (fd, header, sizeof (header), entry->offset))
+                goto out;
+
+        if (gfdb_get_le32 (header) != GFDB_V2_BLOCK_MAGIC ||
+            gfdb_get_le64 (header + 8) != entry->payload_len ||
+            gfdb_get_le64 (header + 16) != entry->record_count) {
+                LOG_AT (log_error, entry->offset, "Corrupted block header");
+                goto out;
+        }
+
+        if (entry->payload_len > *buffer_size) {
+                new_buffer = realloc (*buffer, entry->payload_len);
+                if (!new_buffer) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "block buffer");
+                        goto out;
+                }
+                *buffer = new_buffer;
+                *buffer_size = entry->payload_len;
+        }
+
+        if (gfdb_pread_full (fd, *buffer, entry->payload_len,
+                             entry->offset + GFDB_V2_BLOCK_HEADER_LEN))
+                goto out;
+
+        if (gfdb_crc32c (*buffer, entry->payload_len) !=
+            gfdb_get_le32 (header + 4)) {
+                LOG_AT (log_error, entry->offset, "Checksum mismatch in "
+                        "block");
+                goto out;
+        }
+
+        ptr = *buffer;
+        end = *buffer + entry->payload_len;
+        for (records = 0; records < entry->record_count; records++) {
+                if (end - ptr < (ptrdiff_t)sizeof (uint32_t))
+                        break;
+                record_len = gfdb_get_le32 (ptr);
+                ptr += sizeof (uint32_t);
+                if ((uint64_t)(end - ptr) < record_len)
+                        break;
+
+                if (gfdb_v2_record_deserialize (ptr, record_len,
+                                                &query_record)) {
+                        LOG_AT (log_error, entry->offset, "Failed to "
+                                "de-serialize query record in block");
+                        ret = -1;
+                        goto out;
+                }
+                ptr += record_len;
+                gfdb_throttle_account (sizeof (uint32_t) + record_len, 1);
+
+                ret = cbk (query_record, data);
+                gfdb_query_record_free (query_record);
+                query_record = NULL;
+                if (ret)
+                        goto out;
+        }
+
+        if (records != entry->record_count || ptr != end) {
+                LOG_AT (log_error, entry->offset, "Corrupted block");
+                ret = -1;
+                goto out;
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Decodes every block of a version 2 query file, handing records to cbk */
+int
+gfdb_v2_foreach_query_record (int fd, gfdb_query_record_cbk_t cbk,
+                              void *data)
+{
+        int ret                         = -1;
+        char header[GFDB_V2_HEADER_LEN] = {0};
+        gfdb_v2_dir_entry_t *dir        = NULL;
+        uint64_t block_count            = 0;
+        uint64_t i                      = 0;
+        char *buffer                    = NULL;
+        size_t buffer_size              = 0;
+
+        if (gfdb_pread_full (fd, header, sizeof (header), 0))
+                goto out;
+        if (gfdb_get_le32 (header + 8) != GFDB_V2_VERSION ||
+            gfdb_get_le32 (header + 12) != GFDB_V2_HEADER_LEN) {
+                LOG_IT (log_error, "Unsupported query file version %u",
+                        gfdb_get_le32 (header + 8));
+                goto out;
+        }
+
+        if (gfdb_v2_read_directory (fd, &dir, &block_count))
+                goto out;
+
+        for (i = 0; i < block_count; i++) {
+                if (gfdb_v2_decode_block (fd, &dir[i], &buffer,
+                                          &buffer_size, cbk, data))
+                        goto out;
+        }
+
+        ret = 0;
+out:
+        free (buffer);
+        free (dir);
+        return ret;
+}
+
+
+/******************************************************************************
+                        WRITING A QUERY FILE
+*******************************************************************************/
+
+#define GFDB_WRITE_BUFFER_SIZE          (1024 * 1024)
+
+/*Structure to batch the writes of query records to a query file*/
+typedef struct gfdb_query_file_writer {
+        int                             fd;
+        char                            *buffer;
+        size_t                          buffer_size;
+        size_t                          used;
+        /* 1 for the legacy format, GFDB_V2_VERSION for blocks */
+        int                             version;
+        gfdb_v2_writer_t                v2;
+} gfdb_query_file_writer_t;
+
+
+static int
+gfdb_query_file_writer_open_flags (gfdb_query_file_writer_t *writer,
+                                   const char *query_file_path, int version,
+                                   int flags)
+{
+        int ret = -1;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, writer, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, query_file_path, out);
+
+        memset (writer, 0, sizeof (*writer));
+        writer->fd = -1;
+        writer->version = version;
+
+        /* Version 2 batches its writes in the block buffer */
+        if (version != GFDB_V2_VERSION) {
+                writer->buffer_size = GFDB_WRITE_BUFFER_SIZE;
+                writer->buffer = malloc (writer->buffer_size);
+                if (!writer->buffer) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "write buffer");
+                        goto out;
+                }
+        }
+
+        writer->fd = open (query_file_path,
+                           O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0644);
+        if (writer->fd < 0) {
+                LOG_IT (log_error, "Failed to open %s : %s",
+                        query_file_path, strerror (errno));
+                goto out;
+        }
+
+        if (version == GFDB_V2_VERSION &&
+            gfdb_v2_writer_init (&writer->v2, writer->fd))
+                goto out;
+
+        ret = 0;
+out:
+        if (ret && writer) {
+                gfdb_v2_writer_cleanup (&writer->v2);
+                if (writer->fd >= 0)
+                        close (writer->fd);
+                writer->fd = -1;
+                free (writer->buffer);
+                writer->buffer = NULL;
+        }
+        return ret;
+}
+
+
+int
+gfdb_query_file_writer_open (gfdb_query_file_writer_t *writer,
+                             const char *query_file_path, int version)
+{
+        return gfdb_query_file_writer_open_flags (writer, query_file_path,
+                                                  version, O_TRUNC);
+}
+
+
+/* Reopens a legacy query file to append to it from offset, cutting what
+ * was written past it */
+int
+gfdb_query_file_writer_reopen (gfdb_query_file_writer_t *writer,
+                               const char *query_file_path, off_t offset)
+{
+        int ret                 = -1;
+        struct stat stat_buff   = {0};
+
+        if (gfdb_query_file_writer_open_flags (writer, query_file_path, 1, 0))
+                goto out;
+
+        if (fstat (writer->fd, &stat_buff) || stat_buff.st_size < offset) {
+                LOG_IT (log_error, "%s is shorter than at the checkpoint",
+                        query_file_path);
+                goto out;
+        }
+
+        if (ftruncate (writer->fd, offset) ||
+            lseek (writer->fd, offset, SEEK_SET) < 0) {
+                LOG_IT (log_error, "Failed to position %s : %s",
+                        query_file_path, strerror (errno));
+                goto out;
+        }
+
+        ret = 0;
+out:
+        if (ret && writer && writer->fd >= 0) {
+                close (writer->fd);
+                writer->fd = -1;
+                free (writer->buffer);
+                writer->buffer = NULL;
+        }
+        return ret;
+}
+
+
+static int
+gfdb_query_file_writer_flush (gfdb_query_file_writer_t *writer)
+{
+        if (gfdb_write_full (writer->fd, writer->buffer, writer->used))
+                return -1;
+
+        writer->used = 0;
+        return 0;
+}
+
+
+/* Writes out the pending records and syncs them, for a checkpoint */
+int
+gfdb_query_file_writer_sync (void *data, int64_t *offset)
+{
+        gfdb_query_file_writer_t *writer = data;
+
+        if (gfdb_query_file_writer_flush (writer))
+                return -1;
+
+        if (fdatasync (writer->fd)) {
+                LOG_IT (log_error, "Failed to sync query file : %s",
+                        strerror (errno));
+                return -1;
+        }
+
+        *offset = lseek (writer->fd, 0, SEEK_CUR);
+        return 0;
+}
+
+
+/* Function to write query record to the query file.
+ * The record is serialized straight into the write buffer, which goes to
+ * the file once full.
+ * */
+int
+gfdb_write_query_record (gfdb_query_file_writer_t *writer,
+                         gfdb_query_record_t *query_record)
+{
+        int ret                 = -1;
+        int buffer_len          = 0;
+        size_t needed           = 0;
+        char *new_buffer        = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, writer, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, query_record, out);
+
+        if (writer->version == GFDB_V2_VERSION)
+                return gfdb_v2_write_query_record (&writer->v2,
+                                                   query_record);
+
+        buffer_len = gfdb_query_record_serialized_length (query_record);
+        needed = sizeof (int32_t) + buffer_len;
+
+        if (writer->used + needed > writer->buffer_size) {
+                if (gfdb_query_file_writer_flush (writer))
+                        goto out;
+        }
+
+        /* A record bigger than the whole buffer */
+        if (needed > writer->buffer_size) {
+                new_buffer = realloc (writer->buffer, needed);
+                if (!new_buffer) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "write buffer");
+                        goto out;
+                }
+                writer->buffer = new_buffer;
+                writer->buffer_size = needed;
+        }
+
+        memcpy (writer->buffer + writer->used, &buffer_len,
+                sizeof (int32_t));
+        ret = gfdb_query_record_serialize (query_record, writer->buffer +
+                                           writer->used + sizeof (int32_t));
+        if (ret < 0)
+                goto out;
+
+        writer->used += needed;
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Flushes the pending records, and for version 2 writes the block
+ * directory and trailer, then closes the query file */
+int
+gfdb_query_file_writer_close (gfdb_query_file_writer_t *writer)
+{
+        int ret = -1;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, writer, out);
+
+        if (writer->fd >= 0) {
+                if (writer->version == GFDB_V2_VERSION)
+                        ret = gfdb_v2_writer_finish (&writer->v2);
+                else
+                        ret = gfdb_query_file_writer_flush (writer);
+                if (close (writer->fd) && !ret) {
+                        LOG_IT (log_error, "Failed to close query file : "
+                                "%s", strerror (errno));
+                        ret = -1;
+                }
+                writer->fd = -1;
+        }
+
+        gfdb_v2_writer_cleanup (&writer->v2);
+        free (writer->buffer);
+        writer->buffer = NULL;
+out:
+        return ret;
+}
+
+
+/******************************************************************************
+                        FOLLOWING A QUERY FILE BEING WRITTEN
+*******************************************************************************/
+/******************************************************************************
+ In follow mode the query file is decoded while the tier daemon is still
+ writing it. Whatever is available is read into a buffer and every complete
+ length prefixed record in it is decoded. A partially written record is kept
+ in the buffer and the reader blocks on inotify until the file is modified,
+ instead of treating the short read as corruption.
+
+ Following ends when there is no more data to read after either,
+   - the writer closed the file (IN_CLOSE_WRITE), or the file was removed
+   - the completion marker file (--done-marker) was created
+ A partial record left in the buffer at that point is a truncated file.
+
+ A writer that closed the file before the watch was added sends no
+ IN_CLOSE_WRITE. So without --done-marker, /proc is searched at setup for a
+ process holding the file open for writing, and with none found following
+ ends at the first end of file. Processes whose fds cannot be inspected
+ (other users, without privileges) count as possible writers.
+
+ A length prefix is checked against a fixed limit, and against the link
+ count as soon as it is in the buffer, before the buffer is grown for it.
+ * ****************************************************************************/
+
+#define GFDB_FOLLOW_MIN_BUFFER          (64 * 1024)
+#define GFDB_INOTIFY_BUFFER_SIZE        (16 * (sizeof (struct inotify_event) \
+                                               + GF_NAME_MAX + 1))
+
+typedef struct gfdb_follow_ctx {
+        int                             query_fd;
+        int                             inotify_fd;
+        int                             file_wd;
+        int                             dir_wd;
+        const char                      *marker_name;
+        char                            *buffer;
+        size_t                          buffer_size;
+        size_t                          data_start;
+        size_t                          data_end;
+        off_t                           record_offset;
+        boolean_t                       finished;
+} gfdb_follow_ctx_t;
+
+
+/* Whether the fd of process pid named fd_name is open for writing */
+static boolean_t
+gfdb_fd_is_writable (const char *pid, const char *fd_name)
+{
+        char path[PATH_MAX]     = {0};
+        char line[128]          = {0};
+        FILE *fdinfo            = NULL;
+        unsigned int flags      = 0;
+        boolean_t ret           = _true;
+
+        snprintf (path, sizeof (path), "/proc/%s/fdinfo/%s", pid, fd_name);
+        fdinfo = fopen (path, "re");
+        if (!fdinfo)
+                goto out;
+
+        while (fgets (line, sizeof (line), fdinfo)) {
+                if (sscanf (line, "flags: %o", &flags) == 1) {
+                        if ((flags & O_ACCMODE) == O_RDONLY)
+                                ret = _false;
+                        break;
+                }
+        }
+
+        fclose (fdinfo);
+out:
+        return ret;
+}
+
+
+/* Searches /proc for a process with the query file open for writing.
+ * Returns 1 when there may be one, 0 when there is none and -1 on failure.
+ * */
+static int
+gfdb_follow_has_writer (int query_fd)
+{
+        int ret                         = -1;
+        struct stat query_stat          = {0};
+        struct stat fd_stat             = {0};
+        char path[PATH_MAX]             = {0};
+        DIR *proc_dir                   = NULL;
+        DIR *fd_dir                     = NULL;
+        struct dirent *proc_entry       = NULL;
+        struct dirent *fd_entry         = NULL;
+
+        if (fstat (query_fd, &query_stat)) {
+                LOG_IT (log_error, "Failed to stat query file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        proc_dir = opendir ("/proc");
+        if (!proc_dir) {
+                LOG_IT (log_error, "Failed to open /proc : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        ret = 0;
+        while (ret == 0 && (proc_entry = readdir (proc_dir))) {
+                if (!isdigit ((uchar_t)proc_entry->d_name[0]))
+                        continue;
+
+                snprintf (path, sizeof (path), "/proc/%s/fd",
+                          proc_entry->d_name);
+                fd_dir = opendir (path);
+                if (!fd_dir) {
+                        /* Gone is fine, not inspectable may be the writer */
+                        if (errno != ENOENT)
+                                ret = 1;
+                        continue;
+                }
+
+                while ((fd_entry = readdir (fd_dir))) {
+                        if (fd_entry->d_name[0] == '.')
+                                continue;
+                        snprintf (path, sizeof (path), "/proc/%s/fd/%s",
+                                  proc_entry->d_name, fd_entry->d_name);
+                        if (stat (path, &fd_stat) ||
+                            fd_stat.st_dev != query_stat.st_dev ||
+                            fd_stat.st_ino != query_stat.st_ino)
+                                continue;
+                        if (gfdb_fd_is_writable (proc_entry->d_name,
+                                                 fd_entry->d_name)) {
+                                ret = 1;
+                                break;
+                        }
+                }
+                closedir (fd_dir);
+        }
+
+        closedir (proc_dir);
+out:
+        return ret;
+}
+
+
+static int
+gfdb_follow_setup (gfdb_follow_ctx_t *ctx, int query_fd,
+                   const char *query_file_path, const char *marker_path)
+{
+        int ret                 = -1;
+        char *marker_dir        = NULL;
+        const char *slash       = NULL;
+
+        ctx->query_fd = query_fd;
+        ctx->file_wd = -1;
+        ctx->dir_wd = -1;
+
+        ctx->buffer_size = GFDB_FOLLOW_MIN_BUFFER;
+        ctx->buffer = malloc (ctx->buffer_size);
+        if (!ctx->buffer) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "follow buffer");
+                goto out;
+        }
+
+        ctx->inotify_fd = inotify_init1 (IN_CLOEXEC);
+        if (ctx->inotify_fd < 0) {
+                LOG_IT (log_error, "Failed to initialize inotify : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        ctx->file_wd = inotify_add_watch (ctx->inotify_fd, query_file_path,
+                                          IN_MODIFY | IN_CLOSE_WRITE |
+                                          IN_DELETE_SELF | IN_MOVE_SELF);
+        if (ctx->file_wd < 0) {
+                LOG_IT (log_error, "Failed to watch %s : %s",
+                        query_file_path, strerror (errno));
+                goto out;
+        }
+
+        if (marker_path) {
+                /* Watch the directory the marker will be created in */
+                slash = strrchr (marker_path, '/');
+                if (slash) {
+                        marker_dir = strndup (marker_path,
+                                              (slash == marker_path) ? 1 :
+                                              slash - marker_path);
+                        ctx->marker_name = slash + 1;
+                } else {
+                        marker_dir = strdup (".");
+                        ctx->marker_name = marker_path;
+                }
+                if (!marker_dir) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "marker directory");
+                        goto out;
+                }
+
+                ctx->dir_wd = inotify_add_watch (ctx->inotify_fd,
+                                                 marker_dir,
+                                                 IN_CREATE | IN_MOVED_TO);
+                if (ctx->dir_wd < 0) {
+                        LOG_IT (log_error, "Failed to watch %s : %s",
+                                marker_dir, strerror (errno));
+                        goto out;
+                }
+
+                /* The marker may have shown up before the watch */
+                if (access (marker_path, F_OK) == 0)
+                        ctx->finished = _true;
+        } else {
+                /* The writer may have closed the file before the watch */
+                switch (gfdb_follow_has_writer (query_fd)) {
+                case 0:
+                        ctx->finished = _true;
+                        break;
+                case 1:
+                        break;
+                default:
+                        goto out;
+                }
+        }
+
+        ret = 0;
+out:
+        free (marker_dir);
+        return ret;
+}
+
+
+static void
+gfdb_follow_cleanup (gfdb_follow_ctx_t *ctx)
+{
+        if (ctx->inotify_fd >= 0)
+                close (ctx->inotify_fd);
+        free (ctx->buffer);
+        ctx->buffer = NULL;
+}
+
+
+/* Blocks until the query file changes or following has to end */
+static int
+gfdb_follow_wait (gfdb_follow_ctx_t *ctx)
+{
+        char events[GFDB_INOTIFY_BUFFER_SIZE]
+                __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        const struct inotify_event *event       = NULL;
+        ssize_t len                             = 0;
+        char *ptr                               = NULL;
+
+        do {
+                len = read (ctx->inotify_fd, events, sizeof (events));
+        } while (len < 0 && errno == EINTR);
+
+        if (len <= 0) {
+                LOG_IT (log_error, "Failed reading inotify events : %s",
+                        strerror (errno));
+                return -1;
+        }
+
+        for (ptr = events; ptr < events + len;
+             ptr += sizeof (struct inotify_event) + event->len) {
+                event = (const struct inotify_event *)ptr;
+
+                if (event->wd == ctx->file_wd &&
+                    (event->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF |
+                                    IN_MOVE_SELF)))
+                        ctx->finished = _true;
+
+                if (event->wd == ctx->dir_wd && event->len &&
+                    strcmp (event->name, ctx->marker_name) == 0)
+                        ctx->finished = _true;
+        }
+
+        return 0;
+}
+
+
+/* Reads whatever is available into the buffer.
+ * Returns the number of bytes read, 0 when nothing is available yet
+ * and -1 on failure.
+ * */
+static ssize_t
+gfdb_follow_fill (gfdb_follow_ctx_t *ctx)
+{
+        ssize_t ret             = -1;
+        char *new_buffer        = NULL;
+        size_t pending          = 0;
+
+        /* Move the partial record to the front to make room */
+        pending = ctx->data_end - ctx->data_start;
+        if (ctx->data_start > 0) {
+                memmove (ctx->buffer, ctx->buffer + ctx->data_start, pending);
+                ctx->data_start = 0;
+                ctx->data_end = pending;
+        }
+
+        if (ctx->data_end == ctx->buffer_size) {
+                new_buffer = realloc (ctx->buffer, ctx->buffer_size << 1);
+                if (!new_buffer) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "follow buffer");
+                        goto out;
+                }
+                ctx->buffer = new_buffer;
+                ctx->buffer_size <<= 1;
+        }
+
+        do {
+                ret = read (ctx->query_fd, ctx->buffer + ctx->data_end,
+                            ctx->buffer_size - ctx->data_end);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0) {
+                LOG_IT (log_error, "Failed reading query file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        ctx->data_end += ret;
+out:
+        return ret;
+}
+
+
+/* Decodes every complete record in the buffer */
+static int
+gfdb_follow_decode (gfdb_follow_ctx_t *ctx, gfdb_query_record_cbk_t cbk,
+                    void *data)
+{
+        int ret                                 = 0;
+        int32_t buffer_len                      = 0;
+        int32_t link_count                      = 0;
+        size_t pending                          = 0;
+        gfdb_query_record_t *query_record       = NULL;
+
+        for (;;) {
+                pending = ctx->data_end - ctx->data_start;
+                if (pending < sizeof (int32_t))
+                        break;
+
+                if (ctx->record_offset == 0 &&
+                    pending >= GFDB_V2_MAGIC_LEN &&
+                    !memcmp (ctx->buffer + ctx->data_start, GFDB_V2_MAGIC,
+                             GFDB_V2_MAGIC_LEN)) {
+                        LOG_IT (log_error, "--follow supports only legacy "
+                                "(version 1) query files");
+                        ret = -1;
+                        break;
+                }
+
+                memcpy (&buffer_len, ctx->buffer + ctx->data_start,
+                        sizeof (int32_t));
+                if (buffer_len < (int32_t)GFDB_QUERY_RECORD_MIN_LEN ||
+                    buffer_len > GFDB_QUERY_RECORD_MAX_LEN) {
+                        LOG_AT (log_error, ctx->record_offset, "Invalid "
+                                "record length %d, corrupted query file",
+                                buffer_len);
+                        ret = -1;
+                        break;
+                }
+
+                /* Once the link count is in, the length must fit it,
+                 * else the buffer would grow waiting for a record that
+                 * never completes */
+                if (pending >= sizeof (int32_t) + UUID_LEN +
+                               sizeof (int32_t)) {
+                        memcpy (&link_count, ctx->buffer + ctx->data_start +
+                                sizeof (int32_t) + UUID_LEN,
+                                sizeof (int32_t));
+                        if (link_count < 0 ||
+                            (size_t)buffer_len > GFDB_QUERY_RECORD_MIN_LEN +
+                            (size_t)link_count * GFDB_QUERY_LINK_MAX_LEN) {
+                                LOG_AT (log_error, ctx->record_offset,
+                                        "Invalid record length %d for %d "
+                                        "links, corrupted query file",
+                                        buffer_len, link_count);
+                                ret = -1;
+                                break;
+                        }
+                }
+
+                /* Partially written record, wait for the rest of it */
+                if (pending < sizeof (int32_t) + (size_t)buffer_len)
+                        break;
+
+                ret = gfdb_query_record_deserialize (ctx->buffer +
+                                ctx->data_start + sizeof (int32_t),
+                                buffer_len, &query_record);
+                if (ret) {
+                        LOG_AT (log_error, ctx->record_offset, "Failed to "
+                                "de-serialize query record");
+                        break;
+                }
+
+                ret = cbk (query_record, data);
+                gfdb_query_record_free (query_record);
+                query_record = NULL;
+                if (ret)
+                        break;
+
+                ctx->data_start += sizeof (int32_t) + buffer_len;
+                ctx->record_offset += sizeof (int32_t) + buffer_len;
+                gfdb_throttle_account (sizeof (int32_t) + buffer_len, 1);
+        }
+
+        return ret;
+}
+
+
+/* Decodes the query file as it is being written, till the writer is done */
+int
+gfdb_follow_query_file (int query_fd, const char *query_file_path,
+                        const char *marker_path,
+                        gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                 = -1;
+        ssize_t read_len        = 0;
+        gfdb_follow_ctx_t ctx   = {0};
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, (query_fd >= 0), out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, query_file_path, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, cbk, out);
+
+        ctx.inotify_fd = -1;
+        if (gfdb_follow_setup (&ctx, query_fd, query_file_path, marker_path))
+                goto out;
+
+        for (;;) {
+                if (gfdb_follow_decode (&ctx, cbk, data))
+                        goto out;
+
+                read_len = gfdb_follow_fill (&ctx);
+                if (read_len < 0)
+                        goto out;
+                if (read_len > 0)
+                        continue;
+
+                /* Nothing more to read after the writer is done */
+                if (ctx.finished)
+                        break;
+
+                if (gfdb_follow_wait (&ctx))
+                        goto out;
+        }
+
+        if (ctx.data_end != ctx.data_start) {
+                LOG_AT (log_error, ctx.record_offset, "Query file ended "
+                        "with a truncated record");
+                goto out;
+        }
+
+        ret = 0;
+out:
+        gfdb_follow_cleanup (&ctx);
+        return ret;
+}
+
+
+/******************************************************************************
+                SHARED MEMORY RING FOR LOCAL MIGRATION WORKERS
+*******************************************************************************/
+/******************************************************************************
+ In serve mode the query file is decoded once and the records are handed out
+ to the local worker processes through a ring in shared memory. Every record
+ goes to exactly one worker, so each worker pulls a disjoint slice of the
+ query file without re-reading or re-parsing it.
+
+ The ring lives in a memfd. Workers attach by connecting to the server's
+ unix socket, which replies with the memfd (SCM_RIGHTS) and the size of the
+ mapping; a worker detaches by closing the connection.
+
+   +---------------------------------------------------------------------+
+   | HEADER | SEQUENCE[0] .. SEQUENCE[N-1] | SLOT[0] .. SLOT[N-1]         |
+   +---------------------------------------------------------------------+
+                  8 B each                       GFDB_RING_SLOT_SIZE each
+
+ A record takes one or more consecutive slots. The first slot of the span
+ starts with a <ENTRY HEADER>, followed by the serialized query record.
+   +-----------------------------------+
+   | RECORD LENGTH | SPAN (slot count) |
+   +-----------------------------------+
+         4 B               4 B
+ A span never wraps around the end of the ring, the producer fills the tail
+ with a padding entry (RECORD LENGTH 0) instead.
+
+ The slot sequence numbers follow the bounded MPMC queue scheme, with a
+ single producer. Slot i of the span at position pos is free when its
+ sequence is pos + i, and the span is ready when the sequence of its first
+ slot is pos + 1. Consumers claim a span with a CAS on dequeue_pos and give
+ the slots back by bumping their sequence by the slot count. Nothing takes a
+ lock; futexes on the shared mapping are only used to sleep when the ring is
+ empty or full.
+
+ Backpressure : the producer blocks while the ring is full, and it does not
+ produce while no worker is attached. A worker that dies holding a claimed
+ span stalls the ring once the producer wraps around to that span.
+ * ****************************************************************************/
+
+#define GFDB_RING_MAGIC                 0x474E4952      /* "RING" */
+#define GFDB_RING_SLOT_SIZE             256
+#define GFDB_RING_DEFAULT_SIZE          (64 * 1024 * 1024)
+#define GFDB_RING_MAX_CONSUMERS         64
+#define GFDB_RING_WAIT_MS               100
+#define GFDB_CACHELINE_SIZE             64
+
+/*Header at the start of the shared mapping*/
+typedef struct gfdb_ring_shared {
+        uint32_t                        magic;
+        uint32_t                        slot_size;
+        uint64_t                        slot_count;
+        uint64_t                        data_offset;
+        uint32_t                        eof;
+
+        uint64_t                        enqueue_pos
+                        __attribute__ ((aligned (GFDB_CACHELINE_SIZE)));
+        uint64_t                        dequeue_pos
+                        __attribute__ ((aligned (GFDB_CACHELINE_SIZE)));
+
+        /* Bumped by the producer after publishing, consumers sleep on it */
+        uint32_t                        data_futex
+                        __attribute__ ((aligned (GFDB_CACHELINE_SIZE)));
+        uint32_t                        data_waiters;
+
+        /* Bumped by the consumers after releasing, the producer sleeps on it */
+        uint32_t                        space_futex
+                        __attribute__ ((aligned (GFDB_CACHELINE_SIZE)));
+        uint32_t                        space_waiters;
+
+        uint64_t                        sequence[]
+                        __attribute__ ((aligned (GFDB_CACHELINE_SIZE)));
+} gfdb_ring_shared_t;
+
+/*Header of the first slot of every span*/
+typedef struct gfdb_ring_entry {
+        uint32_t                        record_len;
+        uint32_t                        span;
+} gfdb_ring_entry_t;
+
+/*Producer side*/
+typedef struct gfdb_ring_server {
+        gfdb_ring_shared_t              *ring;
+        size_t                          map_size;
+        int                             memfd;
+        int                             listen_fd;
+        int                             stop_pipe[2];
+        const char                      *socket_path;
+        pthread_t                       control_thread;
+        boolean_t                       control_started;
+        uint32_t                        consumer_count;
+        char                            *scratch;
+        size_t                          scratch_size;
+} gfdb_ring_server_t;
+
+
+static int
+gfdb_futex_wait (uint32_t *addr, uint32_t val, int timeout_ms)
+{
+        struct timespec timeout = {0};
+
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+        /* Not FUTEX_PRIVATE, the word is shared between processes */
+        return syscall (SYS_futex, addr, FUTEX_WAIT, val, &timeout,
+                        NULL, 0);
+}
+
+
+static void
+gfdb_futex_wake (uint32_t *addr)
+{
+        syscall (SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+static inline char *
+gfdb_ring_slot (gfdb_ring_shared_t *ring, uint64_t pos)
+{
+        return (char *)ring + ring->data_offset +
+               (pos & (ring->slot_count - 1)) * ring->slot_size;
+}
+
+
+static inline uint64_t *
+gfdb_ring_sequence (gfdb_ring_shared_t *ring, uint64_t pos)
+{
+        return &ring->sequence[pos & (ring->slot_count - 1)];
+}
+
+
+/* Size of the mapping and the offset of the slots for slot_count slots */
+static size_t
+gfdb_ring_layout (uint64_t slot_count, uint64_t *data_offset)
+{
+        size_t offset = 0;
+
+        offset = sizeof (gfdb_ring_shared_t) + slot_count * sizeof (uint64_t);
+        offset = (offset + GFDB_CACHELINE_SIZE - 1) &
+                 ~((size_t)GFDB_CACHELINE_SIZE - 1);
+        *data_offset = offset;
+
+        return offset + slot_count * GFDB_RING_SLOT_SIZE;
+}
+
+
+static int
+gfdb_ring_create (gfdb_ring_server_t *server, size_t ring_size)
+{
+        int ret                         = -1;
+        uint64_t slot_count             = 1;
+        uint64_t data_offset            = 0;
+        uint64_t i                      = 0;
+        gfdb_ring_shared_t *ring        = NULL;
+
+        /* Power of two number of slots, so positions can be masked */
+        while (slot_count * GFDB_RING_SLOT_SIZE < ring_size)
+                slot_count <<= 1;
+
+        server->map_size = gfdb_ring_layout (slot_count, &data_offset);
+
+        server->memfd = memfd_create ("gfdb_query_ring", MFD_CLOEXEC);
+        if (server->memfd < 0) {
+                LOG_IT (log_error, "Failed to create shared memory : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        if (ftruncate (server->memfd, server->map_size)) {
+                LOG_IT (log_error, "Failed to size shared memory : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        ring = mmap (NULL, server->map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, server->memfd, 0);
+        if (ring == MAP_FAILED) {
+                LOG_IT (log_error, "Failed to map shared memory : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        ring->slot_size = GFDB_RING_SLOT_SIZE;
+        ring->slot_count = slot_count;
+        ring->data_offset = data_offset;
+        for (i = 0; i < slot_count; i++)
+                ring->sequence[i] = i;
+        __atomic_store_n (&ring->magic, GFDB_RING_MAGIC, __ATOMIC_RELEASE);
+
+        server->ring = ring;
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Hands the memfd of the ring to a newly connected consumer */
+static int
+gfdb_ring_send_memfd (gfdb_ring_server_t *server, int client_fd)
+{
+        struct msghdr msg                               = {0};
+        struct iovec iov                                = {0};
+        struct cmsghdr *cmsg                            = NULL;
+        uint64_t map_size                               = 0;
+        union {
+                char            buf[CMSG_SPACE (sizeof (int))];
+                struct cmsghdr  align;
+        } control;
+
+        memset (&control, 0, sizeof (control));
+        map_size = server->map_size;
+        iov.iov_base = &map_size;
+        iov.iov_len = sizeof (map_size);
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof (control.buf);
+
+        cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (cmsg), &server->memfd, sizeof (int));
+
+        if (sendmsg (client_fd, &msg, MSG_NOSIGNAL) != sizeof (map_size)) {
+                LOG_IT (log_error, "Failed to send ring to consumer : %s",
+                        strerror (errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/* Control channel : accepts consumers and tracks their detach */
+static void *
+gfdb_ring_control_thread (void *data)
+{
+        gfdb_ring_server_t *server                      = data;
+        struct pollfd fds[GFDB_RING_MAX_CONSUMERS + 2]  = {{0}};
+        int nfds                                        = 2;
+        int client_fd                                   = -1;
+        char byte                                       = 0;
+        int i                                           = 0;
+
+        fds[0].fd = server->stop_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = server->listen_fd;
+        fds[1].events = POLLIN;
+
+        for (;;) {
+                if (poll (fds, nfds, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_IT (log_error, "Failed polling control "
+                                "channel : %s", strerror (errno));
+                        break;
+                }
+
+                if (fds[0].revents)
+                        break;
+
+                /* Any byte or a hangup from a consumer is a detach */
+                for (i = 2; i < nfds; i++) {
+                        if (!fds[i].revents)
+                                continue;
+                        if (read (fds[i].fd, &byte, 1) > 0)
+                                LOG_IT (log_info, "Consumer detached");
+                        close (fds[i].fd);
+                        fds[i] = fds[--nfds];
+                        i--;
+                        __atomic_sub_fetch (&server->consumer_count, 1,
+                                            __ATOMIC_RELEASE);
+                        __atomic_add_fetch (&server->ring->space_futex, 1,
+                                            __ATOMIC_RELEASE);
+                        gfdb_futex_wake (&server->ring->space_futex);
+                }
+
+                if (!(fds[1].revents & POLLIN))
+                        continue;
+
+                client_fd = accept4 (server->listen_fd, NULL, NULL,
+                                     SOCK_CLOEXEC);
+                if (client_fd < 0)
+                        continue;
+
+                if (nfds == GFDB_RING_MAX_CONSUMERS + 2) {
+                        LOG_IT (log_error, "Too many consumers, rejecting");
+                        close (client_fd);
+                        continue;
+                }
+
+                if (gfdb_ring_send_memfd (server, client_fd)) {
+                        close (client_fd);
+                        continue;
+                }
+
+                fds[nfds].fd = client_fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+                __atomic_add_fetch (&server->consumer_count, 1,
+                                    __ATOMIC_RELEASE);
+                __atomic_add_fetch (&server->ring->space_futex, 1,
+                                    __ATOMIC_RELEASE);
+                gfdb_futex_wake (&server->ring->space_futex);
+        }
+
+        for (i = 2; i < nfds; i++)
+                close (fds[i].fd);
+
+        return NULL;
+}
+
+
+static int
+gfdb_ring_server_start (gfdb_ring_server_t *server, const char *socket_path,
+                        size_t ring_size)
+{
+        int ret                         = -1;
+        struct sockaddr_un addr         = {0};
+
+        server->memfd = -1;
+        server->listen_fd = -1;
+        server->stop_pipe[0] = server->stop_pipe[1] = -1;
+        server->socket_path = socket_path;
+
+        if (strlen (socket_path) >= sizeof (addr.sun_path)) {
+                LOG_IT (log_error, "Socket path too long : %s", socket_path);
+                goto out;
+        }
+
+        if (gfdb_ring_create (server, ring_size))
+                goto out;
+
+        if (pipe2 (server->stop_pipe, O_CLOEXEC)) {
+                LOG_IT (log_error, "Failed to create pipe : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        server->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (server->listen_fd < 0) {
+                LOG_IT (log_error, "Failed to create socket : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        addr.sun_family = AF_UNIX;
+        strcpy (addr.sun_path, socket_path);
+        unlink (socket_path);
+        if (bind (server->listen_fd, (struct sockaddr *)&addr,
+                  sizeof (addr)) ||
+            listen (server->listen_fd, GFDB_RING_MAX_CONSUMERS)) {
+                LOG_IT (log_error, "Failed to listen on %s : %s",
+                        socket_path, strerror (errno));
+                goto out;
+        }
+
+        ret = pthread_create (&server->control_thread, NULL,
+                              gfdb_ring_control_thread, server);
+        if (ret) {
+                LOG_IT (log_error, "Failed to start control thread : %s",
+                        strerror (ret));
+                ret = -1;
+                goto out;
+        }
+        server->control_started = _true;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static void
+gfdb_ring_server_stop (gfdb_ring_server_t *server)
+{
+        if (server->control_started) {
+                if (write (server->stop_pipe[1], "x", 1) != 1)
+                        LOG_IT (log_error, "Failed to stop control thread");
+                pthread_join (server->control_thread, NULL);
+        }
+        if (server->listen_fd >= 0) {
+                close (server->listen_fd);
+                unlink (server->socket_path);
+        }
+        if (server->stop_pipe[0] >= 0)
+                close (server->stop_pipe[0]);
+        if (server->stop_pipe[1] >= 0)
+                close (server->stop_pipe[1]);
+        if (server->ring)
+                munmap (server->ring, server->map_size);
+        if (server->memfd >= 0)
+                close (server->memfd);
+        free (server->scratch);
+}
+
+
+/* Sleeps until a consumer gives back slots, or the consumers change */
+static void
+gfdb_ring_wait_for_event (gfdb_ring_server_t *server)
+{
+        gfdb_ring_shared_t *ring        = server->ring;
+        uint32_t val                    = 0;
+
+        val = __atomic_load_n (&ring->space_futex, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch (&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+        gfdb_futex_wait (&ring->space_futex, val, GFDB_RING_WAIT_MS);
+        __atomic_sub_fetch (&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Sleeps until a consumer gives back the slot at pos */
+static void
+gfdb_ring_wait_for_space (gfdb_ring_server_t *server, uint64_t pos)
+{
+        gfdb_ring_shared_t *ring        = server->ring;
+        uint32_t val                    = 0;
+
+        val = __atomic_load_n (&ring->space_futex, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch (&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+        /* A consumer that freed the slot before space_waiters went up
+         * skipped the wake, so look at the slot again before sleeping */
+        if (__atomic_load_n (gfdb_ring_sequence (ring, pos),
+                             __ATOMIC_ACQUIRE) != pos)
+                gfdb_futex_wait (&ring->space_futex, val, GFDB_RING_WAIT_MS);
+        __atomic_sub_fetch (&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Waits till the span of slot_count slots at pos is free to be written */
+static void
+gfdb_ring_reserve (gfdb_ring_server_t *server, uint64_t pos,
+                   uint32_t slot_count)
+{
+        gfdb_ring_shared_t *ring        = server->ring;
+        uint32_t i                      = 0;
+
+        for (i = 0; i < slot_count; i++) {
+                while (__atomic_load_n (gfdb_ring_sequence (ring, pos + i),
+                                        __ATOMIC_ACQUIRE) != pos + i)
+                        gfdb_ring_wait_for_space (server, pos + i);
+        }
+}
+
+
+static void
+gfdb_ring_publish (gfdb_ring_shared_t *ring, uint64_t pos, uint32_t span)
+{
+        __atomic_store_n (gfdb_ring_sequence (ring, pos), pos + 1,
+                          __ATOMIC_RELEASE);
+        __atomic_store_n (&ring->enqueue_pos, pos + span, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n (&ring->data_waiters, __ATOMIC_SEQ_CST)) {
+                __atomic_add_fetch (&ring->data_futex, 1, __ATOMIC_RELEASE);
+                gfdb_futex_wake (&ring->data_futex);
+        }
+}
+
+
+/* Copies a serialized query record into the ring, blocking while full */
+static int
+gfdb_ring_put (gfdb_ring_server_t *server, const char *record,
+               uint32_t record_len)
+{
+        gfdb_ring_shared_t *ring        = server->ring;
+        gfdb_ring_entry_t entry         = {0};
+        uint64_t pos                    = 0;
+        uint64_t first                  = 0;
+        uint32_t span                   = 0;
+        size_t total                    = 0;
+
+        total = sizeof (gfdb_ring_entry_t) + record_len;
+        span = (total + ring->slot_size - 1) / ring->slot_size;
+        if (span > ring->slot_count) {
+                LOG_IT (log_error, "Query record of %u bytes does not fit "
+                        "in the ring", record_len);
+                return -1;
+        }
+
+        /* Hold off while nobody is attached to take the records */
+        while (!__atomic_load_n (&server->consumer_count, __ATOMIC_ACQUIRE))
+                gfdb_ring_wait_for_event (server);
+
+        pos = ring->enqueue_pos;
+        first = pos & (ring->slot_count - 1);
+
+        /* Pad till the end of the ring so that the span is contiguous */
+        if (first + span > ring->slot_count) {
+                entry.record_len = 0;
+                entry.span = ring->slot_count - first;
+                gfdb_ring_reserve (server, pos, entry.span);
+                memcpy (gfdb_ring_slot (ring, pos), &entry, sizeof (entry));
+                gfdb_ring_publish (ring, pos, entry.span);
+                pos += entry.span;
+        }
+
+        entry.record_len = record_len;
+        entry.span = span;
+        gfdb_ring_reserve (server, pos, span);
+        memcpy (gfdb_ring_slot (ring, pos), &entry, sizeof (entry));
+        memcpy (gfdb_ring_slot (ring, pos) + sizeof (entry), record,
+                record_len);
+        gfdb_ring_publish (ring, pos, span);
+
+        return 0;
+}
+
+
+static int
+gfdb_ring_put_record_cbk (gfdb_query_record_t *query_record, void *data)
+{
+        gfdb_ring_server_t *server      = data;
+        char *new_scratch               = NULL;
+        int len                         = 0;
+
+        len = gfdb_query_record_serialized_length (query_record);
+        if ((size_t)len > server->scratch_size) {
+                new_scratch = realloc (server->scratch, len);
+                if (!new_scratch) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "serialization buffer");
+                        return -1;
+                }
+                server->scratch = new_scratch;
+                server->scratch_size = len;
+        }
+
+        len = gfdb_query_record_serialize (query_record, server->scratch);
+        if (len < 0)
+                return -1;
+
+        return gfdb_ring_put (server, server->scratch, len);
+}
+
+
+/* Marks the end of the records and waits for the consumers to drain them */
+static void
+gfdb_ring_finish (gfdb_ring_server_t *server)
+{
+        gfdb_ring_shared_t *ring = server->ring;
+
+        __atomic_store_n (&ring->eof, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch (&ring->data_futex, 1, __ATOMIC_RELEASE);
+        gfdb_futex_wake (&ring->data_futex);
+
+        while (__atomic_load_n (&server->consumer_count, __ATOMIC_ACQUIRE) ||
+               __atomic_load_n (&ring->dequeue_pos, __ATOMIC_ACQUIRE) !=
+               ring->enqueue_pos)
+                gfdb_ring_wait_for_event (server);
+}
+
+
+/* Decodes the query file once and serves the records to the consumers */
+int
+gfdb_serve_query_file (int query_fd, const gfdb_reader_conf_t *conf)
+{
+        int ret                         = -1;
+        gfdb_ring_server_t server       = {0};
+
+        if (gfdb_ring_server_start (&server, conf->serve_socket_path,
+                                    conf->ring_size))
+                goto out;
+
+        LOG_IT (log_info, "Serving query records on %s",
+                conf->serve_socket_path);
+
+        ret = gfdb_process_query_file (query_fd, conf,
+                                       gfdb_ring_put_record_cbk, &server);
+        if (ret)
+                goto out;
+
+        gfdb_ring_finish (&server);
+        ret = 0;
+out:
+        gfdb_ring_server_stop (&server);
+        return ret;
+}
+
+
+/* Receives the memfd of the ring from the server and maps it */
+static int
+gfdb_ring_attach (int sock_fd, gfdb_ring_shared_t **ring, size_t *map_size)
+{
+        int ret                         = -1;
+        struct msghdr msg               = {0};
+        struct iovec iov                = {0};
+        struct cmsghdr *cmsg            = NULL;
+        uint64_t size                   = 0;
+        int memfd                       = -1;
+        void *map                       = MAP_FAILED;
+        union {
+                char            buf[CMSG_SPACE (sizeof (int))];
+                struct cmsghdr  align;
+        } control;
+
+        memset (&control, 0, sizeof (control));
+        iov.iov_base = &size;
+        iov.iov_len = sizeof (size);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof (control.buf);
+
+        if (recvmsg (sock_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof (size)) {
+                LOG_IT (log_error, "Failed to receive ring from server");
+                goto out;
+        }
+
+        cmsg = CMSG_FIRSTHDR (&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS) {
+                LOG_IT (log_error, "Server did not send the ring");
+                goto out;
+        }
+        memcpy (&memfd, CMSG_DATA (cmsg), sizeof (int));
+
+        map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    memfd, 0);
+        if (map == MAP_FAILED) {
+                LOG_IT (log_error, "Failed to map ring : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        if (__atomic_load_n (&((gfdb_ring_shared_t *)map)->magic,
+                             __ATOMIC_ACQUIRE) != GFDB_RING_MAGIC) {
+                LOG_IT (log_error, "Invalid ring received from server");
+                munmap (map, size);
+                goto out;
+        }
+
+        *ring = map;
+        *map_size = size;
+        ret = 0;
+out:
+        if (memfd >= 0)
+                close (memfd);
+        return ret;
+}
+
+
+/* Claims the next record from the ring.
+ * Copies the serialized record into *buffer, growing it when needed, and
+ * returns its length. Returns 0 once the server is done and the ring is
+ * drained, -1 on failure.
+ * */
+static int
+gfdb_ring_get (gfdb_ring_shared_t *ring, char **buffer, size_t *buffer_size)
+{
+        int ret                         = 0;
+        gfdb_ring_entry_t entry         = {0};
+        uint64_t pos                    = 0;
+        uint64_t seq                    = 0;
+        uint32_t val                    = 0;
+        uint32_t i                      = 0;
+        char *new_buffer                = NULL;
+
+        for (;;) {
+                pos = __atomic_load_n (&ring->dequeue_pos, __ATOMIC_ACQUIRE);
+                seq = __atomic_load_n (gfdb_ring_sequence (ring, pos),
+                                       __ATOMIC_ACQUIRE);
+
+                if (seq == pos + 1) {
+                        memcpy (&entry, gfdb_ring_slot (ring, pos),
+                                sizeof (entry));
+                        if (!__atomic_compare_exchange_n (&ring->dequeue_pos,
+                                        &pos, pos + entry.span, _false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                                continue;
+
+                        /* The span is ours until the slots are released */
+                        ret = entry.record_len;
+                        if (entry.record_len > *buffer_size) {
+                                new_buffer = realloc (*buffer,
+                                                      entry.record_len);
+                                if (new_buffer) {
+                                        *buffer = new_buffer;
+                                        *buffer_size = entry.record_len;
+                                } else {
+                                        LOG_IT (log_error, "Memory "
+                                                "allocation failed for "
+                                                "record buffer");
+                                        ret = -1;
+                                }
+                        }
+                        if (ret > 0)
+                                memcpy (*buffer, gfdb_ring_slot (ring, pos) +
+                                        sizeof (entry), entry.record_len);
+
+                        for (i = 0; i < entry.span; i++)
+                                __atomic_store_n (gfdb_ring_sequence (ring,
+                                                        pos + i),
+                                                  pos + i + ring->slot_count,
+                                                  __ATOMIC_RELEASE);
+
+                        if (__atomic_load_n (&ring->space_waiters,
+                                             __ATOMIC_SEQ_CST)) {
+                                __atomic_add_fetch (&ring->space_futex, 1,
+                                                    __ATOMIC_RELEASE);
+                                gfdb_futex_wake (&ring->space_futex);
+                        }
+
+                        /* Padding entry, move on to the next one */
+                        if (ret == 0)
+                                continue;
+
+                        return ret;
+                }
+
+                /* Another consumer took it, retry */
+                if ((int64_t)(seq - (pos + 1)) > 0)
+                        continue;
+
+                /* Empty */
+                if (__atomic_load_n (&ring->eof, __ATOMIC_ACQUIRE) &&
+                    __atomic_load_n (&ring->dequeue_pos, __ATOMIC_ACQUIRE) ==
+                    __atomic_load_n (&ring->enqueue_pos, __ATOMIC_ACQUIRE))
+                        return 0;
+
+                val = __atomic_load_n (&ring->data_futex, __ATOMIC_ACQUIRE);
+                __atomic_add_fetch (&ring->data_waiters, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n (gfdb_ring_sequence (ring, pos),
+                                     __ATOMIC_ACQUIRE) != pos + 1 &&
+                    !__atomic_load_n (&ring->eof, __ATOMIC_ACQUIRE))
+                        gfdb_futex_wait (&ring->data_futex, val,
+                                         GFDB_RING_WAIT_MS);
+                __atomic_sub_fetch (&ring->data_waiters, 1, __ATOMIC_SEQ_CST);
+        }
+}
+
+
+/* Attaches to a serving gfdb_query_file_reader and hands every record
+ * it gets from the ring to cbk.
+ * */
+int
+gfdb_consume_query_ring (const char *socket_path,
+                         gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                                 = -1;
+        int sock_fd                             = -1;
+        struct sockaddr_un addr                 = {0};
+        gfdb_ring_shared_t *ring                = NULL;
+        size_t map_size                         = 0;
+        char *buffer                            = NULL;
+        size_t buffer_size                      = 0;
+        int record_len                          = 0;
+        gfdb_query_record_t *query_record       = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, socket_path, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, cbk, out);
+
+        if (strlen (socket_path) >= sizeof (addr.sun_path)) {
+                LOG_IT (log_error, "Socket path too long : %s", socket_path);
+                goto out;
+        }
+
+        sock_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock_fd < 0) {
+                LOG_IT (log_error, "Failed to create socket : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        addr.sun_family = AF_UNIX;
+        strcpy (addr.sun_path, socket_path);
+        if (connect (sock_fd, (struct sockaddr *)&addr, sizeof (addr))) {
+                LOG_IT (log_error, "Failed to connect to %s : %s",
+                        socket_path, strerror (errno));
+                goto out;
+        }
+
+        if (gfdb_ring_attach (sock_fd, &ring, &map_size))
+                goto out;
+
+        while ((record_len = gfdb_ring_get (ring, &buffer,
+                                            &buffer_size)) > 0) {
+                ret = gfdb_query_record_deserialize (buffer, record_len,
+                                                     &query_record);
+                if (ret) {
+                        LOG_IT (log_error, "Failed to de-serialize query "
+                                "record from ring");
+                        goto out;
+                }
+
+                ret = cbk (query_record, data);
+                gfdb_query_record_free (query_record);
+                query_record = NULL;
+                if (ret)
+                        goto out;
+        }
+
+        ret = (record_len < 0) ? -1 : 0;
+out:
+        if (ring)
+                munmap (ring, map_size);
+        /* Closing the control connection detaches from the server */
+        if (sock_fd >= 0)
+                close (sock_fd);
+        free (buffer);
+        return ret;
+}
+
+
+#ifdef USE_GFDB
+/******************************************************************************
+                READING THE GFDB SQLITE DATABASE DIRECTLY
+*******************************************************************************/
+/******************************************************************************
+ The query file is a dump of the CTR database of the brick. With --gfdb the
+ database is opened read-only and the same heat/time threshold queries the
+ tier daemon runs are stepped with a prepared statement, so that the records
+ go straight into the output pipeline (or into a query file written with
+ batched writes) without the write and re-read of the intermediate file.
+
+ One row is returned per hard link, ordered by GF_ID, and the consecutive
+ rows of a GF_ID are folded into a single query record. Files without a link
+ (LEFT JOIN) give a query record with no links, as they do in the tier
+ daemon's query callback.
+
+ The write and read times are stored as seconds and microseconds, thresholds
+ are compared as (SEC * 1000000 + MSEC).
+ * ****************************************************************************/
+
+#define GFDB_SQL_COLUMNS        "GF_FILE_TB.GF_ID, GF_FLINK_TB.GF_PID, "\
+                                "GF_FLINK_TB.FNAME"
+#define GFDB_SQL_FROM           " FROM GF_FILE_TB LEFT JOIN GF_FLINK_TB "\
+                                "ON GF_FILE_TB.GF_ID = GF_FLINK_TB.GF_ID "
+#define GFDB_SQL_WRITE_TIME     "(GF_FILE_TB.W_SEC * 1000000 + "\
+                                "GF_FILE_TB.W_MSEC)"
+#define GFDB_SQL_READ_TIME      "(GF_FILE_TB.W_READ_SEC * 1000000 + "\
+                                "GF_FILE_TB.W_READ_MSEC)"
+#define GFDB_SQL_ORDER          " ORDER BY GF_FILE_TB.GF_ID;"
+
+/* ?1 time threshold, ?2 write frequency, ?3 read frequency */
+static const char *gfdb_sql_queries[] = {
+        [GFDB_QUERY_ALL] =
+                "SELECT " GFDB_SQL_COLUMNS GFDB_SQL_FROM GFDB_SQL_ORDER,
+
+        [GFDB_QUERY_CHANGED] =
+                "SELECT " GFDB_SQL_COLUMNS GFDB_SQL_FROM
+                "WHERE ((" GFDB_SQL_WRITE_TIME " >= ?1 AND "
+                "GF_FILE_TB.WRITE_FREQ_CNTR >= ?2) OR "
+                "(" GFDB_SQL_READ_TIME " >= ?1 AND "
+                "GF_FILE_TB.READ_FREQ_CNTR >= ?3))"
+                GFDB_SQL_ORDER,
+
+        [GFDB_QUERY_UNCHANGED] =
+                "SELECT " GFDB_SQL_COLUMNS GFDB_SQL_FROM
+                "WHERE ((" GFDB_SQL_WRITE_TIME " < ?1 AND "
+                GFDB_SQL_READ_TIME " < ?1) OR "
+                "(" GFDB_SQL_WRITE_TIME " >= ?1 AND "
+                "GF_FILE_TB.WRITE_FREQ_CNTR < ?2) OR "
+                "(" GFDB_SQL_READ_TIME " >= ?1 AND "
+                "GF_FILE_TB.READ_FREQ_CNTR < ?3))"
+                GFDB_SQL_ORDER,
+};
+
+/* Read-only tuning, the database belongs to the brick process */
+#define GFDB_SQL_PRAGMAS        "PRAGMA query_only = ON;"\
+                                "PRAGMA temp_store = MEMORY;"\
+                                "PRAGMA cache_size = -65536;"\
+                                "PRAGMA mmap_size = 268435456;"
+
+#define GFDB_SQL_BUSY_TIMEOUT_MS        5000
+
+
+static int
+gfdb_sqlite_open (const char *db_path, sqlite3 **db)
+{
+        int ret         = -1;
+        char *errmsg    = NULL;
+
+        ret = sqlite3_open_v2 (db_path, db, SQLITE_OPEN_READONLY |
+                               SQLITE_OPEN_NOMUTEX, NULL);
+        if (ret != SQLITE_OK) {
+                LOG_IT (log_error, "Failed to open gfdb %s : %s", db_path,
+                        *db ? sqlite3_errmsg (*db) : sqlite3_errstr (ret));
+                ret = -1;
+                goto out;
+        }
+
+        sqlite3_busy_timeout (*db, GFDB_SQL_BUSY_TIMEOUT_MS);
+
+        ret = sqlite3_exec (*db, GFDB_SQL_PRAGMAS, NULL, NULL, &errmsg);
+        if (ret != SQLITE_OK) {
+                LOG_IT (log_error, "Failed to set pragmas on %s : %s",
+                        db_path, errmsg);
+                sqlite3_free (errmsg);
+                ret = -1;
+                goto out;
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Adds the link of the current row, if any, to the query record */
+static int
+gfdb_sqlite_add_link (sqlite3_stmt *stmt, gfdb_query_record_t *query_record)
+{
+        int ret                         = -1;
+        const char *pgfid_str           = NULL;
+        const char *base_name           = NULL;
+        uuid_t pgfid                    = {0};
+
+        pgfid_str = (const char *)sqlite3_column_text (stmt, 1);
+        base_name = (const char *)sqlite3_column_text (stmt, 2);
+
+        /* File without a link */
+        if (!pgfid_str || !base_name) {
+                ret = 0;
+                goto out;
+        }
+
+        if (gf_uuid_parse (pgfid_str, pgfid)) {
+                LOG_IT (log_error, "Invalid GF_PID %s in gfdb", pgfid_str);
+                goto out;
+        }
+
+        if (strlen (base_name) > GF_NAME_MAX) {
+                LOG_IT (log_error, "FNAME %s in gfdb is too long",
+                        base_name);
+                goto out;
+        }
+
+        ret = gfdb_add_link_to_query_record (query_record, pgfid,
+                                             (char *)base_name);
+out:
+        return ret;
+}
+
+
+/* Runs the configured query on the gfdb and hands every record to cbk */
+int
+gfdb_sqlite_query_records (const gfdb_reader_conf_t *conf,
+                           gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                                 = -1;
+        sqlite3 *db                             = NULL;
+        sqlite3_stmt *stmt                      = NULL;
+        const char *gfid_str                    = NULL;
+        uuid_t gfid                             = {0};
+        gfdb_query_record_t *query_record       = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, conf, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, cbk, out);
+
+        if (gfdb_sqlite_open (conf->gfdb_path, &db))
+                goto out;
+
+        ret = sqlite3_prepare_v2 (db, gfdb_sql_queries[conf->query_type], -1,
+                                  &stmt, NULL);
+        if (ret != SQLITE_OK) {
+                LOG_IT (log_error, "Failed to prepare query : %s",
+                        sqlite3_errmsg (db));
+                ret = -1;
+                goto out;
+        }
+
+        if (conf->query_type != GFDB_QUERY_ALL) {
+                if (sqlite3_bind_int64 (stmt, 1, conf->query_time_usec) ||
+                    sqlite3_bind_int64 (stmt, 2, conf->write_freq) ||
+                    sqlite3_bind_int64 (stmt, 3, conf->read_freq)) {
+                        LOG_IT (log_error, "Failed to bind query : %s",
+                                sqlite3_errmsg (db));
+                        ret = -1;
+                        goto out;
+                }
+        }
+
+        while ((ret = sqlite3_step (stmt)) == SQLITE_ROW) {
+                gfid_str = (const char *)sqlite3_column_text (stmt, 0);
+                if (!gfid_str || gf_uuid_parse (gfid_str, gfid)) {
+                        LOG_IT (log_error, "Invalid GF_ID %s in gfdb",
+                                gfid_str ? gfid_str : "(null)");
+                        ret = -1;
+                        goto out;
+                }
+
+                /* Next file, the previous record is complete */
+                if (query_record &&
+                    memcmp (query_record->gfid, gfid, UUID_LEN)) {
+                        ret = cbk (query_record, data);
+                        gfdb_query_record_free (query_record);
+                        query_record = NULL;
+                        if (ret)
+                                goto out;
+                }
+
+                if (!query_record) {
+                        query_record = gfdb_query_record_new ();
+                        if (!query_record) {
+                                ret = -1;
+                                goto out;
+                        }
+                        gf_uuid_copy (query_record->gfid, gfid);
+                }
+
+                if (gfdb_sqlite_add_link (stmt, query_record)) {
+                        ret = -1;
+                        goto out;
+                }
+        }
+
+        if (ret != SQLITE_DONE) {
+                LOG_IT (log_error, "Failed querying gfdb : %s",
+                        sqlite3_errmsg (db));
+                ret = -1;
+                goto out;
+        }
+
+        ret = 0;
+        if (query_record)
+                ret = cbk (query_record, data);
+out:
+        gfdb_query_record_free (query_record);
+        if (stmt)
+                sqlite3_finalize (stmt);
+        if (db)
+                sqlite3_close (db);
+        return ret;
+}
+#endif /* USE_GFDB */
+
+
+/******************************************************************************
+                BLOOM FILTER OF GFID SETS
+*******************************************************************************/
+/******************************************************************************
+ A blocked Bloom filter of the GFIDs of one or more query files, written to
+ a file other tools can mmap and probe with gfdb_bloom_contains ().
+
+ Every GFID maps to a single 64 byte (cache line) block, so a lookup touches
+ one cache line. Within the block, made of 8 64-bit lanes, the GFID sets one
+ bit in each lane (split block Bloom filter). The eight bit positions are
+ computed independently from one 32-bit hash and eight odd salts, so the
+ probe is a straight line of multiplies, shifts and ANDs that the compiler
+ (or the AVX2 path) turns into vector instructions.
+
+ The number of blocks is chosen for the requested false positive rate, from
+ the expected rate of a blocked filter with Poisson distributed block loads.
+
+ Bloom file format (host endian, same as the query file):
+   +------------------------------------------------------------------+
+   | MAGIC | VERSION | LANES | BLOCK COUNT | KEY COUNT | FPR | PAD    |
+   +------------------------------------------------------------------+
+     8 B      4 B      4 B       8 B           8 B       8 B   ->64 B
+   followed by BLOCK COUNT blocks of 64 bytes.
+ * ****************************************************************************/
+
+#define GFDB_BLOOM_MAGIC                0x314D4C4242444647ULL /* GFDBBLM1 */
+#define GFDB_BLOOM_VERSION              1
+#define GFDB_BLOOM_LANES                8
+#define GFDB_BLOOM_BLOCK_SIZE           (GFDB_BLOOM_LANES * sizeof (uint64_t))
+#define GFDB_BLOOM_DEFAULT_FPR          0.01
+
+typedef struct gfdb_bloom_header {
+        uint64_t                        magic;
+        uint32_t                        version;
+        uint32_t                        lanes;
+        uint64_t                        block_count;
+        uint64_t                        key_count;
+        double                          fpr;
+        char                            pad[24];
+} gfdb_bloom_header_t;
+
+/*Mapped Bloom filter*/
+typedef struct gfdb_bloom {
+        gfdb_bloom_header_t             *header;
+        uint64_t                        *blocks;
+        uint64_t                        block_count;
+        size_t                          map_size;
+} gfdb_bloom_t;
+
+static const uint32_t gfdb_bloom_salt[GFDB_BLOOM_LANES] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+        0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+
+/* Mixes the two halves of the GFID; GFIDs like the root one are not random */
+static inline uint64_t
+gfdb_bloom_hash (const uuid_t gfid)
+{
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+        uint64_t h  = 0;
+
+        memcpy (&lo, gfid, sizeof (lo));
+        memcpy (&hi, gfid + sizeof (lo), sizeof (hi));
+
+        h = lo ^ (hi * 0x9e3779b97f4a7c15ULL);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
+
+/* Block from the upper 32 bits of the hash, without a division */
+static inline uint64_t *
+gfdb_bloom_block (uint64_t *blocks, uint64_t block_count, uint64_t hash)
+{
+        return blocks + ((hash >> 32) * block_count >> 32) * GFDB_BLOOM_LANES;
+}
+
+
+/* One bit per lane from the lower 32 bits of the hash */
+static inline void
+gfdb_bloom_mask (uint64_t hash, uint64_t mask[GFDB_BLOOM_LANES])
+{
+        uint32_t key    = (uint32_t)hash;
+        int i           = 0;
+
+        for (i = 0; i < GFDB_BLOOM_LANES; i++)
+                mask[i] = 1ULL << ((key * gfdb_bloom_salt[i]) >> 26);
+}
+
+
+static void
+gfdb_bloom_add (uint64_t *blocks, uint64_t block_count, const uuid_t gfid)
+{
+        uint64_t hash                           = 0;
+        uint64_t *block                         = NULL;
+        uint64_t mask[GFDB_BLOOM_LANES]         = {0};
+        int i                                   = 0;
+
+        hash = gfdb_bloom_hash (gfid);
+        block = gfdb_bloom_block (blocks, block_count, hash);
+        gfdb_bloom_mask (hash, mask);
+
+        for (i = 0; i < GFDB_BLOOM_LANES; i++)
+                block[i] |= mask[i];
+}
+
+
+/* Returns _true if the GFID may be in the set, _false if it surely is not */
+boolean_t
+gfdb_bloom_contains (const gfdb_bloom_t *bloom, const uuid_t gfid)
+{
+        uint64_t hash                           = 0;
+        const uint64_t *block                   = NULL;
+
+        hash = gfdb_bloom_hash (gfid);
+        block = gfdb_bloom_block (bloom->blocks, bloom->block_count, hash);
+
+#ifdef __AVX2__
+        {
+                const __m256i salt = _mm256_loadu_si256 (
+                                        (const __m256i *)gfdb_bloom_salt);
+                const __m256i ones = _mm256_set1_epi64x (1);
+                __m256i pos;
+                __m256i mask_lo;
+                __m256i mask_hi;
+
+                pos = _mm256_mullo_epi32 (_mm256_set1_epi32 ((uint32_t)hash),
+                                          salt);
+                pos = _mm256_srli_epi32 (pos, 26);
+                mask_lo = _mm256_sllv_epi64 (ones, _mm256_cvtepu32_epi64 (
+                                        _mm256_castsi256_si128 (pos)));
+                mask_hi = _mm256_sllv_epi64 (ones, _mm256_cvtepu32_epi64 (
+                                        _mm256_extracti128_si256 (pos, 1)));
+
+                /* All the mask bits must be set in the block */
+                return (_mm256_testc_si256 (_mm256_loadu_si256 (
+                                        (const __m256i *)block), mask_lo) &
+                        _mm256_testc_si256 (_mm256_loadu_si256 (
+                                        (const __m256i *)(block + 4)),
+                                        mask_hi)) ? _true : _false;
+        }
+#else
+        {
+                uint64_t mask[GFDB_BLOOM_LANES]         = {0};
+                uint64_t missing                        = 0;
+                int i                                   = 0;
+
+                gfdb_bloom_mask (hash, mask);
+                for (i = 0; i < GFDB_BLOOM_LANES; i++)
+                        missing |= mask[i] & ~block[i];
+
+                return missing ? _false : _true;
+        }
+#endif
+}
+
+
+/* Maps a Bloom filter file read-only */
+int
+gfdb_bloom_open (const char *bloom_path, gfdb_bloom_t *bloom)
+{
+        int ret                         = -1;
+        int fd                          = -1;
+        struct stat stat_buff           = {0};
+        void *map                       = MAP_FAILED;
+        gfdb_bloom_header_t *header     = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, bloom_path, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, bloom, out);
+
+        fd = open (bloom_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat (fd, &stat_buff)) {
+                LOG_IT (log_error, "Failed to open %s : %s", bloom_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        if (stat_buff.st_size < (off_t)sizeof (gfdb_bloom_header_t)) {
+                LOG_IT (log_error, "%s is not a bloom filter", bloom_path);
+                goto out;
+        }
+
+        map = mmap (NULL, stat_buff.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                LOG_IT (log_error, "Failed to map %s : %s", bloom_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        header = map;
+        if (header->magic != GFDB_BLOOM_MAGIC ||
+            header->version != GFDB_BLOOM_VERSION ||
+            header->lanes != GFDB_BLOOM_LANES || header->block_count == 0 ||
+            header->block_count > (stat_buff.st_size - sizeof (*header)) /
+                                  GFDB_BLOOM_BLOCK_SIZE) {
+                LOG_IT (log_error, "%s is not a valid bloom filter",
+                        bloom_path);
+                goto out;
+        }
+
+        bloom->header = header;
+        bloom->blocks = (uint64_t *)(header + 1);
+        bloom->block_count = header->block_count;
+        bloom->map_size = stat_buff.st_size;
+        map = MAP_FAILED;
+
+        ret = 0;
+out:
+        if (map != MAP_FAILED)
+                munmap (map, stat_buff.st_size);
+        if (fd >= 0)
+                close (fd);
+        return ret;
+}
+
+
+void
+gfdb_bloom_close (gfdb_bloom_t *bloom)
+{
+        if (bloom && bloom->header) {
+                munmap (bloom->header, bloom->map_size);
+                bloom->header = NULL;
+        }
+}
+
+
+/* False positive rate of the blocked filter at a mean block load */
+static double
+gfdb_bloom_expected_fpr (double keys_per_block)
+{
+        double probability      = 0;
+        double fpr              = 0;
+        double lane_bit_free    = 0;
+        int load                = 0;
+        int max_load            = 0;
+
+        /* Keys per block are Poisson distributed */
+        probability = exp (-keys_per_block);
+        max_load = (int)(keys_per_block * 4) + 64;
+        for (load = 0; load <= max_load; load++) {
+                lane_bit_free = pow (1.0 - 1.0 / 64, load);
+                fpr += probability * pow (1.0 - lane_bit_free,
+                                          GFDB_BLOOM_LANES);
+                probability *= keys_per_block / (load + 1);
+        }
+
+        return fpr;
+}
+
+
+/* Smallest number of blocks keeping the rate for key_count keys */
+static uint64_t
+gfdb_bloom_block_count (uint64_t key_count, double fpr)
+{
+        double low      = 1e-6;
+        double high     = 64;
+        double mid      = 0;
+        int i           = 0;
+        double blocks   = 0;
+
+        /* Bisect the highest mean block load within the rate */
+        for (i = 0; i < 64; i++) {
+                mid = (low + high) / 2;
+                if (gfdb_bloom_expected_fpr (mid) <= fpr)
+                        low = mid;
+                else
+                        high = mid;
+        }
+
+        blocks = ceil ((double)(key_count ? key_count : 1) / low);
+        return (blocks < 1) ? 1 : (uint64_t)blocks;
+}
+
+
+/* Calls fn for the GFID of every record of the query files */
+static int
+gfdb_bloom_scan_gfids (char **query_file_paths, int query_file_count,
+                       void (*fn) (const uuid_t gfid, void *data),
+                       void *data)
+{
+        int ret                         = -1;
+        int fd                          = -1;
+        int i                           = 0;
+        char *record                    = NULL;
+        int record_len                  = 0;
+        gfdb_record_scanner_t scanner   = {0};
+
+        for (i = 0; i < query_file_count; i++) {
+                fd = open (query_file_paths[i], O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        LOG_IT (log_error, "Failed to open %s : %s",
+                                query_file_paths[i], strerror (errno));
+                        goto out;
+                }
+                posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+                if (gfdb_record_scanner_init (&scanner, fd))
+                        goto out;
+
+                /* The GFID is the first field of a serialized record */
+                while ((ret = gfdb_record_scanner_next (&scanner, &record,
+                                                        &record_len)) > 0)
+                        fn ((const unsigned char *)record, data);
+
+                gfdb_record_scanner_cleanup (&scanner);
+                close (fd);
+                fd = -1;
+
+                if (ret < 0) {
+                        LOG_IT (log_error, "Failed to scan %s",
+                                query_file_paths[i]);
+                        goto out;
+                }
+        }
+
+        ret = 0;
+out:
+        gfdb_record_scanner_cleanup (&scanner);
+        if (fd >= 0)
+                close (fd);
+        return ret;
+}
+
+
+static void
+gfdb_bloom_count_cbk (const uuid_t gfid, void *data)
+{
+        (*(uint64_t *)data)++;
+}
+
+
+static void
+gfdb_bloom_add_cbk (const uuid_t gfid, void *data)
+{
+        gfdb_bloom_t *bloom = data;
+
+        gfdb_bloom_add (bloom->blocks, bloom->block_count, gfid);
+}
+
+
+/* Builds the Bloom filter of the GFIDs of the query files into bloom_path.
+ * The query files are scanned twice, once to size the filter. The filter
+ * is built in a temporary file renamed over bloom_path, so that readers
+ * mapping the old filter are not disturbed.
+ * */
+int
+gfdb_bloom_build (const char *bloom_path, double fpr,
+                  char **query_file_paths, int query_file_count)
+{
+        int ret                         = -1;
+        int fd                          = -1;
+        char *tmp_path                  = NULL;
+        uint64_t key_count              = 0;
+        gfdb_bloom_t bloom              = {0};
+        void *map                       = MAP_FAILED;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, bloom_path, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, query_file_paths, out);
+
+        if (gfdb_bloom_scan_gfids (query_file_paths, query_file_count,
+                                   gfdb_bloom_count_cbk, &key_count))
+                goto out;
+
+        bloom.block_count = gfdb_bloom_block_count (key_count, fpr);
+        bloom.map_size = sizeof (gfdb_bloom_header_t) +
+                         bloom.block_count * GFDB_BLOOM_BLOCK_SIZE;
+
+        if (asprintf (&tmp_path, "%s.XXXXXX", bloom_path) < 0) {
+                tmp_path = NULL;
+                LOG_IT (log_error, "Memory allocation failed for path");
+                goto out;
+        }
+
+        fd = mkstemp (tmp_path);
+        if (fd < 0) {
+                LOG_IT (log_error, "Failed to create %s : %s", tmp_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        if (ftruncate (fd, bloom.map_size)) {
+                LOG_IT (log_error, "Failed to size %s : %s", tmp_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        map = mmap (NULL, bloom.map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                LOG_IT (log_error, "Failed to map %s : %s", tmp_path,
+                        strerror (errno));
+                goto out;
+        }
+        bloom.header = map;
+        bloom.blocks = (uint64_t *)(bloom.header + 1);
+
+        if (gfdb_bloom_scan_gfids (query_file_paths, query_file_count,
+                                   gfdb_bloom_add_cbk, &bloom))
+                goto out;
+
+        bloom.header->version = GFDB_BLOOM_VERSION;
+        bloom.header->lanes = GFDB_BLOOM_LANES;
+        bloom.header->block_count = bloom.block_count;
+        bloom.header->key_count = key_count;
+        bloom.header->fpr = fpr;
+        /* Magic last, a filter is valid only once complete */
+        bloom.header->magic = GFDB_BLOOM_MAGIC;
+
+        if (msync (map, bloom.map_size, MS_SYNC) || fsync (fd) ||
+            fchmod (fd, 0644) || rename (tmp_path, bloom_path)) {
+                LOG_IT (log_error, "Failed to write %s : %s", bloom_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        LOG_IT (log_info, "Bloom filter of %llu GFIDs, %llu blocks, "
+                "expected false positive rate %g", (unsigned long long)
+                key_count, (unsigned long long)bloom.block_count,
+                gfdb_bloom_expected_fpr ((double)key_count /
+                                         bloom.block_count));
+
+        ret = 0;
+out:
+        if (map != MAP_FAILED)
+                munmap (map, bloom.map_size);
+        if (fd >= 0) {
+                close (fd);
+                if (ret)
+                        unlink (tmp_path);
+        }
+        free (tmp_path);
+        return ret;
+}
+
+
+/* Checks the GFIDs, from the command line or else one per line on stdin */
+int
+gfdb_bloom_check (const char *bloom_path, char **gfid_strs, int gfid_count)
+{
+        int ret                 = -1;
+        gfdb_bloom_t bloom      = {0};
+        uuid_t gfid             = {0};
+        char *line              = NULL;
+        size_t line_size        = 0;
+        ssize_t len             = 0;
+        int i                   = 0;
+
+        if (gfdb_bloom_open (bloom_path, &bloom))
+                goto out;
+
+        for (i = 0; i < gfid_count; i++) {
+                if (gf_uuid_parse (gfid_strs[i], gfid)) {
+                        LOG_IT (log_error, "Invalid GFID %s", gfid_strs[i]);
+                        goto out;
+                }
+                printf ("%s : %s\n", gfid_strs[i],
+                        gfdb_bloom_contains (&bloom, gfid) ?
+                        "maybe present" : "absent");
+        }
+
+        if (gfid_count == 0) {
+                while ((len = getline (&line, &line_size, stdin)) > 0) {
+                        if (line[len - 1] == '\n')
+                                line[len - 1] = '\0';
+                        if (gf_uuid_parse (line, gfid)) {
+                                LOG_IT (log_error, "Invalid GFID %s", line);
+                                goto out;
+                        }
+                        printf ("%s : %s\n", line,
+                                gfdb_bloom_contains (&bloom, gfid) ?
+                                "maybe present" : "absent");
+                }
+        }
+
+        ret = 0;
+out:
+        free (line);
+        gfdb_bloom_close (&bloom);
+        return ret;
+}
+
+
+/******************************************************************************
+                        RESERVOIR SAMPLING
+*******************************************************************************/
+/******************************************************************************
+ With --sample K a uniform random sample of K records is taken in one pass.
+ The records are hopped over by their length prefix with the record scanner,
+ and only the offset and the length of the records in the reservoir are
+ kept. The gaps between reservoir replacements are drawn directly
+ (Algorithm L), so the random number generator is called O(K log(N/K))
+ times rather than once per record. Only the K chosen records are read
+ again and de-serialized, in file order.
+ * ****************************************************************************/
+
+/*A record chosen for the sample*/
+typedef struct gfdb_sample_slot {
+        off_t                           offset;
+        int                             record_len;
+} gfdb_sample_slot_t;
+
+
+/* splitmix64 */
+static uint64_t
+gfdb_random_next (uint64_t *state)
+{
+        uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+/* Uniform in (0, 1), never 0 so that it can go through log () */
+static double
+gfdb_random_unit (uint64_t *state)
+{
+        return ((gfdb_random_next (state) >> 11) + 0.5) *
+               (1.0 / 9007199254740992.0);
+}
+
+
+/* Number of records to pass over before the next replacement */
+static uint64_t
+gfdb_sample_gap (uint64_t *state, double w)
+{
+        return (uint64_t)floor (log (gfdb_random_unit (state)) /
+                                log (1.0 - w));
+}
+
+
+static int
+gfdb_sample_slot_cmp (const void *a, const void *b)
+{
+        const gfdb_sample_slot_t *sa = a;
+        const gfdb_sample_slot_t *sb = b;
+
+        return (sa->offset < sb->offset) ? -1 : (sa->offset > sb->offset);
+}
+
+
+/* Reads and de-serializes the chosen records, handing them to cbk */
+static int
+gfdb_sample_emit (int query_fd, gfdb_sample_slot_t *slots, size_t count,
+                  gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                                 = -1;
+        char *buffer                            = NULL;
+        char *new_buffer                        = NULL;
+        size_t buffer_size                      = 0;
+        ssize_t read_len                        = 0;
+        size_t i                                = 0;
+        gfdb_query_record_t *query_record       = NULL;
+
+        /* In file order, for sequential reads */
+        qsort (slots, count, sizeof (*slots), gfdb_sample_slot_cmp);
+
+        for (i = 0; i < count; i++) {
+                if ((size_t)slots[i].record_len > buffer_size) {
+                        new_buffer = realloc (buffer, slots[i].record_len);
+                        if (!new_buffer) {
+                                LOG_IT (log_error, "Memory allocation "
+                                        "failed for record buffer");
+                                goto out;
+                        }
+                        buffer = new_buffer;
+                        buffer_size = slots[i].record_len;
+                }
+
+                read_len = pread (query_fd, buffer, slots[i].record_len,
+                                  slots[i].offset + sizeof (int32_t));
+                if (read_len != slots[i].record_len) {
+                        LOG_AT (log_error, slots[i].offset, "Failed to "
+                                "read record");
+                        goto out;
+                }
+
+                ret = gfdb_query_record_deserialize (buffer,
+                                                     slots[i].record_len,
+                                                     &query_record);
+                if (ret) {
+                        LOG_AT (log_error, slots[i].offset, "Failed to "
+                                "de-serialize query record");
+                        goto out;
+                }
+
+                ret = cbk (query_record, data);
+                gfdb_query_record_free (query_record);
+                query_record = NULL;
+                if (ret)
+                        goto out;
+        }
+
+        ret = 0;
+out:
+        free (buffer);
+        return ret;
+}
+
+
+/* Hands a uniform random sample of sample_count records to cbk */
+int
+gfdb_sample_query_file (int query_fd, size_t sample_count, uint64_t seed,
+                        gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                         = -1;
+        gfdb_record_scanner_t scanner   = {0};
+        gfdb_sample_slot_t *slots       = NULL;
+        char *record                    = NULL;
+        int record_len                  = 0;
+        off_t offset                    = 0;
+        uint64_t state                  = seed;
+        uint64_t seen                   = 0;
+        uint64_t next                   = 0;
+        uint64_t slot                   = 0;
+        double w                        = 0;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, cbk, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, (sample_count > 0), out);
+
+        slots = calloc (sample_count, sizeof (*slots));
+        if (!slots) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "sample reservoir");
+                goto out;
+        }
+
+        if (gfdb_record_scanner_init (&scanner, query_fd))
+                goto out;
+
+        w = exp (log (gfdb_random_unit (&state)) / sample_count);
+        next = sample_count + gfdb_sample_gap (&state, w);
+
+        for (;;) {
+                offset = scanner.offset;
+                ret = gfdb_record_scanner_next (&scanner, &record,
+                                                &record_len);
+                if (ret <= 0)
+                        break;
+
+                if (seen < sample_count) {
+                        /* Fill the reservoir */
+                        slots[seen].offset = offset;
+                        slots[seen].record_len = record_len;
+                } else if (seen == next) {
+                        /* Replace a random member of the reservoir */
+                        slot = gfdb_random_next (&state) % sample_count;
+                        slots[slot].offset = offset;
+                        slots[slot].record_len = record_len;
+
+                        w *= exp (log (gfdb_random_unit (&state)) /
+                                  sample_count);
+                        next += 1 + gfdb_sample_gap (&state, w);
+                }
+                seen++;
+        }
+
+        if (ret < 0) {
+                LOG_IT (log_error, "Failed to scan query file");
+                goto out;
+        }
+
+        ret = gfdb_sample_emit (query_fd, slots,
+                                (seen < sample_count) ? seen : sample_count,
+                                cbk, data);
+out:
+        gfdb_record_scanner_cleanup (&scanner);
+        free (slots);
+        return ret;
+}
+
+
+/******************************************************************************
+                CHECKING RECORDS AGAINST THE BRICK
+*******************************************************************************/
+/******************************************************************************
+ Query files go stale : by the time the migrator runs, files may have been
+ deleted or relinked. With --check-brick, every record is looked up on the
+ brick before it is written out :
+
+   GFID  : .glusterfs/xx/yy/<gfid>, the hard link (symlink for a directory)
+           gluster keeps for every file
+   link  : .glusterfs/pp/qq/<pgfid>/<basename>, through the symlink of the
+           parent directory, which must be the same inode as the GFID
+
+ A record whose GFID is gone is dropped, as are the links whose entry is
+ gone or now names another inode. A record left with none of its links is
+ dropped too. Errors other than ENOENT/ENOTDIR keep the record (link), a
+ check that could not be made is no proof that the file is gone.
+
+ Records are checked GFDB_CHECK_BATCH_RECORDS at a time, all the statx of
+ a batch in flight together : through io_uring when the kernel allows
+ IORING_OP_STATX, by a pool of threads otherwise. The surviving records
+ are written in their original order.
+ * ****************************************************************************/
+
+#define GFDB_CHECK_BATCH_RECORDS        4096
+#define GFDB_CHECK_DEFAULT_THREADS      16
+#define GFDB_CHECK_URING_DEPTH          256
+/* Checks a pool thread takes at a time */
+#define GFDB_CHECK_CHUNK                16
+#define GFDB_CHECK_STATX_MASK           (STATX_TYPE | STATX_INO)
+/* xx/yy/<uuid>/<basename> */
+#define GFDB_HANDLE_PATH_MAX            (6 + 36 + 1 + GF_NAME_MAX + 1)
+
+/*A single statx to make*/
+typedef struct gfdb_brick_check {
+        char                            path[GFDB_HANDLE_PATH_MAX];
+        struct statx                    stx;
+        /* 0 or the errno of the statx */
+        int                             error;
+} gfdb_brick_check_t;
+
+/*io_uring set up by hand, the rings being mmapped from the kernel*/
+typedef struct gfdb_brick_uring {
+        int                             ring_fd;
+        unsigned                        entries;
+        unsigned                        *sq_head;
+        unsigned                        *sq_tail;
+        unsigned                        *sq_mask;
+        unsigned                        *sq_array;
+        unsigned                        *cq_head;
+        unsigned                        *cq_tail;
+        unsigned                        *cq_mask;
+        struct io_uring_sqe             *sqes;
+        struct io_uring_cqe             *cqes;
+        void                            *sq_ring;
+        size_t                          sq_ring_size;
+        void                            *cq_ring;
+        size_t                          cq_ring_size;
+        size_t                          sqes_size;
+} gfdb_brick_uring_t;
+
+/*State of the check of a query file against a brick*/
+typedef struct gfdb_brick_checker {
+        /* The .glusterfs directory of the brick, checks are relative to it */
+        int                             dir_fd;
+        gfdb_query_file_writer_t        *writer;
+        /* Records of the batch, copies as the caller frees its own */
+        gfdb_query_record_t             **records;
+        int                             record_count;
+        gfdb_brick_check_t              *checks;
+        size_t                          check_count;
+        size_t                          check_size;
+        boolean_t                       use_uring;
+        gfdb_brick_uring_t              uring;
+        pthread_t                       *threads;
+        int                             thread_count;
+        pthread_mutex_t                 lock;
+        pthread_cond_t                  work_cond;
+        pthread_cond_t                  done_cond;
+        uint64_t                        generation;
+        size_t                          next_check;
+        int                             busy;
+        boolean_t                       stop;
+        uint64_t                        records_checked;
+        uint64_t                        records_dropped;
+        uint64_t                        links_dropped;
+} gfdb_brick_checker_t;
+
+
+static void
+gfdb_brick_uring_cleanup (gfdb_brick_uring_t *uring)
+{
+        if (uring->sqes)
+                munmap (uring->sqes, uring->sqes_size);
+        if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+                munmap (uring->cq_ring, uring->cq_ring_size);
+        if (uring->sq_ring)
+                munmap (uring->sq_ring, uring->sq_ring_size);
+        if (uring->ring_fd >= 0)
+                close (uring->ring_fd);
+        memset (uring, 0, sizeof (*uring));
+        uring->ring_fd = -1;
+}
+
+
+/* Sets up an io_uring that can statx, fails quietly when the kernel (or
+ * the sandbox) does not allow it, the thread pool being the fallback */
+static int
+gfdb_brick_uring_init (gfdb_brick_uring_t *uring, unsigned entries)
+{
+        int ret                                 = -1;
+        struct io_uring_params params           = {0};
+        struct io_uring_probe *probe            = NULL;
+        size_t probe_size                       = 0;
+        char *sq                                = NULL;
+        char *cq                                = NULL;
+
+        memset (uring, 0, sizeof (*uring));
+        uring->ring_fd = syscall (__NR_io_uring_setup, entries, &params);
+        if (uring->ring_fd < 0)
+                goto out;
+
+        probe_size = sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op);
+        probe = calloc (1, probe_size);
+        if (!probe)
+                goto out;
+        if (syscall (__NR_io_uring_register, uring->ring_fd,
+                     IORING_REGISTER_PROBE, probe, 256) < 0 ||
+            probe->last_op < IORING_OP_STATX ||
+            !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+                goto out;
+
+        uring->entries = params.sq_entries;
+        uring->sq_ring_size = params.sq_off.array +
+                              params.sq_entries * sizeof (unsigned);
+        uring->cq_ring_size = params.cq_off.cqes +
+                              params.cq_entries * sizeof (struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (uring->cq_ring_size > uring->sq_ring_size)
+                        uring->sq_ring_size = uring->cq_ring_size;
+                uring->cq_ring_size = uring->sq_ring_size;
+        }
+
+        uring->sq_ring = mmap (NULL, uring->sq_ring_size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                               IORING_OFF_SQ_RING);
+        if (uring->sq_ring == MAP_FAILED) {
+                uring->sq_ring = NULL;
+                goto out;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                uring->cq_ring = uring->sq_ring;
+        } else {
+                uring->cq_ring = mmap (NULL, uring->cq_ring_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE,
+                                       uring->ring_fd, IORING_OFF_CQ_RING);
+                if (uring->cq_ring == MAP_FAILED) {
+                        uring->cq_ring = NULL;
+                        goto out;
+                }
+        }
+
+        uring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+        uring->sqes = mmap (NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                            IORING_OFF_SQES);
+        if (uring->sqes == MAP_FAILED) {
+                uring->sqes = NULL;
+                goto out;
+        }
+
+        sq = uring->sq_ring;
+        cq = uring->cq_ring;
+        uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+        uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+        uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+        uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+        uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+        uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        ret = 0;
+out:
+        free (probe);
+        if (ret)
+                gfdb_brick_uring_cleanup (uring);
+        return ret;
+}
+
+
+/* Runs all the checks of the batch through the ring, keeping at most
+ * entries of them in flight */
+static int
+gfdb_brick_uring_run (gfdb_brick_checker_t *checker)
+{
+        int ret                         = -1;
+        gfdb_brick_uring_t *uring       = &checker->uring;
+        gfdb_brick_check_t *check       = NULL;
+        struct io_uring_sqe *sqe        = NULL;
+        struct io_uring_cqe *cqe        = NULL;
+        size_t submitted                = 0;
+        size_t completed                = 0;
+        unsigned in_flight              = 0;
+        unsigned tail                   = 0;
+        unsigned head                   = 0;
+        unsigned index                  = 0;
+        unsigned to_submit              = 0;
+
+        while (completed < checker->check_count) {
+                tail = *uring->sq_tail;
+                while (submitted < checker->check_count &&
+                       in_flight < uring->entries) {
+                        check = &checker->checks[submitted];
+                        index = tail & *uring->sq_mask;
+                        sqe = &uring->sqes[index];
+                        memset (sqe, 0, sizeof (*sqe));
+                        sqe->opcode = IORING_OP_STATX;
+                        sqe->fd = checker->dir_fd;
+                        sqe->addr = (uintptr_t)check->path;
+                        sqe->len = GFDB_CHECK_STATX_MASK;
+                        sqe->off = (uintptr_t)&check->stx;
+                        sqe->statx_flags = AT_STATX_DONT_SYNC;
+                        sqe->user_data = submitted;
+                        uring->sq_array[index] = index;
+                        tail++;
+                        submitted++;
+                        in_flight++;
+                }
+                __atomic_store_n (uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+                to_submit = tail - __atomic_load_n (uring->sq_head,
+                                                    __ATOMIC_ACQUIRE);
+                if (syscall (__NR_io_uring_enter, uring->ring_fd, to_submit,
+                             1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_IT (log_error, "io_uring_enter failed : %s",
+                                strerror (errno));
+                        goto out;
+                }
+
+                head = *uring->cq_head;
+                while (head != __atomic_load_n (uring->cq_tail,
+                                                __ATOMIC_ACQUIRE)) {
+                        cqe = &uring->cqes[head & *uring->cq_mask];
+                        checker->checks[cqe->user_data].error =
+                                        (cqe->res < 0) ? -cqe->res : 0;
+                        head++;
+                        completed++;
+                        in_flight--;
+                }
+                __atomic_store_n (uring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static void
+gfdb_brick_statx (gfdb_brick_checker_t *checker, gfdb_brick_check_t *check)
+{
+        if (statx (checker->dir_fd, check->path, AT_STATX_DONT_SYNC,
+                   GFDB_CHECK_STATX_MASK, &check->stx))
+                check->error = errno;
+        else
+                check->error = 0;
+}
+
+
+/* Pool thread : takes checks of each new batch chunk by chunk */
+static void *
+gfdb_brick_check_worker (void *data)
+{
+        gfdb_brick_checker_t *checker   = data;
+        uint64_t seen                   = 0;
+        size_t i                        = 0;
+        size_t end                      = 0;
+
+        pthread_mutex_lock (&checker->lock);
+        for (;;) {
+                while (!checker->stop && checker->generation == seen)
+                        pthread_cond_wait (&checker->work_cond,
+                                           &checker->lock);
+                if (checker->stop)
+                        break;
+                seen = checker->generation;
+                pthread_mutex_unlock (&checker->lock);
+
+                while ((i = __atomic_fetch_add (&checker->next_check,
+                                                GFDB_CHECK_CHUNK,
+                                                __ATOMIC_RELAXED)) <
+                       checker->check_count) {
+                        end = i + GFDB_CHECK_CHUNK;
+                        if (end > checker->check_count)
+                                end = checker->check_count;
+                        for (; i < end; i++)
+                                gfdb_brick_statx (checker,
+                                                  &checker->checks[i]);
+                }
+
+                pthread_mutex_lock (&checker->lock);
+                if (--checker->busy == 0)
+                        pthread_cond_signal (&checker->done_cond);
+        }
+        pthread_mutex_unlock (&checker->lock);
+
+        return NULL;
+}
+
+
+static void
+gfdb_brick_pool_run (gfdb_brick_checker_t *checker)
+{
+        pthread_mutex_lock (&checker->lock);
+        checker->next_check = 0;
+        checker->busy = checker->thread_count;
+        checker->generation++;
+        pthread_cond_broadcast (&checker->work_cond);
+        while (checker->busy > 0)
+                pthread_cond_wait (&checker->done_cond, &checker->lock);
+        pthread_mutex_unlock (&checker->lock);
+}
+
+
+static inline boolean_t
+gfdb_brick_check_gone (const gfdb_brick_check_t *check)
+{
+        return (check->error == ENOENT || check->error == ENOTDIR) ?
+               _true : _false;
+}
+
+
+/* Makes the checks of the batch, then writes out what is still live */
+static int
+gfdb_brick_check_batch (gfdb_brick_checker_t *checker)
+{
+        int ret                         = -1;
+        int i                           = 0;
+        size_t c                        = 0;
+        gfdb_query_record_t *record     = NULL;
+        gfdb_link_info_t *link_info     = NULL;
+        gfdb_link_info_t *temp          = NULL;
+        gfdb_brick_check_t *gfid_check  = NULL;
+        gfdb_brick_check_t *link_check  = NULL;
+        boolean_t had_links             = _false;
+
+        if (checker->check_count) {
+                if (checker->use_uring) {
+                        if (gfdb_brick_uring_run (checker))
+                                goto out;
+                } else {
+                        gfdb_brick_pool_run (checker);
+                }
+        }
+
+        for (i = 0; i < checker->record_count; i++) {
+                record = checker->records[i];
+                gfid_check = &checker->checks[c++];
+                had_links = !list_empty (&record->link_list);
+
+                list_for_each_entry_safe (link_info, temp,
+                                          &record->link_list, list) {
+                        link_check = &checker->checks[c++];
+                        if (gfid_check->error == 0 && link_check->error == 0 &&
+                            link_check->stx.stx_ino ==
+                                        gfid_check->stx.stx_ino &&
+                            link_check->stx.stx_dev_major ==
+                                        gfid_check->stx.stx_dev_major &&
+                            link_check->stx.stx_dev_minor ==
+                                        gfid_check->stx.stx_dev_minor)
+                                continue;
+                        if (link_check->error == 0 && gfid_check->error)
+                                continue;
+                        if (link_check->error && !gfdb_brick_check_gone (
+                                                        link_check))
+                                continue;
+                        gfdb_delete_linkinfo_from_list (&link_info);
+                        record->link_count--;
+                        checker->links_dropped++;
+                }
+
+                checker->records_checked++;
+                if (gfdb_brick_check_gone (gfid_check) ||
+                    (had_links && list_empty (&record->link_list))) {
+                        checker->records_dropped++;
+                        continue;
+                }
+
+                if (gfdb_write_query_record (checker->writer, record))
+                        goto out;
+        }
+
+        ret = 0;
+out:
+        for (i = 0; i < checker->record_count; i++)
+                gfdb_query_record_free (checker->records[i]);
+        checker->record_count = 0;
+        checker->check_count = 0;
+        return ret;
+}
+
+
+static int
+gfdb_brick_add_check (gfdb_brick_checker_t *checker, const uuid_t gfid,
+                      const char *base_name)
+{
+        gfdb_brick_check_t *checks      = NULL;
+        gfdb_brick_check_t *check       = NULL;
+        size_t size                     = 0;
+        char uuid_str[40]               = "";
+
+        if (checker->check_count == checker->check_size) {
+                size = checker->check_size << 1;
+                checks = realloc (checker->checks, size * sizeof (*checks));
+                if (!checks) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "brick checks");
+                        return -1;
+                }
+                checker->checks = checks;
+                checker->check_size = size;
+        }
+
+        check = &checker->checks[checker->check_count++];
+        gf_uuid_unparse (gfid, uuid_str);
+        snprintf (check->path, sizeof (check->path), "%.2s/%.2s/%s%s%s",
+                  uuid_str, uuid_str + 2, uuid_str,
+                  base_name ? "/" : "", base_name ? base_name : "");
+        check->error = 0;
+        return 0;
+}
+
+
+static int
+gfdb_brick_check_record_cbk (gfdb_query_record_t *query_record, void *data)
+{
+        int ret                         = -1;
+        gfdb_brick_checker_t *checker   = data;
+        gfdb_query_record_t *record     = NULL;
+        gfdb_link_info_t *link_info     = NULL;
+
+        record = gfdb_query_record_new ();
+        if (!record)
+                goto out;
+        checker->records[checker->record_count++] = record;
+        gf_uuid_copy (record->gfid, query_record->gfid);
+
+        if (gfdb_brick_add_check (checker, record->gfid, NULL))
+                goto out;
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                if (gfdb_add_link_to_query_record (record,
+                                        link_info->pargfid,
+                                        link_info->file_name) ||
+                    gfdb_brick_add_check (checker, link_info->pargfid,
+                                          link_info->file_name))
+                        goto out;
+        }
+
+        if (checker->record_count == GFDB_CHECK_BATCH_RECORDS &&
+            gfdb_brick_check_batch (checker))
+                goto out;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static void
+gfdb_brick_checker_cleanup (gfdb_brick_checker_t *checker)
+{
+        int i = 0;
+
+        if (checker->threads) {
+                pthread_mutex_lock (&checker->lock);
+                checker->stop = _true;
+                pthread_cond_broadcast (&checker->work_cond);
+                pthread_mutex_unlock (&checker->lock);
+                for (i = 0; i < checker->thread_count; i++)
+                        pthread_join (checker->threads[i], NULL);
+                free (checker->threads);
+                pthread_mutex_destroy (&checker->lock);
+                pthread_cond_destroy (&checker->work_cond);
+                pthread_cond_destroy (&checker->done_cond);
+        }
+
+        if (checker->use_uring)
+                gfdb_brick_uring_cleanup (&checker->uring);
+
+        for (i = 0; i < checker->record_count; i++)
+                gfdb_query_record_free (checker->records[i]);
+        free (checker->records);
+        free (checker->checks);
+
+        if (checker->dir_fd >= 0)
+                close (checker->dir_fd);
+}
+
+
+static int
+gfdb_brick_checker_init (gfdb_brick_checker_t *checker,
+                         const gfdb_reader_conf_t *conf,
+                         gfdb_query_file_writer_t *writer)
+{
+        int ret         = -1;
+        int brick_fd    = -1;
+        int i           = 0;
+
+        memset (checker, 0, sizeof (*checker));
+        checker->writer = writer;
+
+        brick_fd = open (conf->brick_path, O_RDONLY | O_DIRECTORY |
+                                           O_CLOEXEC);
+        checker->dir_fd = (brick_fd < 0) ? -1 :
+                          openat (brick_fd, ".glusterfs", O_RDONLY |
+                                  O_DIRECTORY | O_CLOEXEC);
+        if (checker->dir_fd < 0) {
+                LOG_IT (log_error, "Failed to open %s/.glusterfs : %s",
+                        conf->brick_path, strerror (errno));
+                goto out;
+        }
+
+        checker->records = calloc (GFDB_CHECK_BATCH_RECORDS,
+                                   sizeof (*checker->records));
+        checker->check_size = GFDB_CHECK_BATCH_RECORDS * 2;
+        checker->checks = malloc (checker->check_size *
+                                  sizeof (*checker->checks));
+        if (!checker->records || !checker->checks) {
+                LOG_IT (log_error, "Memory allocation failed for brick "
+                        "checks");
+                goto out;
+        }
+
+        if (gfdb_brick_uring_init (&checker->uring,
+                                   GFDB_CHECK_URING_DEPTH) == 0) {
+                checker->use_uring = _true;
+                ret = 0;
+                goto out;
+        }
+
+        checker->thread_count = conf->check_threads;
+        checker->threads = calloc (checker->thread_count, sizeof (pthread_t));
+        if (!checker->threads) {
+                LOG_IT (log_error, "Memory allocation failed for check "
+                        "threads");
+                goto out;
+        }
+        pthread_mutex_init (&checker->lock, NULL);
+        pthread_cond_init (&checker->work_cond, NULL);
+        pthread_cond_init (&checker->done_cond, NULL);
+
+        for (i = 0; i < checker->thread_count; i++) {
+                errno = pthread_create (&checker->threads[i], NULL,
+                                        gfdb_brick_check_worker, checker);
+                if (errno) {
+                        LOG_IT (log_error, "Failed to start check thread : "
+                                "%s", strerror (errno));
+                        checker->thread_count = i;
+                        goto out;
+                }
+        }
+
+        ret = 0;
+out:
+        if (brick_fd >= 0)
+                close (brick_fd);
+        return ret;
+}
+
+
+/* Writes to writer the records of the query file still live on the brick */
+int
+gfdb_check_brick_query_file (int query_fd, const gfdb_reader_conf_t *conf,
+                             gfdb_query_file_writer_t *writer)
+{
+        int ret                         = -1;
+        gfdb_brick_checker_t checker    = {0};
+
+        if (gfdb_brick_checker_init (&checker, conf, writer))
+                goto out;
+
+        if (gfdb_process_query_file (query_fd, conf,
+                                     gfdb_brick_check_record_cbk, &checker))
+                goto out;
+
+        if (gfdb_brick_check_batch (&checker))
+                goto out;
+
+        LOG_IT (log_info, "Checked %llu records with %s : %llu dropped, "
+                "%llu stale links removed",
+                (unsigned long long)checker.records_checked,
+                checker.use_uring ? "io_uring" : "a thread pool",
+                (unsigned long long)checker.records_dropped,
+                (unsigned long long)checker.links_dropped);
+
+        ret = 0;
+out:
+        gfdb_brick_checker_cleanup (&checker);
+        return ret;
+}
+
+
+/******************************************************************************
+                        CHECKPOINT AND RESUME
+*******************************************************************************/
+/******************************************************************************
+ A full volume query file takes hours to go through. With --checkpoint, the
+ dump and -w modes save every --checkpoint-interval seconds where they are :
+ the offset in the query file just past the last record fully emitted, and
+ the offset reached in the output, once the output is synced. The
+ checkpoint is a small text file replaced atomically (written aside,
+ fsynced and renamed), so a crash leaves either the old or the new one.
+ A run that did not load a checkpoint saves one as it starts; a file
+ already on stdout is left alone and its end is where the output starts.
+
+ With --resume the query file is read from the saved offset, after making
+ sure it is the same query file and a record starts there, and the output
+ is cut back to the saved offset before appending to it. Records emitted
+ after the last checkpoint are thus emitted again, exactly once in the
+ output. Without a checkpoint file --resume starts from the beginning, so
+ the same command line can be used for the first run and every restart.
+
+ Only legacy query files are read sequentially from a byte offset, and
+ only a legacy query file (or a regular file on stdout) can be appended to.
+ * ****************************************************************************/
+
+#define GFDB_CHECKPOINT_MAGIC           "gfdb-checkpoint"
+#define GFDB_CHECKPOINT_VERSION         1
+#define GFDB_CHECKPOINT_DEFAULT_INTERVAL 30
+/* Records between two looks at the clock */
+#define GFDB_CHECKPOINT_CLOCK_RECORDS   256
+
+/* Syncs the output to stable storage and returns how far it goes, -1 when
+ * the output has no offset (a pipe) */
+typedef int (*gfdb_output_sync_t) (void *data, int64_t *offset);
+
+/*What a checkpoint holds*/
+typedef struct gfdb_checkpoint_state {
+        uint64_t                        query_dev;
+        uint64_t                        query_ino;
+        uint64_t                        query_offset;
+        uint64_t                        records;
+        int64_t                         output_offset;
+        /* Not stored, set when the state came from a checkpoint file */
+        boolean_t                       loaded;
+} gfdb_checkpoint_state_t;
+
+/*Checkpointing wrapped around the record callback*/
+typedef struct gfdb_checkpoint {
+        const char                      *path;
+        int                             query_fd;
+        int                             interval;
+        time_t                          last_save;
+        gfdb_checkpoint_state_t         state;
+        gfdb_query_record_cbk_t         cbk;
+        void                            *data;
+        gfdb_output_sync_t              sync;
+        void                            *sync_data;
+} gfdb_checkpoint_t;
+
+
+/* Returns 1 when a checkpoint was loaded, 0 when there is none */
+static int
+gfdb_checkpoint_load (const char *path, gfdb_checkpoint_state_t *state)
+{
+        int ret                         = -1;
+        FILE *fp                        = NULL;
+        int version                     = 0;
+        unsigned long long dev          = 0;
+        unsigned long long ino          = 0;
+        unsigned long long offset       = 0;
+        unsigned long long records      = 0;
+        long long output_offset         = 0;
+
+        fp = fopen (path, "r");
+        if (!fp) {
+                if (errno == ENOENT)
+                        ret = 0;
+                else
+                        LOG_IT (log_error, "Failed to open checkpoint %s : "
+                                "%s", path, strerror (errno));
+                goto out;
+        }
+
+        if (fscanf (fp, GFDB_CHECKPOINT_MAGIC " %d query_dev %llu "
+                    "query_ino %llu query_offset %llu records %llu "
+                    "output_offset %lld", &version, &dev, &ino, &offset,
+                    &records, &output_offset) != 6 ||
+            version != GFDB_CHECKPOINT_VERSION) {
+                LOG_IT (log_error, "Invalid checkpoint %s", path);
+                goto out;
+        }
+
+        state->query_dev = dev;
+        state->query_ino = ino;
+        state->query_offset = offset;
+        state->records = records;
+        state->output_offset = output_offset;
+
+        ret = 1;
+out:
+        if (fp)
+                fclose (fp);
+        return ret;
+}
+
+
+/* Replaces the checkpoint file atomically */
+static int
+gfdb_checkpoint_store (const char *path, const gfdb_checkpoint_state_t *state)
+{
+        int ret                 = -1;
+        int fd                  = -1;
+        int dir_fd              = -1;
+        char *tmp_path          = NULL;
+        char *dir_path          = NULL;
+        char *slash             = NULL;
+        char buffer[512]        = "";
+        int len                 = 0;
+
+        if (asprintf (&tmp_path, "%s.tmp", path) < 0 ||
+            !(dir_path = strdup (path))) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "checkpoint path");
+                goto out;
+        }
+        slash = strrchr (dir_path, '/');
+        if (slash)
+                *(slash == dir_path ? slash + 1 : slash) = '\0';
+        else
+                strcpy (dir_path, ".");
+
+        len = snprintf (buffer, sizeof (buffer), GFDB_CHECKPOINT_MAGIC " %d\n"
+                        "query_dev %llu\nquery_ino %llu\nquery_offset %llu\n"
+                        "records %llu\noutput_offset %lld\n",
+                        GFDB_CHECKPOINT_VERSION,
+                        (unsigned long long)state->query_dev,
+                        (unsigned long long)state->query_ino,
+                        (unsigned long long)state->query_offset,
+                        (unsigned long long)state->records,
+                        (long long)state->output_offset);
+
+        fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || gfdb_write_full (fd, buffer, len) || fsync (fd)) {
+                LOG_IT (log_error, "Failed to write checkpoint %s : %s",
+                        tmp_path, strerror (errno));
+                goto out;
+        }
+        close (fd);
+        fd = -1;
+
+        if (rename (tmp_path, path)) {
+                LOG_IT (log_error, "Failed to rename checkpoint to %s : %s",
+                        path, strerror (errno));
+                goto out;
+        }
+
+        /* Make the rename itself durable */
+        dir_fd = open (dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+                fsync (dir_fd);
+                close (dir_fd);
+        }
+
+        ret = 0;
+out:
+        if (fd >= 0)
+                close (fd);
+        free (tmp_path);
+        free (dir_path);
+        return ret;
+}
+
+
+static int
+gfdb_checkpoint_save (gfdb_checkpoint_t *ckpt)
+{
+        off_t offset = 0;
+
+        offset = lseek (ckpt->query_fd, 0, SEEK_CUR);
+        if (offset < 0) {
+                LOG_IT (log_error, "Failed to get query file offset : %s",
+                        strerror (errno));
+                return -1;
+        }
+        ckpt->state.query_offset = offset;
+
+        /* The output must be on disk before the checkpoint refers to it */
+        if (ckpt->sync (ckpt->sync_data, &ckpt->state.output_offset))
+                return -1;
+
+        ckpt->last_save = time (NULL);
+        return gfdb_checkpoint_store (ckpt->path, &ckpt->state);
+}
+
+
+static int
+gfdb_checkpoint_record_cbk (gfdb_query_record_t *query_record, void *data)
+{
+        gfdb_checkpoint_t *ckpt = data;
+        int ret                 = 0;
+
+        ret = ckpt->cbk (query_record, ckpt->data);
+        if (ret)
+                return ret;
+
+        ckpt->state.records++;
+        if (ckpt->state.records % GFDB_CHECKPOINT_CLOCK_RECORDS == 0 &&
+            time (NULL) - ckpt->last_save >= ckpt->interval)
+                ret = gfdb_checkpoint_save (ckpt);
+
+        return ret;
+}
+
+
+/* Makes sure a serialized record starts at offset of the query file */
+static int
+gfdb_checkpoint_check_boundary (int query_fd, off_t offset, off_t size)
+{
+        int ret                                 = -1;
+        int32_t buffer_len                      = 0;
+        char *buffer                            = NULL;
+        gfdb_query_record_t *query_record       = NULL;
+
+        if (offset == size)
+                return 0;
+
+        if (offset + (off_t)sizeof (int32_t) > size ||
+            gfdb_pread_full (query_fd, (char *)&buffer_len,
+                             sizeof (int32_t), offset))
+                goto err;
+        if (buffer_len < (int32_t)GFDB_QUERY_RECORD_MIN_LEN ||
+            offset + (off_t)sizeof (int32_t) + buffer_len > size)
+                goto err;
+
+        buffer = malloc (buffer_len);
+        if (!buffer) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "serialized buffer");
+                goto out;
+        }
+        if (gfdb_pread_full (query_fd, buffer, buffer_len,
+                             offset + sizeof (int32_t)) ||
+            gfdb_query_record_deserialize (buffer, buffer_len,
+                                           &query_record))
+                goto err;
+
+        ret = 0;
+        goto out;
+err:
+        LOG_AT (log_error, offset, "Checkpoint offset is not a record "
+                "boundary of the query file");
+out:
+        gfdb_query_record_free (query_record);
+        free (buffer);
+        return ret;
+}
+
+
+/* Loads the checkpoint with --resume and positions the query file at the
+ * saved offset. Without anything to resume, state starts from zero; the
+ * caller then positions its output at state->output_offset.
+ * */
+int
+gfdb_checkpoint_resume (int query_fd, const gfdb_reader_conf_t *conf,
+                        gfdb_checkpoint_state_t *state)
+{
+        int ret                 = -1;
+        struct stat stat_buff   = {0};
+
+        memset (state, 0, sizeof (*state));
+
+        if (gfdb_query_file_version (query_fd) != 1) {
+                LOG_IT (log_error, "--checkpoint needs a legacy (version 1) "
+                        "query file");
+                goto out;
+        }
+
+        if (fstat (query_fd, &stat_buff)) {
+                LOG_IT (log_error, "Failed to stat query file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        if (conf->resume) {
+                ret = gfdb_checkpoint_load (conf->checkpoint_path, state);
+                if (ret < 0)
+                        goto out;
+                if (ret == 1)
+                        state->loaded = _true;
+                ret = -1;
+        }
+
+        if (state->query_offset) {
+                if (state->query_dev != (uint64_t)stat_buff.st_dev ||
+                    state->query_ino != (uint64_t)stat_buff.st_ino) {
+                        LOG_IT (log_error, "Checkpoint %s is not of this "
+                                "query file", conf->checkpoint_path);
+                        goto out;
+                }
+                if (gfdb_checkpoint_check_boundary (query_fd,
+                                        state->query_offset,
+                                        stat_buff.st_size))
+                        goto out;
+                if (lseek (query_fd, state->query_offset, SEEK_SET) < 0) {
+                        LOG_IT (log_error, "Failed to seek query file : %s",
+                                strerror (errno));
+                        goto out;
+                }
+        }
+
+        state->query_dev = stat_buff.st_dev;
+        state->query_ino = stat_buff.st_ino;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Feeds the records to cbk from where gfdb_checkpoint_resume () left the
+ * query file, checkpointing along the way and once more at the end */
+int
+gfdb_checkpoint_process (int query_fd, const gfdb_reader_conf_t *conf,
+                         const gfdb_checkpoint_state_t *state,
+                         gfdb_query_record_cbk_t cbk, void *data,
+                         gfdb_output_sync_t sync, void *sync_data)
+{
+        int ret                 = -1;
+        gfdb_checkpoint_t ckpt  = {0};
+
+        ckpt.path = conf->checkpoint_path;
+        ckpt.query_fd = query_fd;
+        ckpt.interval = conf->checkpoint_interval;
+        ckpt.last_save = time (NULL);
+        ckpt.state = *state;
+        ckpt.cbk = cbk;
+        ckpt.data = data;
+        ckpt.sync = sync;
+        ckpt.sync_data = sync_data;
+
+        /* Without a checkpoint to go back to, record where this run starts
+         * so that a crash before the first interval still resumes */
+        if (!state->loaded) {
+                ret = gfdb_checkpoint_save (&ckpt);
+                if (ret)
+                        goto out;
+        }
+
+        ret = gfdb_process_query_file (query_fd, conf,
+                                       gfdb_checkpoint_record_cbk, &ckpt);
+        if (ret)
+                goto out;
+
+        ret = gfdb_checkpoint_save (&ckpt);
+out:
+        return ret;
+}
+
+
+/* Cuts a regular file on stdout back to where the loaded checkpoint left it,
+ * or, with no checkpoint, keeps what is there and records its end as the
+ * baseline */
+int
+gfdb_stdout_resume (gfdb_checkpoint_state_t *state)
+{
+        struct stat stat_buff   = {0};
+        off_t offset            = 0;
+
+        if (fstat (STDOUT_FILENO, &stat_buff) || !S_ISREG (stat_buff.st_mode)) {
+                state->output_offset = -1;
+                return 0;
+        }
+
+        if (!state->loaded) {
+                offset = lseek (STDOUT_FILENO, 0, SEEK_END);
+                if (offset < 0) {
+                        LOG_IT (log_error, "Failed to position output : %s",
+                                strerror (errno));
+                        return -1;
+                }
+                state->output_offset = offset;
+                return 0;
+        }
+
+        if (state->output_offset < 0)
+                return 0;
+
+        if (stat_buff.st_size < state->output_offset) {
+                LOG_IT (log_error, "Output is shorter than at the "
+                        "checkpoint, append to it (>>) when resuming");
+                return -1;
+        }
+
+        if (ftruncate (STDOUT_FILENO, state->output_offset) ||
+            lseek (STDOUT_FILENO, state->output_offset, SEEK_SET) < 0) {
+                LOG_IT (log_error, "Failed to position output : %s",
+                        strerror (errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+
+int
+gfdb_stdout_sync (void *data, int64_t *offset)
+{
+        struct stat stat_buff = {0};
+
+        if (fflush (stdout)) {
+                LOG_IT (log_error, "Failed to flush output : %s",
+                        strerror (errno));
+                return -1;
+        }
+
+        *offset = -1;
+        if (fstat (STDOUT_FILENO, &stat_buff) || !S_ISREG (stat_buff.st_mode))
+                return 0;
+
+        if (fdatasync (STDOUT_FILENO)) {
+                LOG_IT (log_error, "Failed to sync output : %s",
+                        strerror (errno));
+                return -1;
+        }
+        *offset = lseek (STDOUT_FILENO, 0, SEEK_CUR);
+
+        return 0;
+}
+
+
+/******************************************************************************
+                        READING THE QUERY FILE
+*******************************************************************************/
+
+/* Reads the query file till EOF handing every record to cbk */
+int
+gfdb_foreach_query_record (int query_fd, gfdb_query_record_cbk_t cbk,
+                           void *data)
+{
+        int ret                                 = -1;
+        gfdb_query_record_t *query_record       = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, cbk, out);
+
+        if (gfdb_query_file_version (query_fd) == GFDB_V2_VERSION)
+                return gfdb_v2_foreach_query_record (query_fd, cbk, data);
+
+        while ((ret = gfdb_read_query_record
+                        (query_fd, &query_record)) != 0) {
+
+                if (ret < 0 && !query_record) {
+                        LOG_IT (log_error, "Failed to fetch query record "
+                                "from query file");
+                        goto out;
+                }
+                if (ret > 0)
+                        gfdb_throttle_account (sizeof (int32_t) + ret, 1);
+
+                ret = cbk (query_record, data);
+                gfdb_query_record_free (query_record);
+                query_record = NULL;
+                if (ret)
+                        goto out;
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Feeds the records of the query file to cbk, following it if asked to.
+ * When attached to a server the records come from its ring instead, and
+ * with --gfdb they come straight from the brick's database.
+ * */
+int
+gfdb_process_query_file (int query_fd, const gfdb_reader_conf_t *conf,
+                         gfdb_query_record_cbk_t cbk, void *data)
+{
+        if (conf->attach_socket_path)
+                return gfdb_consume_query_ring (conf->attach_socket_path,
+                                                cbk, data);
+
+#ifdef USE_GFDB
+        if (conf->gfdb_path)
+                return gfdb_sqlite_query_records (conf, cbk, data);
+#endif
+
+        if (conf->sample_count)
+                return gfdb_sample_query_file (query_fd, conf->sample_count,
+                                               conf->sample_seed, cbk, data);
+
+        if (conf->follow)
+                return gfdb_follow_query_file (query_fd,
+                                               conf->query_file_path,
+                                               conf->done_marker_path,
+                                               cbk, data);
+
+        return gfdb_foreach_query_record (query_fd, cbk, data);
+}
+
+
+/******************************************************************************
+                        ARROW IPC EXPORT
+*******************************************************************************/
+/******************************************************************************
+ The records are written as an Apache Arrow IPC stream, one row per link :
+
+   record_index : uint64, index of the query record in the query file
+   gfid         : fixed_size_binary(16)
+   pgfid        : fixed_size_binary(16), null for a record without links
+   basename     : binary, null for a record without links. Linux names are
+                  arbitrary bytes, so they are not declared utf8; readers
+                  decode them as they see fit
+
+ The stream is a Schema message, one RecordBatch message per
+ GFDB_ARROW_BATCH_ROWS rows and the end of stream marker. Every message is
+ a 0xFFFFFFFF continuation, the length of its flatbuffer metadata, the
+ metadata padded to 8 bytes and the body, which holds the column buffers
+ each padded to 8 bytes. Like the flatbuffers, the columns are little
+ endian. Columns are filled in place in buffers that are
+ reused from one batch to the next, so there is no allocation per row.
+
+ The metadata flatbuffers are built back to front by the small builder
+ below, which only knows what the Message, Schema and RecordBatch tables
+ need : scalars, strings, vectors and tables.
+ * ****************************************************************************/
+
+#define GFDB_ARROW_BATCH_ROWS           65536
+#define GFDB_ARROW_CONTINUATION         0xFFFFFFFF
+#define GFDB_ARROW_ALIGN                8
+#define GFDB_ARROW_COLUMNS              4
+#define GFDB_ARROW_BUFFERS              9
+/* Message.fbs */
+#define GFDB_ARROW_METADATA_V5          4
+#define GFDB_ARROW_HEADER_SCHEMA        1
+#define GFDB_ARROW_HEADER_RECORD_BATCH  3
+/* Schema.fbs, Type union */
+#define GFDB_ARROW_TYPE_INT             2
+#define GFDB_ARROW_TYPE_BINARY          4
+#define GFDB_ARROW_TYPE_FIXED_BINARY    15
+
+#define GFDB_FB_MAX_SLOTS               8
+
+/*Back to front flatbuffer builder*/
+typedef struct gfdb_fb_builder {
+        char                            *buf;
+        size_t                          size;
+        /* Bytes used, at the end of buf. Offsets count from the end */
+        size_t                          head;
+        size_t                          table_start;
+        uint32_t                        slots[GFDB_FB_MAX_SLOTS];
+        int                             slot_count;
+} gfdb_fb_builder_t;
+
+/*Columns of the batch being filled*/
+typedef struct gfdb_arrow_writer {
+        int                             fd;
+        uint64_t                        record_index;
+        uint32_t                        rows;
+        uint32_t                        null_count;
+        uint64_t                        *record_indexes;
+        unsigned char                   *gfids;
+        unsigned char                   *pgfids;
+        /* Validity of pgfid and basename, a record without links is null */
+        unsigned char                   *validity;
+        int32_t                         *name_offsets;
+        char                            *names;
+        size_t                          names_size;
+        gfdb_fb_builder_t               fb;
+} gfdb_arrow_writer_t;
+
+
+static int
+gfdb_fb_init (gfdb_fb_builder_t *fb)
+{
+        memset (fb, 0, sizeof (*fb));
+        fb->size = 1024;
+        fb->buf = malloc (fb->size);
+        if (!fb->buf) {
+                LOG_IT (log_error, "Memory allocation failed for arrow "
+                        "metadata");
+                return -1;
+        }
+        return 0;
+}
+
+
+static void
+gfdb_fb_reset (gfdb_fb_builder_t *fb)
+{
+        fb->head = 0;
+}
+
+
+/* Pads so that align divides head once len more bytes are pushed, and
+ * makes sure all of it fits */
+static int
+gfdb_fb_prep (gfdb_fb_builder_t *fb, size_t align, size_t len)
+{
+        size_t pad      = 0;
+        size_t new_size = 0;
+        char *new_buf   = NULL;
+
+        pad = (align - ((fb->head + len) & (align - 1))) & (align - 1);
+
+        if (fb->head + pad + len > fb->size) {
+                new_size = fb->size;
+                while (fb->head + pad + len > new_size)
+                        new_size <<= 1;
+                new_buf = malloc (new_size);
+                if (!new_buf) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "arrow metadata");
+                        return -1;
+                }
+                memcpy (new_buf + new_size - fb->head,
+                        fb->buf + fb->size - fb->head, fb->head);
+                free (fb->buf);
+                fb->buf = new_buf;
+                fb->size = new_size;
+        }
+
+        memset (fb->buf + fb->size - fb->head - pad, 0, pad);
+        fb->head += pad;
+        return 0;
+}
+
+
+/* Pushes len bytes, room must have been made by gfdb_fb_prep () */
+static void
+gfdb_fb_push (gfdb_fb_builder_t *fb, const void *data, size_t len)
+{
+        fb->head += len;
+        memcpy (fb->buf + fb->size - fb->head, data, len);
+}
+
+
+static int
+gfdb_fb_push_le32 (gfdb_fb_builder_t *fb, uint32_t val)
+{
+        char le[sizeof (uint32_t)];
+
+        if (gfdb_fb_prep (fb, sizeof (le), sizeof (le)))
+                return -1;
+        gfdb_put_le32 (le, val);
+        gfdb_fb_push (fb, le, sizeof (le));
+        return 0;
+}
+
+
+/* Pushes a reference to the object at off, relative to where it lands */
+static int
+gfdb_fb_push_offset (gfdb_fb_builder_t *fb, uint32_t off)
+{
+        if (gfdb_fb_prep (fb, sizeof (uint32_t), 0))
+                return -1;
+        return gfdb_fb_push_le32 (fb, fb->head + sizeof (uint32_t) - off);
+}
+
+
+static int
+gfdb_fb_create_string (gfdb_fb_builder_t *fb, const char *str,
+                       uint32_t *off)
+{
+        size_t len = strlen (str);
+
+        if (gfdb_fb_prep (fb, sizeof (uint32_t), len + 1))
+                return -1;
+        gfdb_fb_push (fb, "", 1);
+        gfdb_fb_push (fb, str, len);
+        if (gfdb_fb_push_le32 (fb, len))
+                return -1;
+
+        *off = fb->head;
+        return 0;
+}
+
+
+/* Vector of count structs of elem_size bytes, already little endian */
+static int
+gfdb_fb_create_struct_vector (gfdb_fb_builder_t *fb, const void *elems,
+                              size_t elem_size, size_t count, size_t align,
+                              uint32_t *off)
+{
+        if (gfdb_fb_prep (fb, sizeof (uint32_t), elem_size * count) ||
+            gfdb_fb_prep (fb, align, elem_size * count))
+                return -1;
+        gfdb_fb_push (fb, elems, elem_size * count);
+        if (gfdb_fb_push_le32 (fb, count))
+                return -1;
+
+        *off = fb->head;
+        return 0;
+}
+
+
+static int
+gfdb_fb_create_offset_vector (gfdb_fb_builder_t *fb, const uint32_t *offs,
+                              size_t count, uint32_t *off)
+{
+        size_t i = 0;
+
+        if (gfdb_fb_prep (fb, sizeof (uint32_t), sizeof (uint32_t) * count))
+                return -1;
+        for (i = count; i > 0; i--) {
+                if (gfdb_fb_push_offset (fb, offs[i - 1]))
+                        return -1;
+        }
+        if (gfdb_fb_push_le32 (fb, count))
+                return -1;
+
+        *off = fb->head;
+        return 0;
+}
+
+
+static void
+gfdb_fb_start_table (gfdb_fb_builder_t *fb)
+{
+        memset (fb->slots, 0, sizeof (fb->slots));
+        fb->slot_count = 0;
+        fb->table_start = fb->head;
+}
+
+
+static void
+gfdb_fb_slot (gfdb_fb_builder_t *fb, int slot)
+{
+        fb->slots[slot] = fb->head;
+        if (slot >= fb->slot_count)
+                fb->slot_count = slot + 1;
+}
+
+
+/* Adds a little endian scalar field of len bytes */
+static int
+gfdb_fb_add_scalar (gfdb_fb_builder_t *fb, int slot, uint64_t val,
+                    size_t len)
+{
+        char le[sizeof (uint64_t)];
+
+        if (gfdb_fb_prep (fb, len, len))
+                return -1;
+        gfdb_put_le64 (le, val);
+        gfdb_fb_push (fb, le, len);
+        gfdb_fb_slot (fb, slot);
+        return 0;
+}
+
+
+static int
+gfdb_fb_add_offset (gfdb_fb_builder_t *fb, int slot, uint32_t off)
+{
+        if (gfdb_fb_push_offset (fb, off))
+                return -1;
+        gfdb_fb_slot (fb, slot);
+        return 0;
+}
+
+
+/* Writes the vtable of the table just before it */
+static int
+gfdb_fb_end_table (gfdb_fb_builder_t *fb, uint32_t *off)
+{
+        uint32_t table          = 0;
+        uint16_t entry          = 0;
+        char le[sizeof (uint16_t)];
+        int i                   = 0;
+
+        if (gfdb_fb_push_le32 (fb, 0))
+                return -1;
+        table = fb->head;
+
+        if (gfdb_fb_prep (fb, sizeof (uint16_t),
+                          (fb->slot_count + 2) * sizeof (uint16_t)))
+                return -1;
+        for (i = fb->slot_count + 1; i >= 0; i--) {
+                if (i >= 2)
+                        entry = fb->slots[i - 2] ?
+                                table - fb->slots[i - 2] : 0;
+                else if (i == 1)
+                        entry = table - fb->table_start;
+                else
+                        entry = (fb->slot_count + 2) * sizeof (uint16_t);
+                le[0] = entry & 0xFF;
+                le[1] = entry >> 8;
+                gfdb_fb_push (fb, le, sizeof (le));
+        }
+
+        /* The table points back at its vtable, just written before it */
+        gfdb_put_le32 (fb->buf + fb->size - table, fb->head - table);
+
+        *off = table;
+        return 0;
+}
+
+
+/* Returns the finished flatbuffer of root, its length a multiple of 8 */
+static int
+gfdb_fb_finish (gfdb_fb_builder_t *fb, uint32_t root, const char **buf,
+                size_t *len)
+{
+        if (gfdb_fb_prep (fb, GFDB_ARROW_ALIGN, sizeof (uint32_t)) ||
+            gfdb_fb_push_offset (fb, root) ||
+            gfdb_fb_prep (fb, GFDB_ARROW_ALIGN, 0))
+                return -1;
+
+        *buf = fb->buf + fb->size - fb->head;
+        *len = fb->head;
+        return 0;
+}
+
+
+/* Wraps header (a Schema or a RecordBatch) into a Message and writes it
+ * with its continuation and length, the body is written by the caller */
+static int
+gfdb_arrow_write_message (gfdb_arrow_writer_t *writer, int header_type,
+                          uint32_t header, uint64_t body_len)
+{
+        gfdb_fb_builder_t *fb   = &writer->fb;
+        uint32_t message        = 0;
+        const char *metadata    = NULL;
+        size_t metadata_len     = 0;
+        char prefix[8];
+
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_scalar (fb, 3, body_len, sizeof (uint64_t)) ||
+            gfdb_fb_add_offset (fb, 2, header) ||
+            gfdb_fb_add_scalar (fb, 0, GFDB_ARROW_METADATA_V5,
+                                sizeof (int16_t)) ||
+            gfdb_fb_add_scalar (fb, 1, header_type, sizeof (uint8_t)) ||
+            gfdb_fb_end_table (fb, &message) ||
+            gfdb_fb_finish (fb, message, &metadata, &metadata_len))
+                return -1;
+
+        gfdb_put_le32 (prefix, GFDB_ARROW_CONTINUATION);
+        gfdb_put_le32 (prefix + 4, metadata_len);
+
+        if (gfdb_write_full (writer->fd, prefix, sizeof (prefix)) ||
+            gfdb_write_full (writer->fd, metadata, metadata_len))
+                return -1;
+
+        gfdb_fb_reset (fb);
+        return 0;
+}
+
+
+/* Builds the Field of a column, type being already built */
+static int
+gfdb_arrow_build_field (gfdb_fb_builder_t *fb, const char *name,
+                        boolean_t nullable, int type_type, uint32_t type,
+                        uint32_t *field)
+{
+        uint32_t name_off       = 0;
+        uint32_t children       = 0;
+
+        /* Readers insist on a children vector, even an empty one */
+        if (gfdb_fb_create_string (fb, name, &name_off) ||
+            gfdb_fb_create_offset_vector (fb, NULL, 0, &children))
+                return -1;
+
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_offset (fb, 0, name_off) ||
+            gfdb_fb_add_offset (fb, 3, type) ||
+            gfdb_fb_add_offset (fb, 5, children) ||
+            gfdb_fb_add_scalar (fb, 1, nullable, sizeof (uint8_t)) ||
+            gfdb_fb_add_scalar (fb, 2, type_type, sizeof (uint8_t)))
+                return -1;
+
+        return gfdb_fb_end_table (fb, field);
+}
+
+
+static int
+gfdb_arrow_write_schema (gfdb_arrow_writer_t *writer)
+{
+        gfdb_fb_builder_t *fb                   = &writer->fb;
+        uint32_t type                           = 0;
+        uint32_t fields[GFDB_ARROW_COLUMNS]     = {0};
+        uint32_t field_vec                      = 0;
+        uint32_t schema                         = 0;
+
+        /* record_index : Int { bitWidth 64, is_signed false } */
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_scalar (fb, 0, 64, sizeof (int32_t)) ||
+            gfdb_fb_end_table (fb, &type) ||
+            gfdb_arrow_build_field (fb, "record_index", _false,
+                                    GFDB_ARROW_TYPE_INT, type, &fields[0]))
+                return -1;
+
+        /* gfid and pgfid : FixedSizeBinary { byteWidth 16 } */
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_scalar (fb, 0, UUID_LEN, sizeof (int32_t)) ||
+            gfdb_fb_end_table (fb, &type) ||
+            gfdb_arrow_build_field (fb, "gfid", _false,
+                                    GFDB_ARROW_TYPE_FIXED_BINARY, type,
+                                    &fields[1]))
+                return -1;
+
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_scalar (fb, 0, UUID_LEN, sizeof (int32_t)) ||
+            gfdb_fb_end_table (fb, &type) ||
+            gfdb_arrow_build_field (fb, "pgfid", _true,
+                                    GFDB_ARROW_TYPE_FIXED_BINARY, type,
+                                    &fields[2]))
+                return -1;
+
+        /* basename : Binary, same layout as Utf8 without the promise */
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_end_table (fb, &type) ||
+            gfdb_arrow_build_field (fb, "basename", _true,
+                                    GFDB_ARROW_TYPE_BINARY, type,
+                                    &fields[3]))
+                return -1;
+
+        if (gfdb_fb_create_offset_vector (fb, fields, GFDB_ARROW_COLUMNS,
+                                          &field_vec))
+                return -1;
+
+        /* Endianness defaults to Little */
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_offset (fb, 1, field_vec) ||
+            gfdb_fb_end_table (fb, &schema))
+                return -1;
+
+        return gfdb_arrow_write_message (writer, GFDB_ARROW_HEADER_SCHEMA,
+                                         schema, 0);
+}
+
+
+static inline uint64_t
+gfdb_arrow_pad (uint64_t len)
+{
+        return (len + GFDB_ARROW_ALIGN - 1) & ~(uint64_t)(GFDB_ARROW_ALIGN - 1);
+}
+
+
+/* Writes the rows gathered so far as a RecordBatch */
+static int
+gfdb_arrow_flush_batch (gfdb_arrow_writer_t *writer)
+{
+        gfdb_fb_builder_t *fb                           = &writer->fb;
+        static const char zeros[GFDB_ARROW_ALIGN]       = {0};
+        const void *data[GFDB_ARROW_BUFFERS]            = {NULL};
+        uint64_t lens[GFDB_ARROW_BUFFERS]               = {0};
+        char buffers[GFDB_ARROW_BUFFERS][16];
+        char nodes[GFDB_ARROW_COLUMNS][16];
+        uint32_t nodes_vec                              = 0;
+        uint32_t buffers_vec                            = 0;
+        uint32_t batch                                  = 0;
+        uint64_t offset                                 = 0;
+        uint32_t rows                                   = writer->rows;
+        uint64_t validity_len                           = 0;
+        int i                                           = 0;
+
+        if (rows == 0)
+                return 0;
+
+        /* No validity buffer is needed when nothing is null */
+        validity_len = writer->null_count ? (rows + 7) / 8 : 0;
+
+        /* record_index, gfid, pgfid then basename, each validity first */
+        data[1] = writer->record_indexes;
+        lens[1] = (uint64_t)rows * sizeof (uint64_t);
+        data[3] = writer->gfids;
+        lens[3] = (uint64_t)rows * UUID_LEN;
+        data[4] = writer->validity;
+        lens[4] = validity_len;
+        data[5] = writer->pgfids;
+        lens[5] = (uint64_t)rows * UUID_LEN;
+        data[6] = writer->validity;
+        lens[6] = validity_len;
+        data[7] = writer->name_offsets;
+        lens[7] = (uint64_t)(rows + 1) * sizeof (int32_t);
+        data[8] = writer->names;
+        lens[8] = le32toh (writer->name_offsets[rows]);
+
+        for (i = 0; i < GFDB_ARROW_BUFFERS; i++) {
+                gfdb_put_le64 (buffers[i], offset);
+                gfdb_put_le64 (buffers[i] + 8, lens[i]);
+                offset += gfdb_arrow_pad (lens[i]);
+        }
+        for (i = 0; i < GFDB_ARROW_COLUMNS; i++) {
+                gfdb_put_le64 (nodes[i], rows);
+                gfdb_put_le64 (nodes[i] + 8, (i >= 2) ?
+                               writer->null_count : 0);
+        }
+
+        if (gfdb_fb_create_struct_vector (fb, buffers, sizeof (buffers[0]),
+                                          GFDB_ARROW_BUFFERS,
+                                          sizeof (uint64_t), &buffers_vec) ||
+            gfdb_fb_create_struct_vector (fb, nodes, sizeof (nodes[0]),
+                                          GFDB_ARROW_COLUMNS,
+                                          sizeof (uint64_t), &nodes_vec))
+                return -1;
+
+        gfdb_fb_start_table (fb);
+        if (gfdb_fb_add_scalar (fb, 0, rows, sizeof (uint64_t)) ||
+            gfdb_fb_add_offset (fb, 1, nodes_vec) ||
+            gfdb_fb_add_offset (fb, 2, buffers_vec) ||
+            gfdb_fb_end_table (fb, &batch))
+                return -1;
+
+        if (gfdb_arrow_write_message (writer, GFDB_ARROW_HEADER_RECORD_BATCH,
+                                      batch, offset))
+                return -1;
+
+        for (i = 0; i < GFDB_ARROW_BUFFERS; i++) {
+                if (lens[i] == 0)
+                        continue;
+                if (gfdb_write_full (writer->fd, data[i], lens[i]) ||
+                    gfdb_write_full (writer->fd, zeros,
+                                     gfdb_arrow_pad (lens[i]) - lens[i]))
+                        return -1;
+        }
+
+        writer->rows = 0;
+        writer->null_count = 0;
+        memset (writer->validity, 0, GFDB_ARROW_BATCH_ROWS / 8);
+        return 0;
+}
+
+
+/* Appends a row, pgfid and name being NULL for a record without links */
+static int
+gfdb_arrow_add_row (gfdb_arrow_writer_t *writer, const uuid_t gfid,
+                    const uuid_t pgfid, const char *name)
+{
+        uint32_t row            = writer->rows;
+        size_t name_len         = name ? strlen (name) : 0;
+        size_t used             = le32toh (writer->name_offsets[row]);
+        size_t size             = 0;
+        char *names             = NULL;
+
+        if (used + name_len > writer->names_size) {
+                size = writer->names_size << 1;
+                names = realloc (writer->names, size);
+                if (!names) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "arrow basename column");
+                        return -1;
+                }
+                writer->names = names;
+                writer->names_size = size;
+        }
+
+        writer->record_indexes[row] = htole64 (writer->record_index);
+        memcpy (writer->gfids + (size_t)row * UUID_LEN, gfid, UUID_LEN);
+        if (name) {
+                memcpy (writer->pgfids + (size_t)row * UUID_LEN, pgfid,
+                        UUID_LEN);
+                memcpy (writer->names + used, name, name_len);
+                writer->validity[row / 8] |= 1 << (row % 8);
+        } else {
+                memset (writer->pgfids + (size_t)row * UUID_LEN, 0,
+                        UUID_LEN);
+                writer->null_count++;
+        }
+        writer->name_offsets[row + 1] = htole32 (used + name_len);
+        writer->rows++;
+
+        if (writer->rows == GFDB_ARROW_BATCH_ROWS)
+                return gfdb_arrow_flush_batch (writer);
+        return 0;
+}
+
+
+static int
+gfdb_arrow_add_record_cbk (gfdb_query_record_t *query_record, void *data)
+{
+        gfdb_arrow_writer_t *writer     = data;
+        gfdb_link_info_t *link_info     = NULL;
+        int ret                         = 0;
+
+        if (list_empty (&query_record->link_list))
+                ret = gfdb_arrow_add_row (writer, query_record->gfid,
+                                          NULL, NULL);
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                ret = gfdb_arrow_add_row (writer, query_record->gfid,
+                                          link_info->pargfid,
+                                          link_info->file_name);
+                if (ret)
+                        break;
+        }
+
+        writer->record_index++;
+        return ret;
+}
+
+
+static void
+gfdb_arrow_writer_cleanup (gfdb_arrow_writer_t *writer)
+{
+        free (writer->record_indexes);
+        free (writer->gfids);
+        free (writer->pgfids);
+        free (writer->validity);
+        free (writer->name_offsets);
+        free (writer->names);
+        free (writer->fb.buf);
+        memset (writer, 0, sizeof (*writer));
+}
+
+
+static int
+gfdb_arrow_writer_init (gfdb_arrow_writer_t *writer, int fd)
+{
+        memset (writer, 0, sizeof (*writer));
+        writer->fd = fd;
+        writer->names_size = GFDB_ARROW_BATCH_ROWS * 16;
+
+        writer->record_indexes = malloc (GFDB_ARROW_BATCH_ROWS *
+                                         sizeof (uint64_t));
+        writer->gfids = malloc (GFDB_ARROW_BATCH_ROWS * UUID_LEN);
+        writer->pgfids = malloc (GFDB_ARROW_BATCH_ROWS * UUID_LEN);
+        writer->validity = calloc (GFDB_ARROW_BATCH_ROWS / 8, 1);
+        writer->name_offsets = calloc (GFDB_ARROW_BATCH_ROWS + 1,
+                                       sizeof (int32_t));
+        writer->names = malloc (writer->names_size);
+        if (!writer->record_indexes || !writer->gfids || !writer->pgfids ||
+            !writer->validity || !writer->name_offsets || !writer->names) {
+                LOG_IT (log_error, "Memory allocation failed for arrow "
+                        "columns");
+                goto err;
+        }
+
+        if (gfdb_fb_init (&writer->fb))
+                goto err;
+
+        return 0;
+err:
+        gfdb_arrow_writer_cleanup (writer);
+        return -1;
+}
+
+
+/* Exports the records as an Arrow IPC stream to conf->arrow_path, - being
+ * stdout */
+int
+gfdb_arrow_export_query_file (int query_fd, const gfdb_reader_conf_t *conf)
+{
+        int ret                         = -1;
+        int fd                          = -1;
+        gfdb_arrow_writer_t writer      = {0};
+        char eos[8];
+
+        if (strcmp (conf->arrow_path, "-") == 0) {
+                fd = STDOUT_FILENO;
+        } else {
+                fd = open (conf->arrow_path,
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                        LOG_IT (log_error, "Failed to open %s : %s",
+                                conf->arrow_path, strerror (errno));
+                        goto out;
+                }
+        }
+
+        if (gfdb_arrow_writer_init (&writer, fd))
+                goto out;
+
+        if (gfdb_arrow_write_schema (&writer))
+                goto out;
+
+        if (gfdb_process_query_file (query_fd, conf,
+                                     gfdb_arrow_add_record_cbk, &writer))
+                goto out;
+
+        if (gfdb_arrow_flush_batch (&writer))
+                goto out;
+
+        gfdb_put_le32 (eos, GFDB_ARROW_CONTINUATION);
+        gfdb_put_le32 (eos + 4, 0);
+        if (gfdb_write_full (fd, eos, sizeof (eos)))
+                goto out;
+
+        ret = 0;
+out:
+        gfdb_arrow_writer_cleanup (&writer);
+        if (fd >= 0 && fd != STDOUT_FILENO && close (fd) && !ret) {
+                LOG_IT (log_error, "Failed to close %s : %s",
+                        conf->arrow_path, strerror (errno));
+                ret = -1;
+        }
+        return ret;
+}
+
+
+/******************************************************************************
+                        MACHINE READABLE OUTPUT
+*******************************************************************************/
+/******************************************************************************
+ The dump text is meant for people, and a basename with a space or a newline
+ in it cannot be parsed back out of it. With --format the dump mode emits
+ one of:
+
+ json   One JSON object per line (JSON Lines) :
+          {"gfid":"<uuid>","links":[{"pgfid":"<uuid>","name":"<name>"},...]}
+        Names are escaped as JSON requires. A byte that is not part of valid
+        UTF-8 is written as the lone surrogate \udcXX, as Python's
+        surrogateescape does, so names that are not UTF-8 come back intact
+        with json.loads () and .encode ("utf-8", "surrogateescape").
+
+ nul    Three NUL terminated fields per link, GFID, PGFID and basename, for
+        xargs -0 -n 3. A record without links gives a GFID and two empty
+        fields.
+
+ binary Per record, fixed width little endian fields :
+        +-------------------------------------------------------------+
+        | GFID | LINK COUNT |  <LINK>  |  <LINK>  |.....              |
+        +-------------------------------------------------------------+
+          16 B      2 B
+        Each <LINK> is
+        +-------------------------------------------+
+        | PGFID | BASE_NAME_LENGTH |    BASE_NAME   |
+        +-------------------------------------------+
+          16 B          2 B        BASE_NAME_LENGTH
+
+ Each format has its own emitter which encodes a whole record into one
+ buffer, UUIDs through a hex table rather than printf, and hands it to stdio
+ with a single fwrite. Going through stdout keeps --checkpoint working.
+ * ****************************************************************************/
+
+/* "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" without the NUL */
+#define GFDB_UUID_STR_LEN               36
+/* Worst case JSON escaping of one byte, \udcXX */
+#define GFDB_JSON_ESCAPE_MAX            6
+
+typedef struct gfdb_emitter {
+        char                            *buffer;
+        size_t                          size;
+} gfdb_emitter_t;
+
+static const char gfdb_hex_digits[] = "0123456789abcdef";
+
+
+/* Makes room for len bytes in the emitter buffer */
+static int
+gfdb_emitter_reserve (gfdb_emitter_t *emitter, size_t len)
+{
+        char *new_buffer = NULL;
+        size_t new_size = 0;
+
+        if (len <= emitter->size)
+                return 0;
+
+        new_size = emitter->size ? emitter->size : 4096;
+        while (new_size < len)
+                new_size *= 2;
+
+        new_buffer = realloc (emitter->buffer, new_size);
+        if (!new_buffer) {
+                LOG_IT (log_error, "Memory allocation failed for output "
+                        "buffer");
+                return -1;
+        }
+        emitter->buffer = new_buffer;
+        emitter->size = new_size;
+        return 0;
+}
+
+
+static int
+gfdb_emitter_write (gfdb_emitter_t *emitter, size_t len)
+{
+        if (fwrite_unlocked (emitter->buffer, 1, len, stdout) != len) {
+                LOG_IT (log_error, "Failed to write output : %s",
+                        strerror (errno));
+                return -1;
+        }
+        return 0;
+}
+
+
+void
+gfdb_emitter_cleanup (gfdb_emitter_t *emitter)
+{
+        free (emitter->buffer);
+        memset (emitter, 0, sizeof (*emitter));
+}
+
+
+/* Same text as gf_uuid_unparse, returns the end of it */
+static inline char *
+gfdb_emit_uuid (char *out, const unsigned char *uu)
+{
+        int i = 0;
+
+        for (i = 0; i < UUID_LEN; i++) {
+                if (i == 4 || i == 6 || i == 8 || i == 10)
+                        *out++ = '-';
+                *out++ = gfdb_hex_digits[uu[i] >> 4];
+                *out++ = gfdb_hex_digits[uu[i] & 0xF];
+        }
+        return out;
+}
+
+
+/* Length of the valid UTF-8 sequence at str, 0 if it is not one */
+static inline size_t
+gfdb_utf8_sequence_len (const unsigned char *str, size_t left)
+{
+        if (str[0] < 0x80)
+                return 1;
+
+        if (str[0] >= 0xC2 && str[0] <= 0xDF) {
+                if (left >= 2 && (str[1] & 0xC0) == 0x80)
+                        return 2;
+                return 0;
+        }
+
+        if (str[0] >= 0xE0 && str[0] <= 0xEF) {
+                if (left < 3 || (str[1] & 0xC0) != 0x80 ||
+                    (str[2] & 0xC0) != 0x80)
+                        return 0;
+                /* Overlong forms and UTF-16 surrogates */
+                if ((str[0] == 0xE0 && str[1] < 0xA0) ||
+                    (str[0] == 0xED && str[1] > 0x9F))
+                        return 0;
+                return 3;
+        }
+
+        if (str[0] >= 0xF0 && str[0] <= 0xF4) {
+                if (left < 4 || (str[1] & 0xC0) != 0x80 ||
+                    (str[2] & 0xC0) != 0x80 || (str[3] & 0xC0) != 0x80)
+                        return 0;
+                /* Overlong forms and beyond U+10FFFF */
+                if ((str[0] == 0xF0 && str[1] < 0x90) ||
+                    (str[0] == 0xF4 && str[1] > 0x8F))
+                        return 0;
+                return 4;
+        }
+
+        return 0;
+}
+
+
+/* Writes name as the inside of a JSON string, returns the end of it */
+static char *
+gfdb_emit_json_string (char *out, const char *name, size_t len)
+{
+        const unsigned char *str = (const unsigned char *)name;
+        const unsigned char *end = str + len;
+        size_t seq_len = 0;
+
+        while (str < end) {
+                if (*str >= 0x20 && *str < 0x80 && *str != '"' &&
+                    *str != '\\') {
+                        *out++ = *str++;
+                        continue;
+                }
+
+                switch (*str) {
+                case '"':
+                case '\\':
+                        *out++ = '\\';
+                        *out++ = *str++;
+                        continue;
+                case '\n':
+                        *out++ = '\\';
+                        *out++ = 'n';
+                        str++;
+                        continue;
+                case '\t':
+                        *out++ = '\\';
+                        *out++ = 't';
+                        str++;
+                        continue;
+                case '\r':
+                        *out++ = '\\';
+                        *out++ = 'r';
+                        str++;
+                        continue;
+                }
+
+                if (*str < 0x20) {
+                        memcpy (out, "\\u00", 4);
+                        out += 4;
+                        *out++ = gfdb_hex_digits[*str >> 4];
+                        *out++ = gfdb_hex_digits[*str & 0xF];
+                        str++;
+                        continue;
+                }
+
+                seq_len = gfdb_utf8_sequence_len (str, end - str);
+                if (seq_len) {
+                        memcpy (out, str, seq_len);
+                        out += seq_len;
+                        str += seq_len;
+                        continue;
+                }
+
+                /* Not UTF-8, keep the byte as a lone surrogate */
+                memcpy (out, "\\udc", 4);
+                out += 4;
+                *out++ = gfdb_hex_digits[*str >> 4];
+                *out++ = gfdb_hex_digits[*str & 0xF];
+                str++;
+        }
+
+        return out;
+}
+
+
+static int
+gfdb_emit_json_record (gfdb_query_record_t *query_record, void *data)
+{
+        gfdb_emitter_t *emitter = data;
+        gfdb_link_info_t *link_info = NULL;
+        size_t len = 0;
+        size_t name_len = 0;
+        char *out = NULL;
+
+        /* {"gfid":"<uuid>","links":[ ... ]}\n */
+        len = 24 + GFDB_UUID_STR_LEN;
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                /* {"pgfid":"<uuid>","name":"<name>"}, */
+                len += 24 + GFDB_UUID_STR_LEN +
+                       GFDB_JSON_ESCAPE_MAX * strlen (link_info->file_name);
+        }
+        if (gfdb_emitter_reserve (emitter, len))
+                return -1;
+
+        out = emitter->buffer;
+        memcpy (out, "{\"gfid\":\"", 9);
+        out = gfdb_emit_uuid (out + 9, query_record->gfid);
+        memcpy (out, "\",\"links\":[", 11);
+        out += 11;
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                if (link_info->list.prev != &query_record->link_list)
+                        *out++ = ',';
+                memcpy (out, "{\"pgfid\":\"", 10);
+                out = gfdb_emit_uuid (out + 10, link_info->pargfid);
+                memcpy (out, "\",\"name\":\"", 10);
+                name_len = strlen (link_info->file_name);
+                out = gfdb_emit_json_string (out + 10, link_info->file_name,
+                                             name_len);
+                memcpy (out, "\"}", 2);
+                out += 2;
+        }
+
+        memcpy (out, "]}\n", 3);
+        out += 3;
+
+        return gfdb_emitter_write (emitter, out - emitter->buffer);
+}
+
+
+static int
+gfdb_emit_nul_record (gfdb_query_record_t *query_record, void *data)
+{
+        gfdb_emitter_t *emitter = data;
+        gfdb_link_info_t *link_info = NULL;
+        size_t len = 0;
+        size_t name_len = 0;
+        char *out = NULL;
+
+        len = GFDB_UUID_STR_LEN + 3;
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                len += 2 * GFDB_UUID_STR_LEN + 3 +
+                       strlen (link_info->file_name);
+        }
+        if (gfdb_emitter_reserve (emitter, len))
+                return -1;
+
+        out = emitter->buffer;
+        if (list_empty (&query_record->link_list)) {
+                out = gfdb_emit_uuid (out, query_record->gfid);
+                memset (out, '\0', 3);
+                out += 3;
+        }
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                out = gfdb_emit_uuid (out, query_record->gfid);
+                *out++ = '\0';
+                out = gfdb_emit_uuid (out, link_info->pargfid);
+                *out++ = '\0';
+                name_len = strlen (link_info->file_name);
+                memcpy (out, link_info->file_name, name_len);
+                out += name_len;
+                *out++ = '\0';
+        }
+
+        return gfdb_emitter_write (emitter, out - emitter->buffer);
+}
+
+
+static int
+gfdb_emit_binary_record (gfdb_query_record_t *query_record, void *data)
+{
+        gfdb_emitter_t *emitter = data;
+        gfdb_link_info_t *link_info = NULL;
+        size_t len = 0;
+        size_t name_len = 0;
+        size_t link_count = 0;
+        char *out = NULL;
+
+        len = UUID_LEN + sizeof (uint16_t);
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                name_len = strlen (link_info->file_name);
+                if (name_len > UINT16_MAX) {
+                        LOG_IT (log_error, "Basename of %zu bytes does not "
+                                "fit the binary format", name_len);
+                        return -1;
+                }
+                len += UUID_LEN + sizeof (uint16_t) + name_len;
+                link_count++;
+        }
+        if (link_count > UINT16_MAX) {
+                LOG_IT (log_error, "%zu links do not fit the binary format",
+                        link_count);
+                return -1;
+        }
+        if (gfdb_emitter_reserve (emitter, len))
+                return -1;
+
+        out = emitter->buffer;
+        memcpy (out, query_record->gfid, UUID_LEN);
+        out += UUID_LEN;
+        out[0] = link_count & 0xFF;
+        out[1] = link_count >> 8;
+        out += sizeof (uint16_t);
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                memcpy (out, link_info->pargfid, UUID_LEN);
+                out += UUID_LEN;
+                name_len = strlen (link_info->file_name);
+                out[0] = name_len & 0xFF;
+                out[1] = name_len >> 8;
+                out += sizeof (uint16_t);
+                memcpy (out, link_info->file_name, name_len);
+                out += name_len;
+        }
+
+        return gfdb_emitter_write (emitter, out - emitter->buffer);
+}
+
+
+/* Emitter of the output format, NULL for the text dump */
+gfdb_query_record_cbk_t
+gfdb_emitter_cbk (gfdb_output_format_t format)
+{
+        switch (format) {
+        case GFDB_OUTPUT_FORMAT_JSON:
+                return gfdb_emit_json_record;
+        case GFDB_OUTPUT_FORMAT_NUL:
+                return gfdb_emit_nul_record;
+        case GFDB_OUTPUT_FORMAT_BINARY:
+                return gfdb_emit_binary_record;
+        case GFDB_OUTPUT_FORMAT_TEXT:
+        default:
+                return NULL;
+        }
+}
+
+
+/******************************************************************************
+                        INDEX BY GFID AND PGFID
+*******************************************************************************/
+/******************************************************************************
+ Answering "is GFID X in this query file, and under which parents?" used to
+ mean dumping the whole file. --index-build writes, next to a legacy query
+ file, two sorted tables of (key, record offset) : one keyed by the GFID of
+ every record, one by every distinct PGFID of its links. --index-lookup maps
+ the index and finds the range of entries matching a full GFID or a hex
+ prefix of one, then reads and prints only the records of that range, in
+ file order, in the --format of the dump mode. With --by-pgfid the keys are
+ looked up among the parents instead.
+
+ GFIDs are random, so the first 8 bytes of the keys are close to uniformly
+ spread over the table. The search interpolates on them for a few probes,
+ which lands next to the key in a handful of page touches, and finishes
+ with a binary search over the remaining window.
+
+ The index remembers the size and mtime of the query file it was built
+ from, and refuses lookups once the query file has changed.
+
+ Index file format (host endian, same as the query file):
+   +----------------------------------------------------------------------+
+   | MAGIC | VERSION | PAD | QUERY SIZE | QUERY MTIME | GFID COUNT |       |
+   |       PGFID COUNT | PAD                                              |
+   +----------------------------------------------------------------------+
+     8 B      4 B     4 B      8 B          8 B          8 B
+          8 B          ->64 B
+   followed by GFID COUNT then PGFID COUNT entries, each sorted by key
+   +--------------------------+
+   | KEY | RECORD OFFSET      |
+   +--------------------------+
+     16 B        8 B
+ * ****************************************************************************/
+
+#define GFDB_INDEX_MAGIC                0x3158444942444647ULL /* GFDBIDX1 */
+#define GFDB_INDEX_VERSION              1
+/* Interpolation probes before falling back to a binary search */
+#define GFDB_INDEX_MAX_PROBES           8
+
+typedef struct gfdb_index_header {
+        uint64_t                        magic;
+        uint32_t                        version;
+        uint32_t                        pad0;
+        uint64_t                        query_size;
+        uint64_t                        query_mtime_ns;
+        uint64_t                        gfid_count;
+        uint64_t                        pgfid_count;
+        char                            pad[16];
+} gfdb_index_header_t;
+
+typedef struct gfdb_index_entry {
+        uuid_t                          key;
+        uint64_t                        offset;
+} __attribute__ ((packed)) gfdb_index_entry_t;
+
+/*Entries gathered while building a table*/
+typedef struct gfdb_index_table {
+        gfdb_index_entry_t              *entries;
+        size_t                          count;
+        size_t                          size;
+} gfdb_index_table_t;
+
+/*Mapped index*/
+typedef struct gfdb_index {
+        gfdb_index_header_t             *header;
+        const gfdb_index_entry_t        *gfids;
+        const gfdb_index_entry_t        *pgfids;
+        size_t                          map_size;
+} gfdb_index_t;
+
+
+static uint64_t
+gfdb_index_mtime_ns (const struct stat *stat_buff)
+{
+        return (uint64_t)stat_buff->st_mtim.tv_sec * 1000000000ULL +
+               stat_buff->st_mtim.tv_nsec;
+}
+
+
+static int
+gfdb_index_table_add (gfdb_index_table_t *table, const uuid_t key,
+                      uint64_t offset)
+{
+        gfdb_index_entry_t *new_entries = NULL;
+        size_t new_size = 0;
+
+        if (table->count == table->size) {
+                new_size = table->size ? table->size * 2 : 4096;
+                new_entries = realloc (table->entries,
+                                       new_size * sizeof (*new_entries));
+                if (!new_entries) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "index entries");
+                        return -1;
+                }
+                table->entries = new_entries;
+                table->size = new_size;
+        }
+
+        memcpy (table->entries[table->count].key, key, UUID_LEN);
+        table->entries[table->count].offset = offset;
+        table->count++;
+        return 0;
+}
+
+
+static int
+gfdb_index_entry_cmp (const void *a, const void *b)
+{
+        const gfdb_index_entry_t *entry_a = a;
+        const gfdb_index_entry_t *entry_b = b;
+        int ret = 0;
+
+        ret = memcmp (entry_a->key, entry_b->key, UUID_LEN);
+        if (ret)
+                return ret;
+        return (entry_a->offset > entry_b->offset) -
+               (entry_a->offset < entry_b->offset);
+}
+
+
+/* Adds the GFID of the record, and each of its parents once */
+static int
+gfdb_index_add_record (gfdb_index_table_t *gfids, gfdb_index_table_t *pgfids,
+                       gfdb_query_record_t *query_record, uint64_t offset)
+{
+        gfdb_link_info_t *link_info = NULL;
+        size_t first = pgfids->count;
+        size_t i = 0;
+
+        if (gfdb_index_table_add (gfids, query_record->gfid, offset))
+                return -1;
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                for (i = first; i < pgfids->count; i++) {
+                        if (!memcmp (pgfids->entries[i].key,
+                                     link_info->pargfid, UUID_LEN))
+                                break;
+                }
+                if (i < pgfids->count)
+                        continue;
+                if (gfdb_index_table_add (pgfids, link_info->pargfid,
+                                          offset))
+                        return -1;
+        }
+
+        return 0;
+}
+
+
+/* Builds the index of the query file into index_path, through a temporary
+ * file renamed over it like the bloom filter */
+int
+gfdb_index_build (int query_fd, const char *index_path)
+{
+        int ret                                 = -1;
+        int fd                                  = -1;
+        char *tmp_path                          = NULL;
+        struct stat stat_buff                   = {0};
+        gfdb_record_scanner_t scanner           = {0};
+        gfdb_index_table_t gfids                = {0};
+        gfdb_index_table_t pgfids               = {0};
+        gfdb_index_header_t header              = {0};
+        gfdb_query_record_t *query_record       = NULL;
+        char *record                            = NULL;
+        int record_len                          = 0;
+        off_t offset                            = 0;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, index_path, out);
+
+        if (fstat (query_fd, &stat_buff)) {
+                LOG_IT (log_error, "Failed to stat query file : %s",
+                        strerror (errno));
+                goto out;
+        }
+        posix_fadvise (query_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        if (gfdb_record_scanner_init (&scanner, query_fd))
+                goto out;
+
+        for (;;) {
+                offset = scanner.offset;
+                ret = gfdb_record_scanner_next (&scanner, &record,
+                                                &record_len);
+                if (ret <= 0)
+                        break;
+                ret = -1;
+
+                if (gfdb_query_record_deserialize (record, record_len,
+                                                   &query_record))
+                        goto out;
+                if (gfdb_index_add_record (&gfids, &pgfids, query_record,
+                                           offset))
+                        goto out;
+                gfdb_query_record_free (query_record);
+                query_record = NULL;
+        }
+        if (ret < 0)
+                goto out;
+        ret = -1;
+
+        qsort (gfids.entries, gfids.count, sizeof (gfdb_index_entry_t),
+               gfdb_index_entry_cmp);
+        qsort (pgfids.entries, pgfids.count, sizeof (gfdb_index_entry_t),
+               gfdb_index_entry_cmp);
+
+        if (asprintf (&tmp_path, "%s.XXXXXX", index_path) < 0) {
+                tmp_path = NULL;
+                LOG_IT (log_error, "Memory allocation failed for path");
+                goto out;
+        }
+
+        fd = mkstemp (tmp_path);
+        if (fd < 0) {
+                LOG_IT (log_error, "Failed to create %s : %s", tmp_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        /* The header goes last, an index is valid only once complete */
+        if (lseek (fd, sizeof (header), SEEK_SET) < 0 ||
+            gfdb_write_full (fd, (char *)gfids.entries,
+                             gfids.count * sizeof (gfdb_index_entry_t)) ||
+            gfdb_write_full (fd, (char *)pgfids.entries,
+                             pgfids.count * sizeof (gfdb_index_entry_t)))
+                goto out;
+
+        header.magic = GFDB_INDEX_MAGIC;
+        header.version = GFDB_INDEX_VERSION;
+        header.query_size = stat_buff.st_size;
+        header.query_mtime_ns = gfdb_index_mtime_ns (&stat_buff);
+        header.gfid_count = gfids.count;
+        header.pgfid_count = pgfids.count;
+
+        if (pwrite (fd, &header, sizeof (header), 0) != sizeof (header) ||
+            fsync (fd) || fchmod (fd, 0644) ||
+            rename (tmp_path, index_path)) {
+                LOG_IT (log_error, "Failed to write %s : %s", index_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        LOG_IT (log_info, "Index of %llu GFIDs and %llu parent links",
+                (unsigned long long)gfids.count,
+                (unsigned long long)pgfids.count);
+
+        ret = 0;
+out:
+        gfdb_query_record_free (query_record);
+        gfdb_record_scanner_cleanup (&scanner);
+        free (gfids.entries);
+        free (pgfids.entries);
+        if (fd >= 0) {
+                close (fd);
+                if (ret)
+                        unlink (tmp_path);
+        }
+        free (tmp_path);
+        return ret;
+}
+
+
+/* Maps the index read-only, checking it still matches the query file */
+int
+gfdb_index_open (const char *index_path, int query_fd, gfdb_index_t *index)
+{
+        int ret                         = -1;
+        int fd                          = -1;
+        struct stat stat_buff           = {0};
+        struct stat query_stat          = {0};
+        void *map                       = MAP_FAILED;
+        gfdb_index_header_t *header     = NULL;
+        uint64_t entry_count            = 0;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, index_path, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, index, out);
+
+        fd = open (index_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat (fd, &stat_buff)) {
+                LOG_IT (log_error, "Failed to open %s : %s", index_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        if (stat_buff.st_size < (off_t)sizeof (gfdb_index_header_t)) {
+                LOG_IT (log_error, "%s is not an index", index_path);
+                goto out;
+        }
+
+        map = mmap (NULL, stat_buff.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                LOG_IT (log_error, "Failed to map %s : %s", index_path,
+                        strerror (errno));
+                goto out;
+        }
+
+        header = map;
+        entry_count = (stat_buff.st_size - sizeof (*header)) /
+                      sizeof (gfdb_index_entry_t);
+        if (header->magic != GFDB_INDEX_MAGIC ||
+            header->version != GFDB_INDEX_VERSION ||
+            header->gfid_count > entry_count ||
+            header->pgfid_count != entry_count - header->gfid_count) {
+                LOG_IT (log_error, "%s is not a valid index", index_path);
+                goto out;
+        }
+
+        if (fstat (query_fd, &query_stat) ||
+            header->query_size != (uint64_t)query_stat.st_size ||
+            header->query_mtime_ns != gfdb_index_mtime_ns (&query_stat)) {
+                LOG_IT (log_error, "%s was built from another version of "
+                        "the query file, rebuild it", index_path);
+                goto out;
+        }
+
+        madvise (map, stat_buff.st_size, MADV_RANDOM);
+
+        index->header = header;
+        index->gfids = (const gfdb_index_entry_t *)(header + 1);
+        index->pgfids = index->gfids + header->gfid_count;
+        index->map_size = stat_buff.st_size;
+        map = MAP_FAILED;
+
+        ret = 0;
+out:
+        if (map != MAP_FAILED)
+                munmap (map, stat_buff.st_size);
+        if (fd >= 0)
+                close (fd);
+        return ret;
+}
+
+
+void
+gfdb_index_close (gfdb_index_t *index)
+{
+        if (index && index->header) {
+                munmap (index->header, index->map_size);
+                index->header = NULL;
+        }
+}
+
+
+static inline uint64_t
+gfdb_index_key_prefix (const unsigned char *key)
+{
+        uint64_t prefix = 0;
+
+        memcpy (&prefix, key, sizeof (prefix));
+        return be64toh (prefix);
+}
+
+
+/* First entry whose key is not below key, interpolating on the leading
+ * 8 bytes of the keys before a binary search */
+static size_t
+gfdb_index_lower_bound (const gfdb_index_entry_t *entries, size_t count,
+                        const unsigned char *key)
+{
+        size_t low = 0;
+        size_t high = count;
+        size_t mid = 0;
+        uint64_t key_prefix = gfdb_index_key_prefix (key);
+        uint64_t low_prefix = 0;
+        uint64_t high_prefix = 0;
+        int probes = 0;
+
+        /* The answer stays within [low, high] */
+        while (high - low > 16 && probes++ < GFDB_INDEX_MAX_PROBES) {
+                if (memcmp (entries[low].key, key, UUID_LEN) >= 0)
+                        return low;
+                if (memcmp (entries[high - 1].key, key, UUID_LEN) < 0)
+                        return high;
+
+                low_prefix = gfdb_index_key_prefix (entries[low].key);
+                high_prefix = gfdb_index_key_prefix (entries[high - 1].key);
+                if (high_prefix == low_prefix)
+                        break;
+
+                mid = low + (size_t)((unsigned __int128)(key_prefix -
+                                                         low_prefix) *
+                                     (high - 1 - low) /
+                                     (high_prefix - low_prefix));
+                if (memcmp (entries[mid].key, key, UUID_LEN) < 0)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        while (low < high) {
+                mid = low + (high - low) / 2;
+                if (memcmp (entries[mid].key, key, UUID_LEN) < 0)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        return low;
+}
+
+
+/* Turns a GFID, or a hex prefix of one (dashes ignored), into the lowest
+ * and highest keys it matches */
+static int
+gfdb_index_parse_key (const char *str, uuid_t low, uuid_t high)
+{
+        int digits = 0;
+        int value = 0;
+        const char *c = NULL;
+
+        memset (low, 0, UUID_LEN);
+        memset (high, 0xFF, UUID_LEN);
+
+        for (c = str; *c; c++) {
+                if (*c == '-')
+                        continue;
+                if (!isxdigit ((unsigned char)*c) || digits == 2 * UUID_LEN)
+                        return -1;
+                value = isdigit ((unsigned char)*c) ? *c - '0' :
+                        tolower ((unsigned char)*c) - 'a' + 10;
+                if (digits % 2 == 0) {
+                        low[digits / 2] = value << 4;
+                        high[digits / 2] = (value << 4) | 0xF;
+                } else {
+                        low[digits / 2] |= value;
+                        high[digits / 2] = low[digits / 2];
+                }
+                digits++;
+        }
+
+        return digits ? 0 : -1;
+}
+
+
+static int
+gfdb_index_offset_cmp (const void *a, const void *b)
+{
+        uint64_t offset_a = *(const uint64_t *)a;
+        uint64_t offset_b = *(const uint64_t *)b;
+
+        return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+/* Reads the record at offset and hands it to cbk */
+static int
+gfdb_index_read_record (int query_fd, uint64_t offset, char **buffer,
+                        size_t *buffer_size, gfdb_query_record_cbk_t cbk,
+                        void *data)
+{
+        int ret                                 = -1;
+        int32_t record_len                      = 0;
+        char *new_buffer                        = NULL;
+        gfdb_query_record_t *query_record       = NULL;
+
+        if (gfdb_pread_full (query_fd, (char *)&record_len,
+                             sizeof (record_len), offset))
+                goto out;
+        if (record_len < (int32_t)GFDB_QUERY_RECORD_MIN_LEN ||
+            record_len > GFDB_QUERY_RECORD_MAX_LEN) {
+                LOG_AT (log_error, offset, "Invalid record length %d in "
+                        "indexed query file", record_len);
+                goto out;
+        }
+
+        if ((size_t)record_len > *buffer_size) {
+                new_buffer = realloc (*buffer, record_len);
+                if (!new_buffer) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "record buffer");
+                        goto out;
+                }
+                *buffer = new_buffer;
+                *buffer_size = record_len;
+        }
+
+        if (gfdb_pread_full (query_fd, *buffer, record_len,
+                             offset + sizeof (record_len)))
+                goto out;
+
+        if (gfdb_query_record_deserialize (*buffer, record_len,
+                                           &query_record)) {
+                LOG_AT (log_error, offset, "Failed to de-serialize query "
+                        "record");
+                goto out;
+        }
+
+        ret = cbk (query_record, data);
+out:
+        gfdb_query_record_free (query_record);
+        return ret;
+}
+
+
+/* Looks up every key (arguments, or else one per line on stdin) and hands
+ * the records matching it to cbk. Keys matching nothing are reported and
+ * make the lookup fail once all the keys are done. */
+int
+gfdb_index_lookup (int query_fd, const gfdb_reader_conf_t *conf,
+                   gfdb_query_record_cbk_t cbk, void *data)
+{
+        int ret                                 = -1;
+        gfdb_index_t index                      = {0};
+        const gfdb_index_entry_t *entries       = NULL;
+        size_t entry_count                      = 0;
+        uuid_t low                              = {0};
+        uuid_t high                             = {0};
+        size_t first                            = 0;
+        size_t last                             = 0;
+        size_t i                                = 0;
+        uint64_t *offsets                       = NULL;
+        size_t offsets_size                     = 0;
+        size_t offset_count                     = 0;
+        uint64_t *new_offsets                   = NULL;
+        char *buffer                            = NULL;
+        size_t buffer_size                      = 0;
+        char *line                              = NULL;
+        size_t line_size                        = 0;
+        ssize_t len                             = 0;
+        const char *key                         = NULL;
+        int arg                                 = 0;
+        boolean_t missing                       = _false;
+
+        if (gfdb_index_open (conf->index_path, query_fd, &index))
+                goto out;
+
+        if (conf->by_pgfid) {
+                entries = index.pgfids;
+                entry_count = index.header->pgfid_count;
+        } else {
+                entries = index.gfids;
+                entry_count = index.header->gfid_count;
+        }
+
+        for (;;) {
+                if (conf->arg_count) {
+                        if (arg == conf->arg_count)
+                                break;
+                        key = conf->args[arg++];
+                } else {
+                        len = getline (&line, &line_size, stdin);
+                        if (len <= 0)
+                                break;
+                        if (line[len - 1] == '\n')
+                                line[len - 1] = '\0';
+                        key = line;
+                }
+
+                if (gfdb_index_parse_key (key, low, high)) {
+                        LOG_IT (log_error, "Invalid GFID or GFID prefix %s",
+                                key);
+                        goto out;
+                }
+
+                first = gfdb_index_lower_bound (entries, entry_count, low);
+                last = first;
+                while (last < entry_count &&
+                       memcmp (entries[last].key, high, UUID_LEN) <= 0)
+                        last++;
+
+                if (first == last) {
+                        LOG_IT (log_error, "No record matches %s", key);
+                        missing = _true;
+                        continue;
+                }
+
+                /* A prefix can match a record through more than one
+                 * parent, read each once and in file order */
+                if (last - first > offsets_size) {
+                        new_offsets = realloc (offsets, (last - first) *
+                                               sizeof (*offsets));
+                        if (!new_offsets) {
+                                LOG_IT (log_error, "Memory allocation "
+                                        "failed for offsets");
+                                goto out;
+                        }
+                        offsets = new_offsets;
+                        offsets_size = last - first;
+                }
+                for (i = first; i < last; i++)
+                        offsets[i - first] = entries[i].offset;
+                qsort (offsets, last - first, sizeof (*offsets),
+                       gfdb_index_offset_cmp);
+
+                offset_count = 0;
+                for (i = 0; i < last - first; i++) {
+                        if (offset_count &&
+                            offsets[offset_count - 1] == offsets[i])
+                                continue;
+                        offsets[offset_count++] = offsets[i];
+                }
+
+                for (i = 0; i < offset_count; i++) {
+                        if (gfdb_index_read_record (query_fd, offsets[i],
+                                                    &buffer, &buffer_size,
+                                                    cbk, data))
+                                goto out;
+                }
+        }
+
+        ret = missing ? -1 : 0;
+out:
+        free (line);
+        free (buffer);
+        free (offsets);
+        gfdb_index_close (&index);
+        return ret;
+}
+
+
+/******************************************************************************
+                        INTERNING NAMES AND PARENTS
+*******************************************************************************/
+/******************************************************************************
+ Record sets held in memory repeat the same basenames (index.html, .gitkeep)
+ and the same parents over and over. Both are interned to dense 32 bit ids :
+ a basename is stored once in the name pool and a PGFID once in the pgfid
+ dictionary, and the in-memory structures keep only the ids. Two links with
+ the same name (parent) have the same id, so comparing them is an integer
+ compare. Ids start at 0 and stay valid until the pool (dictionary) is reset.
+
+ Both look up ids through an open addressing table of id + 1 (0 is a free
+ slot), kept at most half full. The hash of every id is kept aside so that
+ growing the table does not touch the keys.
+ * ****************************************************************************/
+
+#define GFDB_INTERN_MIN_SLOTS           1024
+#define GFDB_NAME_POOL_CHUNK_SIZE       (1024 * 1024)
+
+/*Open addressing table from hashes to ids*/
+typedef struct gfdb_intern_table {
+        uint32_t                        *slots;
+        size_t                          slot_count;
+        uint32_t                        *hashes;
+        uint32_t                        count;
+        uint32_t                        size;
+} gfdb_intern_table_t;
+
+/*Hash consed pool of basenames*/
+typedef struct gfdb_name_pool {
+        gfdb_intern_table_t             table;
+        /* Names by id, each NUL terminated inside a chunk */
+        char                            **names;
+        /* Chunks the names are carved out of, the last one is being used */
+        char                            **chunks;
+        int                             chunk_count;
+        size_t                          chunk_used;
+} gfdb_name_pool_t;
+
+/*Dictionary of PGFIDs*/
+typedef struct gfdb_pgfid_dict {
+        gfdb_intern_table_t             table;
+        /* PGFIDs by id */
+        uuid_t                          *pgfids;
+} gfdb_pgfid_dict_t;
+
+
+/* FNV-1a */
+static uint32_t
+gfdb_intern_hash (const void *key, size_t len)
+{
+        const unsigned char *ptr        = key;
+        uint32_t hash                   = 0x811c9dc5;
+
+        while (len--) {
+                hash ^= *ptr++;
+                hash *= 0x01000193;
+        }
+
+        return hash;
+}
+
+
+static int
+gfdb_intern_table_init (gfdb_intern_table_t *table)
+{
+        memset (table, 0, sizeof (*table));
+        table->slot_count = GFDB_INTERN_MIN_SLOTS;
+        table->slots = calloc (table->slot_count, sizeof (uint32_t));
+        if (!table->slots) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "intern table");
+                return -1;
+        }
+        return 0;
+}
+
+
+/* Makes room for one more id. When the per id arrays are full the hashes
+ * are grown and their new size returned in *new_size, for the caller to
+ * grow its own per id array; *new_size is 0 otherwise.
+ * */
+static int
+gfdb_intern_table_reserve (gfdb_intern_table_t *table, uint32_t *new_size)
+{
+        int ret                 = -1;
+        uint32_t *slots         = NULL;
+        uint32_t *hashes        = NULL;
+        size_t slot_count       = 0;
+        size_t slot             = 0;
+        uint32_t id             = 0;
+
+        *new_size = 0;
+
+        if (table->count == UINT32_MAX - 1) {
+                LOG_IT (log_error, "Too many interned keys");
+                goto out;
+        }
+
+        if (table->count == table->size) {
+                *new_size = table->size ? table->size << 1 : 1024;
+                hashes = realloc (table->hashes,
+                                  *new_size * sizeof (uint32_t));
+                if (!hashes) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "intern table");
+                        goto out;
+                }
+                table->hashes = hashes;
+        }
+
+        if ((table->count + 1) * 2 > table->slot_count) {
+                slot_count = table->slot_count << 1;
+                slots = calloc (slot_count, sizeof (uint32_t));
+                if (!slots) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "intern table");
+                        goto out;
+                }
+                for (id = 0; id < table->count; id++) {
+                        slot = table->hashes[id] & (slot_count - 1);
+                        while (slots[slot])
+                                slot = (slot + 1) & (slot_count - 1);
+                        slots[slot] = id + 1;
+                }
+                free (table->slots);
+                table->slots = slots;
+                table->slot_count = slot_count;
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Gives the next id to the key of hash, at the free slot found probing */
+static uint32_t
+gfdb_intern_table_add (gfdb_intern_table_t *table, uint32_t hash)
+{
+        size_t slot = hash & (table->slot_count - 1);
+
+        while (table->slots[slot])
+                slot = (slot + 1) & (table->slot_count - 1);
+
+        table->slots[slot] = table->count + 1;
+        table->hashes[table->count] = hash;
+
+        return table->count++;
+}
+
+
+/* Forgets all the ids, keeping the memory for reuse */
+static void
+gfdb_intern_table_reset (gfdb_intern_table_t *table)
+{
+        if (table->slots)
+                memset (table->slots, 0,
+                        table->slot_count * sizeof (uint32_t));
+        table->count = 0;
+}
+
+
+static void
+gfdb_intern_table_cleanup (gfdb_intern_table_t *table)
+{
+        free (table->slots);
+        free (table->hashes);
+        memset (table, 0, sizeof (*table));
+}
+
+
+int
+gfdb_name_pool_init (gfdb_name_pool_t *pool)
+{
+        memset (pool, 0, sizeof (*pool));
+        return gfdb_intern_table_init (&pool->table);
+}
+
+
+/* Copies the name into the current chunk, starting a new one when full */
+static char *
+gfdb_name_pool_store (gfdb_name_pool_t *pool, const char *name, size_t len)
+{
+        char **chunks   = NULL;
+        char *ptr       = NULL;
+
+        if (pool->chunk_count == 0 ||
+            pool->chunk_used + len + 1 > GFDB_NAME_POOL_CHUNK_SIZE) {
+                chunks = realloc (pool->chunks, (pool->chunk_count + 1) *
+                                                sizeof (char *));
+                if (!chunks)
+                        goto out;
+                pool->chunks = chunks;
+
+                pool->chunks[pool->chunk_count] =
+                                malloc (GFDB_NAME_POOL_CHUNK_SIZE);
+                if (!pool->chunks[pool->chunk_count])
+                        goto out;
+                pool->chunk_count++;
+                pool->chunk_used = 0;
+        }
+
+        ptr = pool->chunks[pool->chunk_count - 1] + pool->chunk_used;
+        memcpy (ptr, name, len);
+        ptr[len] = '\0';
+        pool->chunk_used += len + 1;
+out:
+        if (!ptr)
+                LOG_IT (log_error, "Memory allocation failed for name pool");
+        return ptr;
+}
+
+
+/* Returns in *id the id of the name of len bytes (len <= GF_NAME_MAX),
+ * adding it to the pool if it is not there yet */
+int
+gfdb_name_pool_intern (gfdb_name_pool_t *pool, const char *name, size_t len,
+                       uint32_t *id)
+{
+        int ret                 = -1;
+        uint32_t hash           = 0;
+        uint32_t new_size       = 0;
+        size_t slot             = 0;
+        uint32_t found          = 0;
+        char **names            = NULL;
+        char *stored            = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, (len <= GF_NAME_MAX), out);
+
+        hash = gfdb_intern_hash (name, len);
+        slot = hash & (pool->table.slot_count - 1);
+        while ((found = pool->table.slots[slot]) != 0) {
+                if (pool->table.hashes[found - 1] == hash &&
+                    strncmp (pool->names[found - 1], name, len) == 0 &&
+                    pool->names[found - 1][len] == '\0') {
+                        *id = found - 1;
+                        return 0;
+                }
+                slot = (slot + 1) & (pool->table.slot_count - 1);
+        }
+
+        if (gfdb_intern_table_reserve (&pool->table, &new_size))
+                goto out;
+        if (new_size) {
+                names = realloc (pool->names, new_size * sizeof (char *));
+                if (!names) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "name pool");
+                        goto out;
+                }
+                pool->names = names;
+                pool->table.size = new_size;
+        }
+
+        stored = gfdb_name_pool_store (pool, name, len);
+        if (!stored)
+                goto out;
+
+        *id = gfdb_intern_table_add (&pool->table, hash);
+        pool->names[*id] = stored;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static inline const char *
+gfdb_name_pool_get (const gfdb_name_pool_t *pool, uint32_t id)
+{
+        return pool->names[id];
+}
+
+
+/* Forgets all the names, keeping the first chunk for reuse */
+void
+gfdb_name_pool_reset (gfdb_name_pool_t *pool)
+{
+        int i = 0;
+
+        for (i = 1; i < pool->chunk_count; i++)
+                free (pool->chunks[i]);
+        pool->chunk_count = pool->chunk_count ? 1 : 0;
+        pool->chunk_used = 0;
+        gfdb_intern_table_reset (&pool->table);
+}
+
+
+void
+gfdb_name_pool_cleanup (gfdb_name_pool_t *pool)
+{
+        int i = 0;
+
+        for (i = 0; i < pool->chunk_count; i++)
+                free (pool->chunks[i]);
+        free (pool->chunks);
+        free (pool->names);
+        gfdb_intern_table_cleanup (&pool->table);
+        memset (pool, 0, sizeof (*pool));
+}
+
+
+int
+gfdb_pgfid_dict_init (gfdb_pgfid_dict_t *dict)
+{
+        memset (dict, 0, sizeof (*dict));
+        return gfdb_intern_table_init (&dict->table);
+}
+
+
+/* Returns 1 and the id of pgfid in *id when it is in the dictionary,
+ * 0 otherwise */
+int
+gfdb_pgfid_dict_lookup (const gfdb_pgfid_dict_t *dict, const uuid_t pgfid,
+                        uint32_t *id)
+{
+        uint32_t hash   = 0;
+        size_t slot     = 0;
+        uint32_t found  = 0;
+
+        hash = gfdb_intern_hash (pgfid, UUID_LEN);
+        slot = hash & (dict->table.slot_count - 1);
+        while ((found = dict->table.slots[slot]) != 0) {
+                if (dict->table.hashes[found - 1] == hash &&
+                    memcmp (dict->pgfids[found - 1], pgfid, UUID_LEN) == 0) {
+                        *id = found - 1;
+                        return 1;
+                }
+                slot = (slot + 1) & (dict->table.slot_count - 1);
+        }
+
+        return 0;
+}
+
+
+/* Returns in *id the id of pgfid, adding it to the dictionary if needed */
+int
+gfdb_pgfid_dict_intern (gfdb_pgfid_dict_t *dict, const uuid_t pgfid,
+                        uint32_t *id)
+{
+        int ret                 = -1;
+        uint32_t new_size       = 0;
+        uuid_t *pgfids          = NULL;
+
+        if (gfdb_pgfid_dict_lookup (dict, pgfid, id))
+                return 0;
+
+        if (gfdb_intern_table_reserve (&dict->table, &new_size))
+                goto out;
+        if (new_size) {
+                pgfids = realloc (dict->pgfids, new_size * sizeof (uuid_t));
+                if (!pgfids) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "pgfid dictionary");
+                        goto out;
+                }
+                dict->pgfids = pgfids;
+                dict->table.size = new_size;
+        }
+
+        *id = gfdb_intern_table_add (&dict->table,
+                                     gfdb_intern_hash (pgfid, UUID_LEN));
+        gf_uuid_copy (dict->pgfids[*id], pgfid);
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static inline const unsigned char *
+gfdb_pgfid_dict_get (const gfdb_pgfid_dict_t *dict, uint32_t id)
+{
+        return dict->pgfids[id];
+}
+
+
+static inline uint32_t
+gfdb_pgfid_dict_count (const gfdb_pgfid_dict_t *dict)
+{
+        return dict->table.count;
+}
+
+
+void
+gfdb_pgfid_dict_reset (gfdb_pgfid_dict_t *dict)
+{
+        gfdb_intern_table_reset (&dict->table);
+}
+
+
+void
+gfdb_pgfid_dict_cleanup (gfdb_pgfid_dict_t *dict)
+{
+        free (dict->pgfids);
+        gfdb_intern_table_cleanup (&dict->table);
+        memset (dict, 0, sizeof (*dict));
+}
+
+
+/******************************************************************************
+                GROUP BY PARENT (PGFID) AGGREGATION
+*******************************************************************************/
+/******************************************************************************
+ In group-by-pgfid mode every link of every query record is folded into a
+ per parent group. Groups are indexed by the interned id of their PGFID and
+ entries keep the interned id of their basename, see INTERNING above. They
+ stay in memory until the number of distinct parents exceeds the group
+ budget. At that point all the groups are written to a temporary file as a
+ run sorted by PGFID and the map is emptied. When the query file is
+ consumed the runs are merged, combining the groups of a parent that was
+ seen in more than one run, and the directories are emitted in descending
+ order of their file count so that the largest batches start first.
+
+ Spilled group format (host endian, same as the query file):
+   +--------------------------------------------------------+
+   | PGFID | Entry count |  <ENTRY>  |  <ENTRY>  |.....      |
+   +--------------------------------------------------------+
+     16 B       4 B
+   Each <ENTRY> will be serialized as
+   +-----------------------------------------------+
+   | GFID | BASE_NAME_LENGTH |      BASE_NAME      |
+   +-----------------------------------------------+
+     16 B       4 B             BASE_NAME_LENGTH
+ * ****************************************************************************/
+
+#define GFDB_GROUP_DEFAULT_BUDGET       (1 << 20)
+#define GFDB_GROUP_MAX_RUNS             64
+
+/*Structure to hold a single file under a parent*/
+typedef struct gfdb_pgfid_entry {
+        uuid_t                          gfid;
+        struct list_head                list;
+        uint32_t                        name_id;
+} gfdb_pgfid_entry_t;
+
+/*Structure to hold all the files under a parent*/
+typedef struct gfdb_pgfid_group {
+        uint32_t                        pgfid_id;
+        int                             entry_count;
+        struct list_head                entry_list;
+} gfdb_pgfid_group_t;
+
+/*Parent groups by PGFID id, with the runs spilled so far*/
+typedef struct gfdb_pgfid_map {
+        gfdb_pgfid_dict_t               pgfids;
+        gfdb_name_pool_t                names;
+        gfdb_pgfid_group_t              **groups;
+        size_t                          groups_size;
+        size_t                          group_count;
+        size_t                          group_budget;
+        FILE                            **runs;
+        int                             run_count;
+} gfdb_pgfid_map_t;
+
+/*Location of a merged group in the final spill file*/
+typedef struct gfdb_pgfid_index {
+        off_t                           offset;
+        int                             entry_count;
+} gfdb_pgfid_index_t;
+
+/*Cursor over a single spilled run while merging*/
+typedef struct gfdb_pgfid_run_cursor {
+        FILE                            *fp;
+        boolean_t                       valid;
+        uuid_t                          pgfid;
+        int                             entry_count;
+} gfdb_pgfid_run_cursor_t;
+
+
+static int
+gfdb_pgfid_map_init (gfdb_pgfid_map_t *map, size_t group_budget)
+{
+        int ret = -1;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, map, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, (group_budget > 0), out);
+
+        memset (map, 0, sizeof (*map));
+        map->group_budget = group_budget;
+
+        if (gfdb_pgfid_dict_init (&map->pgfids) ||
+            gfdb_name_pool_init (&map->names))
+                goto out;
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static void
+gfdb_pgfid_group_free (gfdb_pgfid_group_t *group)
+{
+        gfdb_pgfid_entry_t      *entry  = NULL;
+        gfdb_pgfid_entry_t      *temp   = NULL;
+
+        if (!group)
+                return;
+
+        list_for_each_entry_safe (entry, temp, &group->entry_list, list) {
+                list_del (&entry->list);
+                free (entry);
+        }
+        free (group);
+}
+
+
+/* Takes the array of the groups of the map, the PGFID and name ids stay
+ * valid until gfdb_pgfid_map_reset_ids () */
+static gfdb_pgfid_group_t **
+gfdb_pgfid_map_detach_groups (gfdb_pgfid_map_t *map)
+{
+        gfdb_pgfid_group_t **groups     = NULL;
+
+        groups = map->groups;
+        if (!groups) {
+                groups = calloc (1, sizeof (gfdb_pgfid_group_t *));
+                if (!groups)
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "pgfid group array");
+        }
+
+        map->groups = NULL;
+        map->groups_size = 0;
+        map->group_count = 0;
+
+        return groups;
+}
+
+
+/* Forgets the interned PGFIDs and names once their groups are gone */
+static void
+gfdb_pgfid_map_reset_ids (gfdb_pgfid_map_t *map)
+{
+        gfdb_pgfid_dict_reset (&map->pgfids);
+        gfdb_name_pool_reset (&map->names);
+}
+
+
+static int
+gfdb_pgfid_group_cmp_pgfid (const void *a, const void *b, void *data)
+{
+        const gfdb_pgfid_group_t *ga = *(gfdb_pgfid_group_t * const *)a;
+        const gfdb_pgfid_group_t *gb = *(gfdb_pgfid_group_t * const *)b;
+        const gfdb_pgfid_dict_t *dict = data;
+
+        return memcmp (gfdb_pgfid_dict_get (dict, ga->pgfid_id),
+                       gfdb_pgfid_dict_get (dict, gb->pgfid_id), UUID_LEN);
+}
+
+
+/* Largest group first, ties broken on PGFID to keep the output stable */
+static int
+gfdb_pgfid_group_cmp_size (const void *a, const void *b, void *data)
+{
+        const gfdb_pgfid_group_t *ga = *(gfdb_pgfid_group_t * const *)a;
+        const gfdb_pgfid_group_t *gb = *(gfdb_pgfid_group_t * const *)b;
+
+        if (ga->entry_count != gb->entry_count)
+                return (ga->entry_count < gb->entry_count) ? 1 : -1;
+
+        return gfdb_pgfid_group_cmp_pgfid (a, b, data);
+}
+
+
+static int
+gfdb_pgfid_index_cmp_size (const void *a, const void *b)
+{
+        const gfdb_pgfid_index_t *ia = a;
+        const gfdb_pgfid_index_t *ib = b;
+
+        if (ia->entry_count != ib->entry_count)
+                return (ia->entry_count < ib->entry_count) ? 1 : -1;
+
+        return (ia->offset < ib->offset) ? -1 : (ia->offset > ib->offset);
+}
+
+
+static int
+gfdb_pgfid_write_group_header (FILE *fp, const uuid_t pgfid, int entry_count)
+{
+        if (fwrite (pgfid, UUID_LEN, 1, fp) != 1 ||
+            fwrite (&entry_count, sizeof (int32_t), 1, fp) != 1) {
+                LOG_IT (log_error, "Failed writing group header to "
+                        "spill file : %s", strerror (errno));
+                return -1;
+        }
+        return 0;
+}
+
+
+/* Returns 1 when a header was read, 0 on a clean EOF and -1 on error */
+static int
+gfdb_pgfid_read_group_header (FILE *fp, uuid_t pgfid, int *entry_count)
+{
+        if (fread (pgfid, UUID_LEN, 1, fp) != 1) {
+                if (feof (fp))
+                        return 0;
+                LOG_IT (log_error, "Failed reading group header from "
+                        "spill file : %s", strerror (errno));
+                return -1;
+        }
+        if (fread (entry_count, sizeof (int32_t), 1, fp) != 1 ||
+            *entry_count < 0) {
+                LOG_IT (log_error, "Truncated or corrupted spill file");
+                return -1;
+        }
+        return 1;
+}
+
+
+static int
+gfdb_pgfid_read_entry (FILE *fp, uuid_t gfid, char *base_name,
+                       int *base_name_len)
+{
+        if (fread (gfid, UUID_LEN, 1, fp) != 1 ||
+            fread (base_name_len, sizeof (int32_t), 1, fp) != 1 ||
+            *base_name_len < 0 || *base_name_len > GF_NAME_MAX ||
+            fread (base_name, 1, *base_name_len, fp) !=
+                                        (size_t)*base_name_len) {
+                LOG_IT (log_error, "Truncated or corrupted spill file");
+                return -1;
+        }
+        base_name[*base_name_len] = '\0';
+        return 0;
+}
+
+
+static int
+gfdb_pgfid_write_entry (FILE *fp, const uuid_t gfid, const char *base_name,
+                        int base_name_len)
+{
+        if (fwrite (gfid, UUID_LEN, 1, fp) != 1 ||
+            fwrite (&base_name_len, sizeof (int32_t), 1, fp) != 1 ||
+            fwrite (base_name, 1, base_name_len, fp) !=
+                                        (size_t)base_name_len) {
+                LOG_IT (log_error, "Failed writing group entry to "
+                        "spill file : %s", strerror (errno));
+                return -1;
+        }
+        return 0;
+}
+
+
+static int
+gfdb_pgfid_run_cursor_advance (gfdb_pgfid_run_cursor_t *cursor)
+{
+        int ret = 0;
+
+        ret = gfdb_pgfid_read_group_header (cursor->fp, cursor->pgfid,
+                                            &cursor->entry_count);
+        cursor->valid = (ret == 1) ? _true : _false;
+
+        return (ret < 0) ? -1 : 0;
+}
+
+
+/*
+ * K-way merge of the sorted runs of the map into out, combining the
+ * groups of the same parent. The result is again sorted by PGFID.
+ * When index is given, the offset and size of every merged group is
+ * recorded in it; this is the only per parent state kept in memory.
+ * */
+static int
+gfdb_pgfid_merge_runs (gfdb_pgfid_map_t *map, FILE *out,
+                       gfdb_pgfid_index_t **index, size_t *index_count)
+{
+        int ret                                 = -1;
+        gfdb_pgfid_run_cursor_t *cursors        = NULL;
+        gfdb_pgfid_index_t *new_index           = NULL;
+        size_t index_size                       = 0;
+        uuid_t pgfid                            = {0};
+        uuid_t gfid                             = {0};
+        char base_name[GF_NAME_MAX + 1]         = "";
+        int base_name_len                       = 0;
+        int entry_count                         = 0;
+        int min                                 = 0;
+        int i                                   = 0;
+        int j                                   = 0;
+
+        cursors = calloc (map->run_count, sizeof (*cursors));
+        if (!cursors) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "run cursors");
+                goto out;
+        }
+
+        for (i = 0; i < map->run_count; i++) {
+                cursors[i].fp = map->runs[i];
+                rewind (cursors[i].fp);
+                if (gfdb_pgfid_run_cursor_advance (&cursors[i]))
+                        goto out;
+        }
+
+        for (;;) {
+                /* Pick the smallest PGFID among the runs */
+                min = -1;
+                for (i = 0; i < map->run_count; i++) {
+                        if (!cursors[i].valid)
+                                continue;
+                        if (min < 0 || memcmp (cursors[i].pgfid,
+                                        cursors[min].pgfid, UUID_LEN) < 0)
+                                min = i;
+                }
+                if (min < 0)
+                        break;
+
+                gf_uuid_copy (pgfid, cursors[min].pgfid);
+                entry_count = 0;
+                for (i = 0; i < map->run_count; i++) {
+                        if (cursors[i].valid &&
+                            !memcmp (cursors[i].pgfid, pgfid, UUID_LEN))
+                                entry_count += cursors[i].entry_count;
+                }
+
+                if (index && *index_count == index_size) {
+                        index_size = index_size ? index_size << 1 : 1024;
+                        new_index = realloc (*index,
+                                             index_size * sizeof (**index));
+                        if (!new_index) {
+                                LOG_IT (log_error, "Memory allocation "
+                                        "failed for pgfid index");
+                                goto out;
+                        }
+                        *index = new_index;
+                }
+                if (index) {
+                        (*index)[*index_count].offset = ftello (out);
+                        (*index)[*index_count].entry_count = entry_count;
+                        (*index_count)++;
+                }
+
+                if (gfdb_pgfid_write_group_header (out, pgfid, entry_count))
+                        goto out;
+
+                for (i = 0; i < map->run_count; i++) {
+                        if (!cursors[i].valid ||
+                            memcmp (cursors[i].pgfid, pgfid, UUID_LEN))
+                                continue;
+
+                        for (j = 0; j < cursors[i].entry_count; j++) {
+                                if (gfdb_pgfid_read_entry (cursors[i].fp,
+                                                gfid, base_name,
+                                                &base_name_len))
+                                        goto out;
+                                if (gfdb_pgfid_write_entry (out, gfid,
+                                                base_name, base_name_len))
+                                        goto out;
+                        }
+
+                        if (gfdb_pgfid_run_cursor_advance (&cursors[i]))
+                                goto out;
+                }
+        }
+
+        if (fflush (out)) {
+                LOG_IT (log_error, "Failed to flush spill file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        ret = 0;
+out:
+        free (cursors);
+        return ret;
+}
+
+
+/* Folds all the runs into one to bound the number of open spill files */
+static int
+gfdb_pgfid_map_compact_runs (gfdb_pgfid_map_t *map)
+{
+        int ret         = -1;
+        FILE *merged    = NULL;
+        int i           = 0;
+
+        merged = tmpfile ();
+        if (!merged) {
+                LOG_IT (log_error, "Failed to create spill file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        if (gfdb_pgfid_merge_runs (map, merged, NULL, NULL))
+                goto out;
+
+        for (i = 0; i < map->run_count; i++)
+                fclose (map->runs[i]);
+        map->runs[0] = merged;
+        map->run_count = 1;
+        merged = NULL;
+
+        ret = 0;
+out:
+        if (merged)
+                fclose (merged);
+        return ret;
+}
+
+
+/* Writes the whole map as a run sorted by PGFID and empties the map */
+static int
+gfdb_pgfid_map_spill (gfdb_pgfid_map_t *map)
+{
+        int ret                         = -1;
+        gfdb_pgfid_group_t **groups     = NULL;
+        gfdb_pgfid_entry_t *entry       = NULL;
+        const char *base_name           = NULL;
+        FILE **runs                     = NULL;
+        FILE *fp                        = NULL;
+        size_t count                    = 0;
+        size_t i                        = 0;
+
+        count = map->group_count;
+        groups = gfdb_pgfid_map_detach_groups (map);
+        if (!groups)
+                goto out;
+
+        qsort_r (groups, count, sizeof (*groups), gfdb_pgfid_group_cmp_pgfid,
+                 &map->pgfids);
+
+        runs = realloc (map->runs, (map->run_count + 1) * sizeof (FILE *));
+        if (!runs) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "spill run list");
+                goto out;
+        }
+        map->runs = runs;
+
+        fp = tmpfile ();
+        if (!fp) {
+                LOG_IT (log_error, "Failed to create spill file : %s",
+                        strerror (errno));
+                goto out;
+        }
+        map->runs[map->run_count++] = fp;
+
+        for (i = 0; i < count; i++) {
+                if (gfdb_pgfid_write_group_header (fp,
+                                gfdb_pgfid_dict_get (&map->pgfids,
+                                                     groups[i]->pgfid_id),
+                                groups[i]->entry_count))
+                        goto out;
+
+                list_for_each_entry (entry, &groups[i]->entry_list, list) {
+                        base_name = gfdb_name_pool_get (&map->names,
+                                                        entry->name_id);
+                        if (gfdb_pgfid_write_entry (fp, entry->gfid,
+                                                    base_name,
+                                                    strlen (base_name)))
+                                goto out;
+                }
+        }
+
+        if (fflush (fp)) {
+                LOG_IT (log_error, "Failed to flush spill file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        if (map->run_count >= GFDB_GROUP_MAX_RUNS &&
+            gfdb_pgfid_map_compact_runs (map))
+                goto out;
+
+        ret = 0;
+out:
+        if (groups) {
+                for (i = 0; i < count; i++)
+                        gfdb_pgfid_group_free (groups[i]);
+                free (groups);
+        }
+        gfdb_pgfid_map_reset_ids (map);
+        return ret;
+}
+
+
+static gfdb_pgfid_group_t *
+gfdb_pgfid_map_get_group (gfdb_pgfid_map_t *map, const uuid_t pgfid)
+{
+        gfdb_pgfid_group_t *group       = NULL;
+        gfdb_pgfid_group_t **groups     = NULL;
+        uint32_t id                     = 0;
+        size_t size                     = 0;
+
+        if (gfdb_pgfid_dict_lookup (&map->pgfids, pgfid, &id))
+                return map->groups[id];
+
+        /* A new parent, make room for it first if we are over budget */
+        if (map->group_count >= map->group_budget) {
+                if (gfdb_pgfid_map_spill (map))
+                        goto out;
+        }
+
+        if (gfdb_pgfid_dict_intern (&map->pgfids, pgfid, &id))
+                goto out;
+
+        if (id >= map->groups_size) {
+                size = map->groups_size ? map->groups_size << 1 : 1024;
+                groups = realloc (map->groups, size * sizeof (*groups));
+                if (!groups) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "pgfid group array");
+                        goto out;
+                }
+                map->groups = groups;
+                map->groups_size = size;
+        }
+
+        group = calloc (1, sizeof (gfdb_pgfid_group_t));
+        if (!group) {
+                LOG_IT (log_error, "Memory allocation failed for "
+                        "pgfid group");
+                goto out;
+        }
+        group->pgfid_id = id;
+        INIT_LIST_HEAD (&group->entry_list);
+
+        map->groups[id] = group;
+        map->group_count++;
+out:
+        return group;
+}
+
+
+/* Adds every link of the query record to the group of its parent */
+static int
+gfdb_pgfid_map_add_record (gfdb_pgfid_map_t *map,
+                           gfdb_query_record_t *query_record)
+{
+        int ret                         = -1;
+        gfdb_link_info_t *link_info     = NULL;
+        gfdb_pgfid_group_t *group       = NULL;
+        gfdb_pgfid_entry_t *entry       = NULL;
+
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, map, out);
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, query_record, out);
+
+        list_for_each_entry (link_info, &query_record->link_list, list) {
+                group = gfdb_pgfid_map_get_group (map, link_info->pargfid);
+                if (!group)
+                        goto out;
+
+                entry = malloc (sizeof (gfdb_pgfid_entry_t));
+                if (!entry) {
+                        LOG_IT (log_error, "Memory allocation failed for "
+                                "pgfid entry");
+                        goto out;
+                }
+                if (gfdb_name_pool_intern (&map->names, link_info->file_name,
+                                           strlen (link_info->file_name),
+                                           &entry->name_id)) {
+                        free (entry);
+                        goto out;
+                }
+                gf_uuid_copy (entry->gfid, query_record->gfid);
+
+                list_add_tail (&entry->list, &group->entry_list);
+                group->entry_count++;
+        }
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+static void
+gfdb_pgfid_print_group_header (const uuid_t pgfid, int entry_count)
+{
+        char uuid_str[100] = "";
+
+        gf_uuid_unparse (pgfid, uuid_str);
+        printf ("PGFID : %s, FILE_COUNT: %d\n", uuid_str, entry_count);
+}
+
+
+static void
+gfdb_pgfid_print_entry (const uuid_t gfid, const char *base_name)
+{
+        char uuid_str[100] = "";
+
+        gf_uuid_unparse (gfid, uuid_str);
+        printf ("%sGFID : %s, BASE_NAME: %s \n", STR_TAB, uuid_str,
+                base_name);
+}
+
+
+/* All groups fitted in the budget, sort and print them from memory */
+static int
+gfdb_pgfid_map_emit_in_memory (gfdb_pgfid_map_t *map)
+{
+        int ret                         = -1;
+        gfdb_pgfid_group_t **groups     = NULL;
+        gfdb_pgfid_entry_t *entry       = NULL;
+        size_t count                    = 0;
+        size_t i                        = 0;
+
+        count = map->group_count;
+        groups = gfdb_pgfid_map_detach_groups (map);
+        if (!groups)
+                goto out;
+
+        qsort_r (groups, count, sizeof (*groups), gfdb_pgfid_group_cmp_size,
+                 &map->pgfids);
+
+        for (i = 0; i < count; i++) {
+                gfdb_pgfid_print_group_header (
+                                gfdb_pgfid_dict_get (&map->pgfids,
+                                                     groups[i]->pgfid_id),
+                                groups[i]->entry_count);
+                list_for_each_entry (entry, &groups[i]->entry_list, list)
+                        gfdb_pgfid_print_entry (entry->gfid,
+                                gfdb_name_pool_get (&map->names,
+                                                    entry->name_id));
+        }
+
+        ret = 0;
+out:
+        if (groups) {
+                for (i = 0; i < count; i++)
+                        gfdb_pgfid_group_free (groups[i]);
+                free (groups);
+        }
+        return ret;
+}
+
+
+/* Merges the runs and prints the merged groups largest first */
+static int
+gfdb_pgfid_map_emit_spilled (gfdb_pgfid_map_t *map)
+{
+        int ret                                 = -1;
+        gfdb_pgfid_index_t *index               = NULL;
+        size_t index_count                      = 0;
+        FILE *merged                            = NULL;
+        uuid_t pgfid                            = {0};
+        uuid_t gfid                             = {0};
+        char base_name[GF_NAME_MAX + 1]         = "";
+        int base_name_len                       = 0;
+        int entry_count                         = 0;
+        int j                                   = 0;
+        size_t k                                = 0;
+
+        /* The groups still in memory become the last run */
+        if (map->group_count > 0 && gfdb_pgfid_map_spill (map))
+                goto out;
+
+        merged = tmpfile ();
+        if (!merged) {
+                LOG_IT (log_error, "Failed to create spill file : %s",
+                        strerror (errno));
+                goto out;
+        }
+
+        if (gfdb_pgfid_merge_runs (map, merged, &index, &index_count))
+                goto out;
+
+        qsort (index, index_count, sizeof (*index),
+               gfdb_pgfid_index_cmp_size);
+
+        for (k = 0; k < index_count; k++) {
+                if (fseeko (merged, index[k].offset, SEEK_SET)) {
+                        LOG_IT (log_error, "Failed to seek in spill "
+                                "file : %s", strerror (errno));
+                        goto out;
+                }
+                if (gfdb_pgfid_read_group_header (merged, pgfid,
+                                                  &entry_count) != 1)
+                        goto out;
+
+                gfdb_pgfid_print_group_header (pgfid, entry_count);
+                for (j = 0; j < entry_count; j++) {
+                        if (gfdb_pgfid_read_entry (merged, gfid, base_name,
+                                                   &base_name_len))
+                                goto out;
+                        gfdb_pgfid_print_entry (gfid, base_name);
+                }
+        }
+
+        ret = 0;
+out:
+        if (merged)
+                fclose (merged);
+        free (index);
+        return ret;
+}
+
+
+static int
+gfdb_pgfid_map_emit (gfdb_pgfid_map_t *map)
+{
+        GF_VALIDATE_OR_GOTO (GFDB_DATA_STORE, map, out);
+
+        if (map->run_count == 0)
+                return gfdb_pgfid_map_emit_in_memory (map);
+
+        return gfdb_pgfid_map_emit_spilled (map);
+out:
+        return -1;
+}
+
+
+static void
+gfdb_pgfid_map_cleanup (gfdb_pgfid_map_t *map)
+{
+        size_t i                        = 0;
+        int j                           = 0;
+
+        if (!map)
+                return;
+
+        for (i = 0; i < map->group_count; i++)
+                gfdb_pgfid_group_free (map->groups[i]);
+        free (map->groups);
+
+        gfdb_pgfid_dict_cleanup (&map->pgfids);
+        gfdb_name_pool_cleanup (&map->names);
+
+        for (j = 0; j < map->run_count; j++)
+                fclose (map->runs[j]);
+        free (map->runs);
+
+        memset (map, 0, sizeof (*map));
+}
+
+
+static int
+gfdb_pgfid_map_add_record_cbk (gfdb_query_record_t *query_record, void *data)
+{
+        int ret = 0;
+
+        ret = gfdb_pgfid_map_add_record (data, query_record);
+        if (ret)
+                LOG_IT (log_error, "Failed to group query record");
+
+        return ret;
+}
+
+
+/* Reads the whole query file and prints the links grouped by parent */
+int
+gfdb_group_query_file_by_pgfid (int query_fd, const gfdb_reader_conf_t *conf)
+{
+        int ret                                 = -1;
+        gfdb_pgfid_map_t map                    = {0};
+
+        if (gfdb_pgfid_map_init (&map, conf->group_budget))
+                goto out;
+
+        ret = gfdb_process_query_file (query_fd, conf,
+                                       gfdb_pgfid_map_add_record_cbk, &map);
+        if (ret)
+                goto out;
+
+        ret = gfdb_pgfid_map_emit (&map);
+out:
+        gfdb_pgfid_map_cleanup (&map);
+        return ret;
+}
+
+
+/******************************************************************************
+ * 
+ *                      Main ()
+ * 
+ * ****************************************************************************/
+
+/* Options with no short form */
+enum {
+        GFDB_OPT_CHANGED_WITHIN = 256,
+        GFDB_OPT_UNCHANGED_FOR,
+        GFDB_OPT_WRITE_FREQ,
+        GFDB_OPT_READ_FREQ,
+        GFDB_OPT_BLOOM_BUILD,
+        GFDB_OPT_BLOOM_FPR,
+        GFDB_OPT_BLOOM_CHECK,
+        GFDB_OPT_SAMPLE,
+        GFDB_OPT_SAMPLE_SEED,
+        GFDB_OPT_WRITE_VERSION,
+        GFDB_OPT_ARROW,
+        GFDB_OPT_CHECK_BRICK,
+        GFDB_OPT_CHECK_THREADS,
+        GFDB_OPT_CHECKPOINT,
+        GFDB_OPT_CHECKPOINT_INTERVAL,
+        GFDB_OPT_RESUME,
+        GFDB_OPT_LOG_FORMAT,
+        GFDB_OPT_FORMAT,
+        GFDB_OPT_INDEX_BUILD,
+        GFDB_OPT_INDEX_LOOKUP,
+        GFDB_OPT_BY_PGFID,
+        GFDB_OPT_MAX_READ_RATE,
+        GFDB_OPT_MAX_RECORD_RATE,
+        GFDB_OPT_ADAPTIVE,
+        GFDB_OPT_IOPRIO,
+        GFDB_OPT_SCHED_IDLE
+};
+
+static struct option gfdb_reader_long_options[] = {
+        {"group-by-pgfid",      no_argument,            NULL, 'g'},
+        {"group-budget",        required_argument,      NULL, 'b'},
+        {"follow",              no_argument,            NULL, 'f'},
+        {"done-marker",         required_argument,      NULL, 'm'},
+        {"serve",               required_argument,      NULL, 's'},
+        {"ring-size",           required_argument,      NULL, 'r'},
+        {"attach",              required_argument,      NULL, 'a'},
+        {"write-query-file",    required_argument,      NULL, 'w'},
+        {"gfdb",                required_argument,      NULL, 'd'},
+        {"changed-within",      required_argument,      NULL,
+                                                GFDB_OPT_CHANGED_WITHIN},
+        {"unchanged-for",       required_argument,      NULL,
+                                                GFDB_OPT_UNCHANGED_FOR},
+        {"write-freq",          required_argument,      NULL,
+                                                GFDB_OPT_WRITE_FREQ},
+        {"read-freq",           required_argument,      NULL,
+                                                GFDB_OPT_READ_FREQ},
+        {"bloom-build",         required_argument,      NULL,
+                                                GFDB_OPT_BLOOM_BUILD},
+        {"bloom-fpr",           required_argument,      NULL,
+                                                GFDB_OPT_BLOOM_FPR},
+        {"bloom-check",         required_argument,      NULL,
+                                                GFDB_OPT_BLOOM_CHECK},
+        {"sample",              required_argument,      NULL,
+                                                GFDB_OPT_SAMPLE},
+        {"sample-seed",         required_argument,      NULL,
+                                                GFDB_OPT_SAMPLE_SEED},
+        {"write-version",       required_argument,      NULL,
+                                                GFDB_OPT_WRITE_VERSION},
+        {"arrow",               required_argument,      NULL, GFDB_OPT_ARROW},
+        {"check-brick",         required_argument,      NULL,
+                                                GFDB_OPT_CHECK_BRICK},
+        {"check-threads",       required_argument,      NULL,
+                                                GFDB_OPT_CHECK_THREADS},
+        {"checkpoint",          required_argument,      NULL,
+                                                GFDB_OPT_CHECKPOINT},
+        {"checkpoint-interval", required_argument,      NULL,
+                                                GFDB_OPT_CHECKPOINT_INTERVAL},
+        {"resume",              no_argument,            NULL, GFDB_OPT_RESUME},
+        {"log-format",          required_argument,      NULL,
+                                                GFDB_OPT_LOG_FORMAT},
+        {"format",              required_argument,      NULL, GFDB_OPT_FORMAT},
+        {"index-build",         required_argument,      NULL,
+                                                GFDB_OPT_INDEX_BUILD},
+        {"index-lookup",        required_argument,      NULL,
+                                                GFDB_OPT_INDEX_LOOKUP},
+        {"by-pgfid",            no_argument,            NULL,
+                                                GFDB_OPT_BY_PGFID},
+        {"max-read-rate",       required_argument,      NULL,
+                                                GFDB_OPT_MAX_READ_RATE},
+        {"max-record-rate",     required_argument,      NULL,
+                                                GFDB_OPT_MAX_RECORD_RATE},
+        {"adaptive",            required_argument,      NULL,
+                                                GFDB_OPT_ADAPTIVE},
+        {"ioprio",              required_argument,      NULL, GFDB_OPT_IOPRIO},
+        {"sched-idle",          no_argument,            NULL,
+                                                GFDB_OPT_SCHED_IDLE},
+        {"help",                no_argument,            NULL, 'h'},
+        {NULL,                  0,                      NULL,  0 }
+};
+
+void
+usage(){
+        LOG_IT (log_error, "Usage : gfdb_query_file_reader [options] "
+                "<query_file_path>\n"
+                STR_TAB "       gfdb_query_file_reader [options] "
+                "--attach <socket_path>\n"
+                STR_TAB "       gfdb_query_file_reader [options] "
+                "--gfdb <db_path>\n"
+                STR_TAB "       gfdb_query_file_reader --bloom-build "
+                "<bloom_path> [--bloom-fpr <rate>] <query_file_path>...\n"
+                STR_TAB "       gfdb_query_file_reader --bloom-check "
+                "<bloom_path> [<gfid>...]\n"
+                STR_TAB "       gfdb_query_file_reader --index-build "
+                "<index_path> <query_file_path>\n"
+                STR_TAB "       gfdb_query_file_reader --index-lookup "
+                "<index_path> [--by-pgfid] <query_file_path> [<key>...]\n"
+                STR_TAB "-g, --group-by-pgfid     group links by parent "
+                "directory, largest first\n"
+                STR_TAB "-b, --group-budget <N>   max distinct parents "
+                "held in memory before spilling to disk (default %d)\n"
+                STR_TAB "-f, --follow             decode records while the "
+                "query file is still being written\n"
+                STR_TAB "-m, --done-marker <path> with --follow, stop once "
+                "this file appears\n"
+                STR_TAB "-s, --serve <socket>     decode once and hand the "
+                "records to workers attached on <socket>\n"
+                STR_TAB "-r, --ring-size <bytes>  size of the shared memory "
+                "ring (default %d)\n"
+                STR_TAB "-a, --attach <socket>    take records from a "
+                "serving reader instead of a query file\n"
+                STR_TAB "-w, --write-query-file <path> write the records "
+                "to a query file\n"
+                STR_TAB "-d, --gfdb <db_path>     read the records from the "
+                "brick's gfdb instead of a query file\n"
+                STR_TAB "    --changed-within <secs> with --gfdb, files "
+                "written or read in the last <secs>\n"
+                STR_TAB "    --unchanged-for <secs> with --gfdb, files not "
+                "written or read in the last <secs>\n"
+                STR_TAB "    --write-freq <N>     with --changed-within "
+                "(--unchanged-for), atleast (below) N writes\n"
+                STR_TAB "    --read-freq <N>      with --changed-within "
+                "(--unchanged-for), atleast (below) N reads\n"
+                STR_TAB "    --bloom-build <path> write a bloom filter of the "
+                "GFIDs of the query files\n"
+                STR_TAB "    --bloom-fpr <rate>   false positive rate of the "
+                "bloom filter (default %g)\n"
+                STR_TAB "    --bloom-check <path> check GFIDs (arguments or "
+                "stdin) against a bloom filter\n"
+                STR_TAB "    --sample <K>         only a uniform random sample "
+                "of K records\n"
+                STR_TAB "    --sample-seed <N>    seed of the sample, for a "
+                "repeatable one\n"
+                STR_TAB "    --write-version <1|2> format written by -w, "
+                "legacy or checksummed blocks (default 1)\n"
+                STR_TAB "    --arrow <path>       export the records as an "
+                "Arrow IPC stream, - for stdout\n"
+                STR_TAB "    --check-brick <path> with -w, only write the "
+                "records still live on the brick\n"
+                STR_TAB "    --check-threads <N>  threads checking the brick "
+                "when io_uring is not available (default %d)\n"
+                STR_TAB "    --checkpoint <path>  with dump or -w, save the "
+                "progress to <path> as records are emitted\n"
+                STR_TAB "    --checkpoint-interval <secs> time between "
+                "checkpoints (default %d)\n"
+                STR_TAB "    --resume             continue from the "
+                "checkpoint, if there is one\n"
+                STR_TAB "    --log-format <fmt>   text (default), or kv for "
+                "key=value diagnostics\n"
+                STR_TAB "    --format <fmt>       dump as text (default), "
+                "json, nul or binary\n"
+                STR_TAB "    --index-build <path> write an index of the "
+                "GFIDs and PGFIDs of the query file\n"
+                STR_TAB "    --index-lookup <path> print the records "
+                "matching GFIDs or GFID prefixes (arguments or stdin)\n"
+                STR_TAB "    --by-pgfid           with --index-lookup, "
+                "match the keys against the parents\n"
+                STR_TAB "    --max-read-rate <bytes> read at most <bytes> "
+                "of query file per second\n"
+                STR_TAB "    --max-record-rate <N> read at most N records "
+                "per second\n"
+                STR_TAB "    --adaptive <depth>   back off while the "
+                "device queue of the query file is deeper\n"
+                STR_TAB "    --ioprio <idle|be:N> I/O scheduling class (and "
+                "best effort level 0-7)\n"
+                STR_TAB "    --sched-idle         run with the SCHED_IDLE "
+                "CPU policy\n"
+                STR_TAB "-h, --help               print this help",
+                GFDB_GROUP_DEFAULT_BUDGET, GFDB_RING_DEFAULT_SIZE,
+                GFDB_BLOOM_DEFAULT_FPR, GFDB_CHECK_DEFAULT_THREADS,
+                GFDB_CHECKPOINT_DEFAULT_INTERVAL);
+}
+
+
+/* Parses a non negative decimal number */
+static int
+gfdb_parse_uint64 (const char *str, uint64_t *value)
+{
+        char *end                       = NULL;
+        unsigned long long parsed       = 0;
+
+        errno = 0;
+        parsed = strtoull (str, &end, 10);
+        if (errno || end == str || *end != '\0' || str[0] == '-' ||
+            parsed > INT64_MAX) {
+                LOG_IT (log_error, "Invalid number : %s", str);
+                return -1;
+        }
+
+        *value = parsed;
+        return 0;
+}
+
+
+/* Sets the mode, dump unless a mode option is given, and only one can be */
+static int
+gfdb_set_mode (gfdb_reader_conf_t *conf, gfdb_reader_mode_t mode)
+{
+        if (conf->mode != GFDB_READER_MODE_DUMP) {
+                LOG_IT (log_error, "Only one of -g, -s, -w, --arrow, "
+                        "--bloom-build, --bloom-check, --index-build and "
+                        "--index-lookup can be given");
+                return -1;
+        }
+
+        conf->mode = mode;
+        return 0;
+}
+
+
+/* Parses an I/O scheduling class, idle or be[:<level>] */
+static int
+gfdb_parse_ioprio (const char *str, int *ioprio_class, int *ioprio_level)
+{
+        uint64_t level = GFDB_IOPRIO_BE_LEVELS / 2;
+
+        if (!strcmp (str, "idle")) {
+                *ioprio_class = GFDB_IOPRIO_CLASS_IDLE;
+                *ioprio_level = 0;
+                return 0;
+        }
+
+        if (strcmp (str, "be") &&
+            (strncmp (str, "be:", 3) || gfdb_parse_uint64 (str + 3, &level)
+             || level >= GFDB_IOPRIO_BE_LEVELS)) {
+                LOG_IT (log_error, "Invalid I/O priority : %s", str);
+                return -1;
+        }
+
+        *ioprio_class = GFDB_IOPRIO_CLASS_BE;
+        *ioprio_level = level;
+        return 0;
+}
+
+
+/* Parses a positive decimal number */
+static int
+gfdb_parse_size (const char *str, size_t *value)
+{
+        uint64_t parsed = 0;
+
+        if (gfdb_parse_uint64 (str, &parsed))
+                return -1;
+
+        if (parsed == 0) {
+                LOG_IT (log_error, "Invalid number : %s", str);
+                return -1;
+        }
+
+        *value = (size_t)parsed;
+        return 0;
+}
+
+
+/* Parses a rate, strictly between 0 and 1 */
+static int
+gfdb_parse_rate (const char *str, double *value)
+{
+        char *end       = NULL;
+        double parsed   = 0;
+
+        errno = 0;
+        parsed = strtod (str, &end);
+        if (errno || end == str || *end != '\0' || !(parsed > 0) ||
+            !(parsed < 1)) {
+                LOG_IT (log_error, "Invalid rate : %s", str);
+                return -1;
+        }
+
+        *value = parsed;
+        return 0;
+}
+
+
+/* Time threshold for the gfdb queries, secs before now */
+static int
+gfdb_parse_query_time (const char *str, int64_t *time_usec)
+{
+        uint64_t secs           = 0;
+        struct timeval now      = {0};
+
+        if (gfdb_parse_uint64 (str, &secs))
+                return -1;
+
+        gettimeofday (&now, NULL);
+        *time_usec = ((int64_t)now.tv_sec - (int64_t)secs) * 1000000 +
+                     now.tv_usec;
+        return 0;
+}
+
+
+static int
+gfdb_parse_options (int argc, char *argv[], gfdb_reader_conf_t *conf)
+{
+        int ret                 = -1;
+        int opt                 = 0;
+        boolean_t seed_set      = _false;
+        uint64_t threads        = 0;
+        uint64_t interval       = 0;
+
+        conf->mode = GFDB_READER_MODE_DUMP;
+        conf->group_budget = GFDB_GROUP_DEFAULT_BUDGET;
+        conf->write_version = 1;
+        conf->check_threads = GFDB_CHECK_DEFAULT_THREADS;
+        conf->checkpoint_interval = GFDB_CHECKPOINT_DEFAULT_INTERVAL;
+        conf->ring_size = GFDB_RING_DEFAULT_SIZE;
+        conf->bloom_fpr = GFDB_BLOOM_DEFAULT_FPR;
+
+        while ((opt = getopt_long (argc, argv, "gb:fm:s:r:a:w:d:h",
+                                   gfdb_reader_long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'g':
+                        if (gfdb_set_mode (conf,
+                                           GFDB_READER_MODE_GROUP_BY_PGFID))
+                                goto out;
+                        break;
+                case 'b':
+                        if (gfdb_parse_size (optarg, &conf->group_budget))
+                                goto out;
+                        break;
+                case 'f':
+                        conf->follow = _true;
+                        break;
+                case 'm':
+                        conf->done_marker_path = optarg;
+                        break;
+                case 's':
+                        if (gfdb_set_mode (conf, GFDB_READER_MODE_SERVE))
+                                goto out;
+                        conf->serve_socket_path = optarg;
+                        break;
+                case 'r':
+                        if (gfdb_parse_size (optarg, &conf->ring_size))
+                                goto out;
+                        break;
+                case 'a':
+                        conf->attach_socket_path = optarg;
+                        break;
+                case 'w':
+                        if (gfdb_set_mode (conf, GFDB_READER_MODE_WRITE))
+                                goto out;
+                        conf->write_query_file_path = optarg;
+                        break;
+                case 'd':
+#ifdef USE_GFDB
+                        conf->gfdb_path = optarg;
+                        break;
+#else
+                        LOG_IT (log_error, "Built without gfdb support, "
+                                "rebuild with -DUSE_GFDB -lsqlite3");
+                        goto out;
+#endif
+                case GFDB_OPT_CHANGED_WITHIN:
+                case GFDB_OPT_UNCHANGED_FOR:
+                        if (conf->query_type != GFDB_QUERY_ALL) {
+                                LOG_IT (log_error, "--changed-within and "
+                                        "--unchanged-for can be given only "
+                                        "once, and not together");
+                                goto out;
+                        }
+                        conf->query_type = (opt == GFDB_OPT_CHANGED_WITHIN) ?
+                                           GFDB_QUERY_CHANGED :
+                                           GFDB_QUERY_UNCHANGED;
+                        if (gfdb_parse_query_time (optarg,
+                                                   &conf->query_time_usec))
+                                goto out;
+                        break;
+                case GFDB_OPT_WRITE_FREQ:
+                        if (gfdb_parse_uint64 (optarg,
+                                        (uint64_t *)&conf->write_freq))
+                                goto out;
+                        break;
+                case GFDB_OPT_READ_FREQ:
+                        if (gfdb_parse_uint64 (optarg,
+                                        (uint64_t *)&conf->read_freq))
+                                goto out;
+                        break;
+                case GFDB_OPT_BLOOM_BUILD:
+                case GFDB_OPT_BLOOM_CHECK:
+                        if (gfdb_set_mode (conf,
+                                           (opt == GFDB_OPT_BLOOM_BUILD) ?
+                                           GFDB_READER_MODE_BLOOM_BUILD :
+                                           GFDB_READER_MODE_BLOOM_CHECK))
+                                goto out;
+                        conf->bloom_path = optarg;
+                        break;
+                case GFDB_OPT_BLOOM_FPR:
+                        if (gfdb_parse_rate (optarg, &conf->bloom_fpr))
+                                goto out;
+                        break;
+                case GFDB_OPT_SAMPLE:
+                        if (gfdb_parse_size (optarg, &conf->sample_count))
+                                goto out;
+                        break;
+                case GFDB_OPT_SAMPLE_SEED:
+                        if (gfdb_parse_uint64 (optarg, &conf->sample_seed))
+                                goto out;
+                        seed_set = _true;
+                        break;
+                case GFDB_OPT_WRITE_VERSION:
+                        if (strcmp (optarg, "1") &&
+                            strcmp (optarg, "2")) {
+                                LOG_IT (log_error, "Invalid query file "
+                                        "version : %s", optarg);
+                                goto out;
+                        }
+                        conf->write_version = atoi (optarg);
+                        break;
+                case GFDB_OPT_ARROW:
+                        if (gfdb_set_mode (conf, GFDB_READER_MODE_ARROW))
+                                goto out;
+                        conf->arrow_path = optarg;
+                        break;
+                case GFDB_OPT_CHECK_BRICK:
+                        conf->brick_path = optarg;
+                        break;
+                case GFDB_OPT_CHECK_THREADS:
+                        if (gfdb_parse_uint64 (optarg, &threads) ||
+                            threads < 1 || threads > 1024) {
+                                LOG_IT (log_error, "Invalid thread count : "
+                                        "%s", optarg);
+                                goto out;
+                        }
+                        conf->check_threads = threads;
+                        break;
+                case GFDB_OPT_CHECKPOINT:
+                        conf->checkpoint_path = optarg;
+                        break;
+                case GFDB_OPT_CHECKPOINT_INTERVAL:
+                        if (gfdb_parse_uint64 (optarg, &interval) ||
+                            interval > INT_MAX) {
+                                LOG_IT (log_error, "Invalid checkpoint "
+                                        "interval : %s", optarg);
+                                goto out;
+                        }
+                        conf->checkpoint_interval = interval;
+                        break;
+                case GFDB_OPT_RESUME:
+                        conf->resume = _true;
+                        break;
+                case GFDB_OPT_LOG_FORMAT:
+                        if (!strcmp (optarg, "text")) {
+                                gfdb_log_format = GFDB_LOG_FORMAT_TEXT;
+                        } else if (!strcmp (optarg, "kv")) {
+                                gfdb_log_format = GFDB_LOG_FORMAT_KV;
+                        } else {
+                                LOG_IT (log_error, "Invalid log format : %s",
+                                        optarg);
+                                goto out;
+                        }
+                        break;
+                case GFDB_OPT_FORMAT:
+                        if (!strcmp (optarg, "text")) {
+                                conf->output_format = GFDB_OUTPUT_FORMAT_TEXT;
+                        } else if (!strcmp (optarg, "json")) {
+                                conf->output_format = GFDB_OUTPUT_FORMAT_JSON;
+                        } else if (!strcmp (optarg, "nul")) {
+                                conf->output_format = GFDB_OUTPUT_FORMAT_NUL;
+                        } else if (!strcmp (optarg, "binary")) {
+                                conf->output_format =
+                                                GFDB_OUTPUT_FORMAT_BINARY;
+                        } else {
+                                LOG_IT (log_error, "Invalid output format : "
+                                        "%s", optarg);
+                                goto out;
+                        }
+                        break;
+                case GFDB_OPT_INDEX_BUILD:
+                case GFDB_OPT_INDEX_LOOKUP:
+                        if (gfdb_set_mode (conf,
+                                           (opt == GFDB_OPT_INDEX_BUILD) ?
+                                           GFDB_READER_MODE_INDEX_BUILD :
+                                           GFDB_READER_MODE_INDEX_LOOKUP))
+                                goto out;
+                        conf->index_path = optarg;
+                        break;
+                case GFDB_OPT_BY_PGFID:
+                        conf->by_pgfid = _true;
+                        break;
+                case GFDB_OPT_MAX_READ_RATE:
+                        if (gfdb_parse_size (optarg, &conf->max_read_rate))
+                                goto out;
+                        break;
+                case GFDB_OPT_MAX_RECORD_RATE:
+                        if (gfdb_parse_size (optarg, &conf->max_record_rate))
+                                goto out;
+                        break;
+                case GFDB_OPT_ADAPTIVE:
+                        if (gfdb_parse_size (optarg, &conf->adaptive_depth))
+                                goto out;
+                        break;
+                case GFDB_OPT_IOPRIO:
+                        if (gfdb_parse_ioprio (optarg, &conf->ioprio_class,
+                                               &conf->ioprio_level))
+                                goto out;
+                        break;
+                case GFDB_OPT_SCHED_IDLE:
+                        conf->sched_idle = _true;
+                        break;
+                case 'h':
+                default:
+                        goto out;
+                }
+        }
+
+        conf->args = argv + optind;
+        conf->arg_count = argc - optind;
+
+        if (conf->sample_count && (conf->follow || conf->attach_socket_path ||
+                                   conf->gfdb_path)) {
+                LOG_IT (log_error, "--sample needs a complete query file, "
+                        "it excludes --follow, --attach and --gfdb");
+                goto out;
+        }
+        if (conf->brick_path && conf->mode != GFDB_READER_MODE_WRITE) {
+                LOG_IT (log_error, "--check-brick writes the live records "
+                        "with -w <path>");
+                goto out;
+        }
+        if (conf->output_format != GFDB_OUTPUT_FORMAT_TEXT &&
+            conf->mode != GFDB_READER_MODE_DUMP &&
+            conf->mode != GFDB_READER_MODE_INDEX_LOOKUP) {
+                LOG_IT (log_error, "--format only applies to the dump and "
+                        "--index-lookup modes");
+                goto out;
+        }
+        if (conf->by_pgfid && conf->mode != GFDB_READER_MODE_INDEX_LOOKUP) {
+                LOG_IT (log_error, "--by-pgfid needs --index-lookup");
+                goto out;
+        }
+        if ((conf->mode == GFDB_READER_MODE_INDEX_BUILD ||
+             conf->mode == GFDB_READER_MODE_INDEX_LOOKUP) &&
+            (conf->follow || conf->attach_socket_path || conf->gfdb_path ||
+             conf->sample_count)) {
+                LOG_IT (log_error, "The index works on a complete query "
+                        "file, it excludes --follow, --attach, --gfdb and "
+                        "--sample");
+                goto out;
+        }
+        if (conf->resume && !conf->checkpoint_path) {
+                LOG_IT (log_error, "--resume needs --checkpoint <path>");
+                goto out;
+        }
+        if (conf->checkpoint_path &&
+            ((conf->mode != GFDB_READER_MODE_DUMP &&
+              conf->mode != GFDB_READER_MODE_WRITE) || conf->brick_path ||
+             conf->write_version != 1 || conf->follow ||
+             conf->attach_socket_path || conf->gfdb_path ||
+             conf->sample_count)) {
+                LOG_IT (log_error, "--checkpoint works with the dump and "
+                        "-w (version 1) modes reading a whole query file");
+                goto out;
+        }
+        if (!seed_set)
+                conf->sample_seed = (uint64_t)time (NULL) ^
+                                    ((uint64_t)getpid () << 32);
+
+        if (conf->adaptive_depth &&
+            (conf->mode == GFDB_READER_MODE_BLOOM_BUILD ||
+             conf->mode == GFDB_READER_MODE_BLOOM_CHECK ||
+             conf->attach_socket_path || conf->gfdb_path)) {
+                LOG_IT (log_error, "--adaptive watches the device of the "
+                        "query file, it excludes --bloom-build, "
+                        "--bloom-check, --attach and --gfdb");
+                goto out;
+        }
+
+        /* Bloom filters work on their own list of arguments */
+        if (conf->mode == GFDB_READER_MODE_BLOOM_BUILD ||
+            conf->mode == GFDB_READER_MODE_BLOOM_CHECK) {
+                if (conf->mode == GFDB_READER_MODE_BLOOM_BUILD &&
+                    conf->arg_count < 1)
+                        goto out;
+                ret = 0;
+                goto out;
+        }
+
+        /* The lookup takes the query file, then the keys */
+        if (conf->mode == GFDB_READER_MODE_INDEX_LOOKUP) {
+                if (conf->arg_count < 1)
+                        goto out;
+                conf->query_file_path = conf->args[0];
+                conf->args++;
+                conf->arg_count--;
+                ret = 0;
+                goto out;
+        }
+
+        if (conf->query_type != GFDB_QUERY_ALL && !conf->gfdb_path) {
+                LOG_IT (log_error, "--changed-within and --unchanged-for "
+                        "require --gfdb");
+                goto out;
+        }
+
+        /* An attached worker or a gfdb reader has no query file to read */
+        if (conf->attach_socket_path || conf->gfdb_path) {
+                if (optind != argc || conf->follow) {
+                        LOG_IT (log_error, "--attach and --gfdb take no "
+                                "query file and exclude --follow");
+                        goto out;
+                }
+                if (conf->attach_socket_path &&
+                    (conf->gfdb_path || conf->mode == GFDB_READER_MODE_SERVE)) {
+                        LOG_IT (log_error, "--attach excludes --gfdb and "
+                                "--serve");
+                        goto out;
+                }
+                ret = 0;
+                goto out;
+        }
+
+        if (optind != argc - 1)
+                goto out;
+
+        if (conf->done_marker_path && !conf->follow) {
+                LOG_IT (log_error, "--done-marker requires --follow");
+                goto out;
+        }
+
+        conf->query_file_path = argv[optind];
+
+        ret = 0;
+out:
+        return ret;
+}
+
+
+/* Prints a query record along with its links */
+static int
+gfdb_print_query_record (gfdb_query_record_t *query_record, void *data)
+{
+        char uuid_str[100]                      ="";
+        gfdb_link_info_t *link_info             = NULL;
+
+        gf_uuid_unparse (query_record->gfid, uuid_str);
+        printf("GFID : %s\n", uuid_str);
+
+        list_for_each_entry (link_info, &query_record->link_list,
+                            list) {
+                
+                gf_uuid_unparse (link_info->pargfid, uuid_str);
+                printf("%sPGFID : %s, BASE_NAME: %s \n", STR_TAB,
+                        uuid_str, link_info->file_name);
+        }
+
+        return 0;
+}
+
+
+/* Callback printing records in the --format asked for */
+static void
+gfdb_output_cbk (const gfdb_reader_conf_t *conf, gfdb_emitter_t *emitter,
+                 gfdb_query_record_cbk_t *cbk, void **cbk_data)
+{
+        *cbk = gfdb_emitter_cbk (conf->output_format);
+        *cbk_data = emitter;
+        if (!*cbk) {
+                *cbk = gfdb_print_query_record;
+                *cbk_data = NULL;
+        }
+}
+
+
+/* Prints every record of the query file along with its links, in the
+ * --format asked for */
+int
+gfdb_dump_query_file (int query_fd, const gfdb_reader_conf_t *conf)
+{
+        int ret                                 = -1;
+        gfdb_checkpoint_state_t state           = {0};
+        gfdb_emitter_t emitter                  = {0};
+        gfdb_query_record_cbk_t cbk             = NULL;
+        void *cbk_data                          = NULL;
+
+        gfdb_output_cbk (conf, &emitter, &cbk, &cbk_data);
+
+        if (!conf->checkpoint_path) {
+                ret = gfdb_process_query_file (query_fd, conf, cbk,
+                                               cbk_data);
+                goto out;
+        }
+
+        if (gfdb_checkpoint_resume (query_fd, conf, &state) ||
+            gfdb_stdout_resume (&state))
+                goto out;
+
+        ret = gfdb_checkpoint_process (query_fd, conf, &state, cbk,
+                                       cbk_data, gfdb_stdout_sync, NULL);
+out:
+        gfdb_emitter_cleanup (&emitter);
+        return ret;
+}
+
+
+/* Prints the records of the query file matching the keys */
+int
+gfdb_index_lookup_query_file (int query_fd, const gfdb_reader_conf_t *conf)
+{
+        int ret                                 = -1;
+        gfdb_emitter_t emitter                  = {0};
+        gfdb_query_record_cbk_t cbk             = NULL;
+        void *cbk_data                          = NULL;
+
+        gfdb_output_cbk (conf, &emitter, &cbk, &cbk_data);
+        ret = gfdb_index_lookup (query_fd, conf, cbk, cbk_data);
+        gfdb_emitter_cleanup (&emitter);
+        return ret;
+}
+
+
+static int
+gfdb_write_query_record_cbk (gfdb_query_record_t *query_record, void *data)
+{
+        return gfdb_write_query_record (data, query_record);
+}
+
+
+/* Writes every record to a new query file, or with --check-brick every
+ * record still live on the brick */
+int
+gfdb_write_query_file (int query_fd, const gfdb_reader_conf_t *conf)
+{
+        int ret                                 = -1;
+        gfdb_query_file_writer_t writer         = {0};
+        gfdb_checkpoint_state_t state           = {0};
+
+        /* Resuming appends to what was written up to the checkpoint */
+        if (conf->checkpoint_path) {
+                if (gfdb_checkpoint_resume (query_fd, conf, &state) ||
+                    gfdb_query_file_writer_reopen (&writer,
+                                        conf->write_query_file_path,
+                                        state.output_offset))
+                        goto out;
+        } else if (gfdb_query_file_writer_open (&writer,
+                                                conf->write_query_file_path,
+                                                conf->write_version)) {
+                goto out;
+        }
+
+        if (conf->checkpoint_path)
+                ret = gfdb_checkpoint_process (query_fd, conf, &state,
+                                        gfdb_write_query_record_cbk, &writer,
+                                        gfdb_query_file_writer_sync, &writer);
+        else if (conf->brick_path)
+                ret = gfdb_check_brick_query_file (query_fd, conf, &writer);
+        else
+                ret = gfdb_process_query_file (query_fd, conf,
+                                               gfdb_write_query_record_cbk,
+                                               &writer);
+
+        if (gfdb_query_file_writer_close (&writer))
+                ret = -1;
+out:
+        return ret;
+}
+
+
+int
+main ( int argc, char *argv[] ) {
+
+        int ret                                 = -1;
+        struct stat stat_buff                   = {0};
+        gfdb_reader_conf_t conf                 = {0};
+        char *query_file_path                   = NULL;
+        int query_fd                            = -1;
+
+        if (gfdb_parse_options (argc, argv, &conf)) {
+                usage();
+                goto out;
+        }
+
+        /* Before any thread is started */
+        if (gfdb_throttle_set_priority (conf.ioprio_class, conf.ioprio_level,
+                                        conf.sched_idle))
+                goto out;
+        gfdb_throttle_set_rates (conf.max_read_rate, conf.max_record_rate);
+
+        switch (conf.mode) {
+        case GFDB_READER_MODE_BLOOM_BUILD:
+                ret = gfdb_bloom_build (conf.bloom_path, conf.bloom_fpr,
+                                        conf.args, conf.arg_count);
+                goto out;
+        case GFDB_READER_MODE_BLOOM_CHECK:
+                ret = gfdb_bloom_check (conf.bloom_path, conf.args,
+                                        conf.arg_count);
+                goto out;
+        default:
+                break;
+        }
+
+	query_file_path = conf.query_file_path;
+
+        if (!query_file_path)
+                goto process;
+
+        ret = stat (query_file_path, &stat_buff);
+        if (ret) {
+                LOG_IT (log_error, "%s query file doesnt exist : %s",
+                          query_file_path, strerror (errno));
+                goto out;
+        }
+
+        query_fd = open (query_file_path, O_RDONLY);
+        if (query_fd < 0) {
+                LOG_IT (log_error, "Failed to open %s", query_file_path);
+                ret = -1;
+                goto out;
+        }
+
+        if (conf.adaptive_depth &&
+            gfdb_throttle_watch_device (query_fd, conf.adaptive_depth)) {
+                ret = -1;
+                goto out;
+        }
+
+process:
+        switch (conf.mode) {
+        case GFDB_READER_MODE_SERVE:
+                ret = gfdb_serve_query_file (query_fd, &conf);
+                break;
+        case GFDB_READER_MODE_WRITE:
+                ret = gfdb_write_query_file (query_fd, &conf);
+                break;
+        case GFDB_READER_MODE_ARROW:
+                ret = gfdb_arrow_export_query_file (query_fd, &conf);
+                break;
+        case GFDB_READER_MODE_GROUP_BY_PGFID:
+                ret = gfdb_group_query_file_by_pgfid (query_fd, &conf);
+                break;
+        case GFDB_READER_MODE_INDEX_BUILD:
+                ret = gfdb_index_build (query_fd, conf.index_path);
+                break;
+        case GFDB_READER_MODE_INDEX_LOOKUP:
+                ret = gfdb_index_lookup_query_file (query_fd, &conf);
+                break;
+        case GFDB_READER_MODE_DUMP:
+        default:
+                ret = gfdb_dump_query_file (query_fd, &conf);
+                break;
         }
 
-        ret = 0;
 out:
 
         if (query_fd!=-1) {